@@ -0,0 +1,102 @@
+// CPU time per single token eval with the graph rebuilt for every token against the graph reused within a
+// bucket of positions, on one thread, where the graph overhead is not hidden behind the matrix products
+//
+//     bench-decode-graph MODEL [N_DECODE] [N_GRAPH_BUCKET]
+#include "llama.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+
+static const int n_prompt = 8;
+
+struct decode_time {
+    double wall_us = 0; // per token
+    double cpu_us  = 0; // per token
+    std::vector<float> logits; // of the last token
+};
+
+static bool measure(llama_model * model, int n_graph_bucket, int n_decode, decode_time & result) {
+    auto params = llama_context_default_params();
+    params.n_ctx          = n_prompt + n_decode;
+    params.seed           = 1;
+    params.n_threads      = 1;
+    params.n_graph_bucket = n_graph_bucket;
+
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    if (ctx == NULL) {
+        return false;
+    }
+
+    std::vector<llama_token> tokens(n_prompt + n_decode);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        tokens[i] = 3 + (int) (i*37 % (llama_n_vocab(ctx) - 3));
+    }
+
+    bool ok = llama_eval(ctx, tokens.data(), n_prompt, 0, 1) == 0;
+
+    const auto    t_start   = std::chrono::steady_clock::now();
+    const clock_t cpu_start = clock();
+    for (int i = n_prompt; ok && i < n_prompt + n_decode; i++) {
+        ok = llama_eval(ctx, &tokens[i], 1, i, 1) == 0;
+    }
+    const double cpu  = (double) (clock() - cpu_start)/CLOCKS_PER_SEC;
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    result.wall_us = 1e6*wall/n_decode;
+    result.cpu_us  = 1e6*cpu/n_decode;
+    result.logits.assign(llama_get_logits(ctx), llama_get_logits(ctx) + llama_n_vocab(ctx));
+
+    llama_free(ctx);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MODEL [N_DECODE] [N_GRAPH_BUCKET]\n", argv[0]);
+        return 1;
+    }
+
+    const int n_decode = argc > 2 ? atoi(argv[2]) : 256;
+    const int n_bucket = argc > 3 ? atoi(argv[3]) : 32;
+
+    auto params = llama_context_default_params();
+    llama_model * model = llama_load_model_from_file(argv[1], params);
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, argv[1]);
+        return 1;
+    }
+
+    // the first context touches the weights, it is not measured
+    decode_time rebuilt;
+    decode_time reused;
+    if (!measure(model, 0, n_decode, rebuilt) || !measure(model, 0, n_decode, rebuilt) || !measure(model, n_bucket, n_decode, reused)) {
+        fprintf(stderr, "%s: the eval failed\n", __func__);
+        llama_free_model(model);
+        return 1;
+    }
+
+    // the SIMD dot products over the masked positions of the bucket add in another order, the logits are
+    // only identical without SIMD
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < rebuilt.logits.size(); i++) {
+        max_diff = std::max(max_diff, std::fabs(rebuilt.logits[i] - reused.logits[i]));
+    }
+
+    printf("%s: %d single token evals on 1 thread, microseconds per token\n", __func__, n_decode);
+    printf("%s: %-24s %10s %10s\n", __func__, "", "wall", "cpu");
+    printf("%s: %-24s %10.1f %10.1f\n", __func__, "graph rebuilt", rebuilt.wall_us, rebuilt.cpu_us);
+    printf("%s: n_graph_bucket = %-7d %10.1f %10.1f\n", __func__, n_bucket, reused.wall_us, reused.cpu_us);
+    printf("%s: %-24s %10.1f %10.1f (%.1f%%)\n", __func__, "saved", rebuilt.wall_us - reused.wall_us,
+            rebuilt.cpu_us - reused.cpu_us, 100*(1 - reused.cpu_us/rebuilt.cpu_us));
+    printf("%s: largest difference of the logits of the last token %g\n", __func__, max_diff);
+
+    llama_free_model(model);
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+// cost of the repetition penalty of the sampler for windows of 64 to 2048 tokens, against the sampling
+// without the penalty and the per-candidate std::find over the window that it replaced
+//
+//     bench-repeat-penalty MODEL [N_SAMPLES]
+#include "llama.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static const int n_ctx = 2048;
+
+// keeps the compiler from dropping the measured work
+static volatile float g_sink;
+
+static double seconds_since(std::chrono::steady_clock::time_point t_start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+}
+
+// microseconds of one greedy llama_sample() with the given repetition penalty
+static double time_sample(llama_context * ctx, const std::vector<llama_token> & window, int n_last, float penalty, int n_samples) {
+    llama_sampler_clear(ctx);
+    llama_sampler_add(ctx, { LLAMA_SAMPLER_REPEAT_PENALTY, penalty });
+    llama_sampler_add(ctx, { LLAMA_SAMPLER_TEMP,           0.0f    });
+
+    const llama_token * last_n = window.data() + window.size() - n_last;
+
+    const auto t_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_samples; i++) {
+        g_sink = (float) llama_sample(ctx, last_n, n_last);
+    }
+    const double t = seconds_since(t_start);
+
+    return 1e6*t/n_samples;
+}
+
+// microseconds of the penalty as every candidate looking itself up in the window
+static double time_naive(llama_context * ctx, const std::vector<llama_token> & window, int n_last, float penalty, int n_samples) {
+    const int n_vocab = llama_n_vocab(ctx);
+    const float * logits = llama_get_logits(ctx);
+    const llama_token * last_n = window.data() + window.size() - n_last;
+
+    std::vector<float> scores(n_vocab);
+
+    const auto t_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_samples; i++) {
+        for (int id = 0; id < n_vocab; id++) {
+            float logit = logits[id];
+            if (std::find(last_n, last_n + n_last, id) != last_n + n_last) {
+                logit = logit < 0.0f ? logit*penalty : logit/penalty;
+            }
+            scores[id] = logit;
+        }
+        g_sink = scores[i % n_vocab];
+    }
+    const double t = seconds_since(t_start);
+
+    return 1e6*t/n_samples;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MODEL [N_SAMPLES]\n", argv[0]);
+        return 1;
+    }
+
+    const int n_samples = argc > 2 ? atoi(argv[2]) : 200;
+
+    auto params = llama_context_default_params();
+    params.n_ctx = n_ctx;
+    params.seed  = 1;
+
+    llama_context * ctx = llama_init_from_file(argv[1], params);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const int n_vocab = llama_n_vocab(ctx);
+
+    // the logits of one token are enough, the sampler starts from them again on every call
+    const llama_token bos = llama_token_bos();
+    if (llama_eval(ctx, &bos, 1, 0, 1) != 0) {
+        fprintf(stderr, "%s: the eval failed\n", __func__);
+        llama_free(ctx);
+        return 1;
+    }
+
+    // a text repeats some tokens, every third one of the window is one of 64 frequent tokens
+    std::vector<llama_token> window(n_ctx);
+    unsigned int rng = 1;
+    for (int i = 0; i < n_ctx; i++) {
+        rng = rng*1103515245u + 12345u;
+        window[i] = 3 + (int) ((rng >> 8) % (i % 3 == 0 ? 64 : n_vocab - 3));
+    }
+
+    const float penalty = 1.1f;
+
+    printf("%s: %d candidates, %d samples per window, microseconds per sample\n", __func__, n_vocab, n_samples);
+    printf("%s: %8s %12s %12s %12s %12s\n", __func__, "last_n", "no penalty", "penalty", "penalty cost", "std::find");
+    for (int n_last = 64; n_last <= n_ctx; n_last *= 2) {
+        const double t_base  = time_sample(ctx, window, n_last, 1.0f,    n_samples);
+        const double t_pen   = time_sample(ctx, window, n_last, penalty, n_samples);
+        const double t_naive = time_naive (ctx, window, n_last, penalty, std::max(1, n_samples/10));
+
+        printf("%s: %8d %12.1f %12.1f %12.1f %12.1f\n", __func__, n_last, t_base, t_pen, t_pen - t_base, t_naive);
+    }
+
+    llama_free(ctx);
+
+    return 0;
+}
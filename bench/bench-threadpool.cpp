@@ -0,0 +1,102 @@
+// tokens/s of the evals with the persistent compute thread pool of the context against creating the threads
+// on every llama_eval()
+//
+//     bench-threadpool MODEL [N_THREADS] [N_DECODE]
+#include "llama.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+static const int n_prompt = 32;
+static const int n_runs   = 3;
+
+struct eval_speed {
+    double prompt_tps = 0; // tokens/s of the prompt evals
+    double decode_tps = 0; // tokens/s of the single token evals
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point t_start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+}
+
+// pool_size 0 creates the threads on every eval
+static bool measure(llama_model * model, int pool_size, int n_threads, int n_decode, eval_speed & speed) {
+    auto params = llama_context_default_params();
+    params.n_ctx     = n_prompt + n_decode;
+    params.seed      = 1;
+    params.n_threads = pool_size;
+
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    if (ctx == NULL) {
+        return false;
+    }
+
+    std::vector<llama_token> tokens(n_prompt + n_decode);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        tokens[i] = 3 + (int) (i*37 % (llama_n_vocab(ctx) - 3));
+    }
+
+    // the first eval touches the buffers and the weights, it is not measured
+    bool ok = llama_eval(ctx, tokens.data(), n_prompt, 0, n_threads) == 0;
+
+    double t_prompt = 1e30;
+    double t_decode = 1e30;
+    for (int run = 0; ok && run < n_runs; run++) {
+        auto t_start = std::chrono::steady_clock::now();
+        ok = llama_eval(ctx, tokens.data(), n_prompt, 0, n_threads) == 0;
+        t_prompt = std::min(t_prompt, seconds_since(t_start));
+
+        t_start = std::chrono::steady_clock::now();
+        for (int i = n_prompt; ok && i < n_prompt + n_decode; i++) {
+            ok = llama_eval(ctx, &tokens[i], 1, i, n_threads) == 0;
+        }
+        t_decode = std::min(t_decode, seconds_since(t_start));
+    }
+
+    llama_free(ctx);
+
+    speed.prompt_tps = n_prompt/t_prompt;
+    speed.decode_tps = n_decode/t_decode;
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MODEL [N_THREADS] [N_DECODE]\n", argv[0]);
+        return 1;
+    }
+
+    // a context without a pool evaluates with at most hardware_concurrency() threads
+    const int n_hw      = std::max(1, (int) std::thread::hardware_concurrency());
+    const int n_threads = std::min(argc > 2 ? atoi(argv[2]) : n_hw, n_hw);
+    const int n_decode  = argc > 3 ? atoi(argv[3]) : 64;
+
+    auto params = llama_context_default_params();
+    llama_model * model = llama_load_model_from_file(argv[1], params);
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, argv[1]);
+        return 1;
+    }
+
+    eval_speed pool;
+    eval_speed spawn;
+    if (!measure(model, n_threads, n_threads, n_decode, pool) || !measure(model, 0, n_threads, n_decode, spawn)) {
+        fprintf(stderr, "%s: the eval failed\n", __func__);
+        llama_free_model(model);
+        return 1;
+    }
+
+    printf("%s: %d threads, best of %d runs of a %d token prompt and %d single token evals\n", __func__, n_threads, n_runs, n_prompt, n_decode);
+    printf("%s: %-16s %12s %12s\n", __func__, "", "prompt t/s", "decode t/s");
+    printf("%s: %-16s %12.2f %12.2f\n", __func__, "thread pool", pool.prompt_tps, pool.decode_tps);
+    printf("%s: %-16s %12.2f %12.2f\n", __func__, "spawn per eval", spawn.prompt_tps, spawn.decode_tps);
+    printf("%s: %-16s %11.1f%% %11.1f%%\n", __func__, "pool speedup", 100*(pool.prompt_tps/spawn.prompt_tps - 1), 100*(pool.decode_tps/spawn.decode_tps - 1));
+
+    llama_free_model(model);
+
+    return 0;
+}
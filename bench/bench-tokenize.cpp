@@ -0,0 +1,100 @@
+// throughput of llama_tokenize() on MB-scale pasted documents and on many chat-sized messages
+//
+//     bench-tokenize MODEL [MB]
+#include "llama.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static const int    n_runs       = 3;
+static const size_t message_size = 256;
+static const int    n_messages   = 4096;
+
+// prose, code and CJK text, the mix of the documents pasted into a chat
+static std::string make_document(size_t size) {
+    static const char * lines[] = {
+        "The quick brown fox jumps over the lazy dog, and then it runs back into the forest.\n",
+        "In 1969, the first humans landed on the Moon; the mission lasted eight days.\n",
+        "    for (int i = 0; i < n; i++) {\n        sum += values[i]*weights[i];\n    }\n",
+        "def tokenize(text):\n    return [vocab[w] for w in text.split() if w in vocab]\n",
+        "今天天气很好，我们一起去公园散步吧。这个模型可以用中文回答问题。\n",
+        "日本語のテキストもトークン化されます。\n",
+        "Ünïcödé wörds, naïve café — “quoted” text… 😀\n",
+        "\n",
+    };
+    const int n_lines = sizeof(lines)/sizeof(lines[0]);
+
+    std::string text;
+    text.reserve(size + 256);
+    srand(1);
+    while (text.size() < size) {
+        text += lines[rand() % n_lines];
+    }
+    return text;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t_start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MODEL [MB]\n", argv[0]);
+        return 1;
+    }
+
+    const size_t doc_size = (size_t) (argc > 2 ? atof(argv[2]) : 4.0)*1024*1024;
+
+    auto params = llama_context_default_params();
+    params.vocab_only = true;
+
+    llama_context * ctx = llama_init_from_file(argv[1], params);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const std::string doc = make_document(doc_size);
+    std::vector<llama_token> tokens(doc.size() + 1);
+
+    // the first call grows the scratch buffers of the tokenizer, the next ones reuse them
+    auto t_start = std::chrono::steady_clock::now();
+    const int n_tokens = llama_tokenize(ctx, doc.c_str(), tokens.data(), tokens.size(), true);
+    const double t_cold = seconds_since(t_start);
+
+    double t_warm = 1e30;
+    for (int run = 0; run < n_runs; run++) {
+        t_start = std::chrono::steady_clock::now();
+        llama_tokenize(ctx, doc.c_str(), tokens.data(), tokens.size(), true);
+        t_warm = std::min(t_warm, seconds_since(t_start));
+    }
+
+    const double mb = doc.size()/(1024.0*1024.0);
+    printf("%s: document of %.1f MB, %d tokens\n", __func__, mb, n_tokens);
+    printf("%s: first call  %8.1f ms, %7.2f MB/s, %10.0f tokens/s\n", __func__, 1e3*t_cold, mb/t_cold, n_tokens/t_cold);
+    printf("%s: next calls  %8.1f ms, %7.2f MB/s, %10.0f tokens/s\n", __func__, 1e3*t_warm, mb/t_warm, n_tokens/t_warm);
+
+    // every message of a chat is a separate call, its cost is dominated by the per-call setup
+    std::vector<std::string> messages;
+    for (int i = 0; i < n_messages; i++) {
+        messages.push_back(doc.substr((i*7919*message_size) % (doc.size() - message_size), message_size));
+    }
+
+    int n_message_tokens = 0;
+    t_start = std::chrono::steady_clock::now();
+    for (const auto & message : messages) {
+        n_message_tokens += llama_tokenize(ctx, message.c_str(), tokens.data(), tokens.size(), false);
+    }
+    const double t_messages = seconds_since(t_start);
+
+    printf("%s: %d messages of %zu bytes, %.1f ms, %.0f messages/s, %.0f tokens/s\n", __func__,
+            n_messages, message_size, 1e3*t_messages, n_messages/t_messages, n_message_tokens/t_messages);
+
+    llama_free(ctx);
+
+    return 0;
+}
@@ -1,129 +1,506 @@
 #include "common.h"
+#include <QByteArray>
+#include <QDataStream>
+#include <QMutex>
+#include <QMutexLocker>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
 
-inline std::vector<llama_token> llama_tokenize(llama_context *ctx, const QString &text, bool add_bos)
+// KV cache snapshots of evaluated prompts, shared by every session of the process
+// so a model reload or a new session with the same prompt skips the prompt eval
+typedef struct _kv_prefix{
+    QString model;
+    int32_t n_ctx = 0;
+    bool memory_f16 = true;
+    int32_t kv_type = LLAMA_KV_TYPE_DEFAULT;
+    bool v_trans = true;
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> kv;
+}kv_prefix_t;
+
+static QMutex kv_prefix_mutex;
+static std::unordered_map<uint64_t, kv_prefix_t> kv_prefix_cache;
+
+inline std::vector<llama_token> llama_tokenize_utf8(llama_context *ctx, const std::string &text_, bool add_bos, int n_threads = 1)
 {
-    std::string text_ = text.toStdString();
     // initialize to prompt numer of chars, since n_tokens <= n_prompt_chars
     std::vector<llama_token> res(text_.size() + (int)add_bos);
-    int n = llama_tokenize(ctx, text_.c_str(), res.data(), res.size(), add_bos);
+    int n = llama_tokenize_parallel(ctx, text_.c_str(), res.data(), res.size(), add_bos, n_threads);
     assert(n >= 0);
     res.resize(n);
 
     return res;
 }
 
-bool load_model(session_env_t *env, const gpt_params &params, llama_progress_callback progress_callback,void *progress_callback_user_data)
+inline std::vector<llama_token> llama_tokenize(llama_context *ctx, const QString &text, bool add_bos, int n_threads = 1)
+{
+    return llama_tokenize_utf8(ctx, text.toStdString(), add_bos, n_threads);
+}
+
+inline void init_sampler(session_env_t *env)
+{
+    const env_configs_t &configs = env->configs;
+    llama_sampler_clear(env->ctx);
+    llama_sampler_add(env->ctx, {LLAMA_SAMPLER_TEMP, configs.temp});
+    llama_sampler_add(env->ctx, {LLAMA_SAMPLER_REPEAT_PENALTY, configs.repeat_penalty});
+    llama_sampler_add(env->ctx, {LLAMA_SAMPLER_TOP_K, (float)configs.top_k});
+    llama_sampler_add(env->ctx, {LLAMA_SAMPLER_TYPICAL, configs.typical_p});
+    llama_sampler_add(env->ctx, {LLAMA_SAMPLER_TOP_P, configs.top_p});
+    llama_sampler_add(env->ctx, {LLAMA_SAMPLER_MIN_P, configs.min_p});
+}
+
+inline llama_context_params context_params(const gpt_params &params)
 {
-    env->configs.init(params);
-    std::string model = params.model.toStdString();
     auto lparams = llama_context_default_params();
     lparams.seed = params.seed;
+    lparams.n_threads = std::max(params.n_threads, std::max(params.n_threads_prompt, params.n_threads_decode));
     lparams.n_ctx = params.n_ctx;
     lparams.f16_kv = params.memory_f16;
+    lparams.kv_type = (llama_kv_type)params.kv_type;
+    lparams.flash_attn = params.flash_attn;
+    lparams.v_trans = params.v_trans;
     lparams.use_mlock = params.use_mlock;
+    if(params.n_batch > 0)
+        lparams.n_batch = params.n_batch;
+    lparams.n_graph_bucket = params.n_graph_bucket;
+    return lparams;
+}
+
+bool load_model(model_env_t *env, const gpt_params &params, llama_progress_callback progress_callback,void *progress_callback_user_data)
+{
+    env->params = params;
+    std::string model = params.model.toStdString();
+    auto lparams = context_params(params);
     lparams.progress_callback=progress_callback;
     lparams.progress_callback_user_data=progress_callback_user_data;
-    env->ctx = llama_init_from_file(model.c_str(),lparams);
+    llama_numa_init((llama_numa_strategy)params.numa);
+    env->model = llama_load_model_from_file(model.c_str(),lparams);
+    return env->model != nullptr;
+}
+
+// prompt evals are bound by the compute and scale with the cores, single token evals are bound by the
+// memory bandwidth and often run best with fewer threads
+static const int calibrate_prompt_tokens = 32;
+static const int calibrate_decode_runs = 3;
+
+inline int64_t time_eval(llama_context *ctx, const std::vector<llama_token> &tokens, int n_past, int n_threads)
+{
+    const auto t_start = std::chrono::steady_clock::now();
+    if(llama_eval(ctx, tokens.data(), tokens.size(), n_past, n_threads))
+        return -1;
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_start).count();
+}
+
+// time the evals with 1, 2, 4, ... threads up to n_threads on the KV cache of a session that is not in use yet
+inline void calibrate_threads(gpt_params &params, llama_context *ctx)
+{
+    const int n_max = std::max(1, params.n_threads);
+    std::vector<int> candidates;
+    for(int n=1;n<n_max;n*=2)
+        candidates.push_back(n);
+    candidates.push_back(n_max);
+
+    // the compute buffers of the context may take fewer tokens than calibrate_prompt_tokens
+    const int n_prompt_tokens = std::max(1, std::min(calibrate_prompt_tokens, (int)llama_max_batch(ctx, 0)));
+    const std::vector<llama_token> prompt(n_prompt_tokens, llama_token_bos());
+    const std::vector<llama_token> token(1, llama_token_bos());
+
+    // the first eval touches the buffers, it is not measured
+    time_eval(ctx, prompt, 0, n_max);
+
+    int64_t t_prompt_best = -1, t_decode_best = -1;
+    int n_prompt = n_max, n_decode = n_max;
+    for(int n : candidates)
+    {
+        if(params.n_threads_prompt <= 0)
+        {
+            const int64_t t = time_eval(ctx, prompt, 0, n);
+            if(t >= 0 && (t_prompt_best < 0 || t < t_prompt_best))
+            {
+                t_prompt_best = t;
+                n_prompt = n;
+            }
+        }
+        if(params.n_threads_decode <= 0)
+        {
+            for(int i=0;i<calibrate_decode_runs;i++)
+            {
+                const int64_t t = time_eval(ctx, token, n_prompt_tokens + i, n);
+                if(t >= 0 && (t_decode_best < 0 || t < t_decode_best))
+                {
+                    t_decode_best = t;
+                    n_decode = n;
+                }
+            }
+        }
+    }
+    if(params.n_threads_prompt <= 0)
+    {
+        params.n_threads_prompt = n_prompt;
+        if(t_prompt_best < 0)
+            fprintf(stderr, "%s: no prompt eval could be timed, %d threads for the prompt evals\n", __func__, n_prompt);
+        else
+            fprintf(stderr, "%s: %d threads for the prompt evals\n", __func__, n_prompt);
+    }
+    if(params.n_threads_decode <= 0)
+    {
+        params.n_threads_decode = n_decode;
+        if(t_decode_best < 0)
+            fprintf(stderr, "%s: no single token eval could be timed, %d threads for the single token evals\n", __func__, n_decode);
+        else
+            fprintf(stderr, "%s: %d threads for the single token evals\n", __func__, n_decode);
+    }
+
+    // the batch size picked for the prompt evals relies on the timings of the real ones
+    llama_reset_timings(ctx);
+}
+
+bool new_session(session_env_t *env, model_env_t *model_env, llama_abort_callback abort_callback, void *abort_callback_user_data)
+{
+    env->ctx = llama_new_context_with_model(model_env->model,context_params(model_env->params));
     if(env->ctx)
+    {
+        // measured once per model, the later sessions reuse the counts
+        if(model_env->params.n_threads_prompt <= 0 || model_env->params.n_threads_decode <= 0)
+            calibrate_threads(model_env->params, env->ctx);
+        env->configs.init(model_env->params);
+        llama_set_abort_callback(env->ctx, abort_callback, abort_callback_user_data);
+        init_sampler(env);
         return true;
+    }
     return false;
 }
 
-void unload_model(session_env_t *env)
+// FNV-1a over the model path, the cache layout and the prompt tokens
+inline uint64_t hash_prefix(const env_configs_t &configs, const std::vector<llama_token> &tokens)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto feed = [&hash](const void *data, size_t size){
+        const uint8_t *bytes = (const uint8_t *)data;
+        for(size_t i=0;i<size;i++)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ULL;
+        }
+    };
+    const QByteArray model = configs.model.toUtf8();
+    feed(model.constData(), model.size());
+    feed(&configs.n_ctx, sizeof(configs.n_ctx));
+    feed(&configs.memory_f16, sizeof(configs.memory_f16));
+    feed(&configs.kv_type, sizeof(configs.kv_type));
+    feed(&configs.v_trans, sizeof(configs.v_trans));
+    feed(tokens.data(), tokens.size()*sizeof(llama_token));
+    return hash;
+}
+
+inline bool restore_prefix(session_env_t *env, const std::vector<llama_token> &tokens)
 {
-    llama_free(env->ctx);
+    const env_configs_t &configs = env->configs;
+    QMutexLocker locker(&kv_prefix_mutex);
+    auto it = kv_prefix_cache.find(hash_prefix(configs, tokens));
+    if(it == kv_prefix_cache.end())
+        return false;
+    const kv_prefix_t &prefix = it->second;
+    // guard against hash collisions
+    if(prefix.model != configs.model || prefix.n_ctx != configs.n_ctx ||
+       prefix.memory_f16 != configs.memory_f16 || prefix.kv_type != configs.kv_type ||
+       prefix.v_trans != configs.v_trans || prefix.tokens != tokens ||
+       prefix.kv.size() != llama_get_kv_cache_size(env->ctx, (int)tokens.size()))
+        return false;
+    llama_set_kv_cache(env->ctx, prefix.kv.data(), (int)tokens.size());
+    env->state.n_past = (int32_t)tokens.size();
+    return true;
+}
+
+inline void save_prefix(session_env_t *env, const std::vector<llama_token> &tokens)
+{
+    kv_prefix_t prefix;
+    prefix.model = env->configs.model;
+    prefix.n_ctx = env->configs.n_ctx;
+    prefix.memory_f16 = env->configs.memory_f16;
+    prefix.kv_type = env->configs.kv_type;
+    prefix.v_trans = env->configs.v_trans;
+    prefix.tokens = tokens;
+    prefix.kv.resize(llama_get_kv_cache_size(env->ctx, (int)tokens.size()));
+    llama_copy_kv_cache(env->ctx, prefix.kv.data(), (int)tokens.size());
+
+    QMutexLocker locker(&kv_prefix_mutex);
+    kv_prefix_cache[hash_prefix(env->configs, tokens)] = std::move(prefix);
+}
+
+inline void write_tokens(QDataStream &out, const std::vector<llama_token> &tokens)
+{
+    out << (qint32)tokens.size();
+    for(llama_token id : tokens)
+        out << (qint32)id;
+}
+
+inline void read_tokens(QDataStream &in, std::vector<llama_token> &tokens)
+{
+    qint32 size = 0;
+    in >> size;
+    tokens.clear();
+    for(qint32 i=0;i<size && in.status()==QDataStream::Ok;i++)
+    {
+        qint32 id = 0;
+        in >> id;
+        tokens.push_back(id);
+    }
 }
 
+void free_session(session_env_t *env)
+{
+    if(env->ctx)
+    {
+        llama_free(env->ctx);
+        env->ctx = nullptr;
+    }
+}
+
+void unload_model(model_env_t *env)
+{
+    if(env->model)
+    {
+        llama_free_model(env->model);
+        env->model = nullptr;
+    }
+}
+
+// the tokens left pending by a failed or aborted eval count toward n_batch
 inline void consume_tokens(session_env_t *env, int32_t n_batch)
 {
-    for(int i=0;i< n_batch; i++)
+    const int32_t n_pending = (int32_t)env->embedding_queue.get_embd_output().size();
+    for(int i=n_pending;i< n_batch; i++)
     {
         env->embedding_queue.input_consume();
     }
 }
 
-inline void process_output_embd(session_env_t *env)
+// prompt tokens of one eval when n_batch is 0: as many as the buffers and the KV cache take, but a step
+// should stay short since it also delays the sessions generating alongside
+static const int32_t auto_batch_min = 32;
+static const double auto_batch_step_ms = 1000.0;
+
+inline int32_t prompt_batch_size(session_env_t *env)
+{
+    // the compute buffers of the context fit llama_max_batch(ctx, 0) tokens at most
+    if(env->configs.n_batch > 0)
+        return std::min(env->configs.n_batch, (int32_t)llama_max_batch(env->ctx, 0));
+    // the tokens must fit in the KV cache after a context shift
+    const int32_t n_ctx_max = (llama_n_ctx(env->ctx) - env->keep_token.get_n_keep())/2;
+    const int32_t n_max = std::max(1, std::min(n_ctx_max, (int32_t)llama_max_batch(env->ctx, env->state.n_past)));
+    int32_t n_batch = auto_batch_min;
+    const double ms_per_token = llama_get_prompt_eval_ms_per_token(env->ctx);
+    if(ms_per_token > 0)
+        n_batch = std::max(n_batch, (int32_t)(auto_batch_step_ms / ms_per_token));
+    return std::min(n_batch, n_max);
+}
+
+// make room in the KV cache for the pending tokens
+inline void shift_context(session_env_t *env)
+{
+    const int n_ctx = llama_n_ctx(env->ctx);
+
+    std::vector<llama_token>& embd = env->embedding_queue.get_embd_output();
+    if (env->state.n_past + (int) embd.size() > n_ctx) {
+        const int n_keep = env->keep_token.get_n_keep();
+        const int n_left = env->state.n_past - n_keep;
+        const int n_discard = n_left - n_left/2;
+
+        // keep the prompt and the n_left/2 most recent tokens in the KV cache, no re-eval needed
+        llama_kv_cache_shift(env->ctx, n_keep, n_discard, env->state.n_past);
+        env->state.n_past -= n_discard;
+    }
+}
+
+inline bool process_output_embd(session_env_t *env)
 {
     if(!env->embedding_queue.output_is_empty())
     {
-        const int n_ctx = llama_n_ctx(env->ctx);
-
+        shift_context(env);
         std::vector<llama_token>& embd = env->embedding_queue.get_embd_output();
-        if (env->state.n_past + (int) embd.size() > n_ctx) {
-            const int n_left = env->state.n_past - env->configs.n_keep;
-
-            env->state.n_past = env->keep_token.get_n_keep();
-            // insert n_left/2 tokens at the start of embd from last_n_tokens
-            embd.insert(embd.begin(), env->last_n_tokens.get_last_n_tokens().begin() + n_ctx - n_left/2 - embd.size(), env->last_n_tokens.get_last_n_tokens().end() - embd.size());
-        }
-        if (llama_eval(env->ctx, embd.data(), embd.size(), env->state.n_past, env->configs.n_threads)) {
+        const int n_threads = embd.size() > 1 ? env->configs.n_threads_prompt : env->configs.n_threads_decode;
+        if (llama_eval(env->ctx, embd.data(), embd.size(), env->state.n_past, n_threads)) {
             fprintf(stderr, "%s : failed to eval\n", __func__);
-            return;
+            return false;
         }
         env->state.n_past += embd.size();
         embd.clear();
     }
+    return true;
+}
+
+// the pending tokens of all the sessions in a single llama_eval_batch(), the weights are read once per step
+// on failure the tokens of the sessions that were not evaluated stay pending
+inline bool process_output_embd(session_env_t **envs, int n_envs)
+{
+    std::vector<llama_context*> ctxs;
+    std::vector<llama_token> tokens;
+    std::vector<int> n_tokens;
+    std::vector<int> n_past;
+    int n_threads = envs[0]->configs.n_threads_decode;
+    for(int i=0;i<n_envs;i++)
+    {
+        session_env_t *env = envs[i];
+        if(env->embedding_queue.output_is_empty())
+            continue;
+        shift_context(env);
+        const std::vector<llama_token>& embd = env->embedding_queue.get_embd_output();
+        ctxs.push_back(env->ctx);
+        tokens.insert(tokens.end(), embd.begin(), embd.end());
+        n_tokens.push_back((int)embd.size());
+        n_past.push_back(env->state.n_past);
+        // a batch with a prompt in it is bound by the compute like a prompt eval
+        if(embd.size() > 1)
+            n_threads = env->configs.n_threads_prompt;
+    }
+    if(ctxs.empty())
+        return true;
+    const bool success = llama_eval_batch(ctxs.data(), tokens.data(), n_tokens.data(), n_past.data(), (int)ctxs.size(), n_threads) == 0;
+    if (!success) {
+        fprintf(stderr, "%s : failed to eval\n", __func__);
+    }
+    // an abort stops the group of the session that asked for it, the other groups are evaluated
+    for(int i=0;i<n_envs;i++)
+    {
+        session_env_t *env = envs[i];
+        std::vector<llama_token>& embd = env->embedding_queue.get_embd_output();
+        if(embd.empty() || !llama_batch_evaluated(env->ctx))
+            continue;
+        env->state.n_past += embd.size();
+        embd.clear();
+    }
+    return success;
 }
 #include <QDebug>
 void init_user_input(session_env_t *env, const QString &msg)
 {
     env->state.n_remain = env->configs.n_predict;
-    env->state.n_remain -= env->embedding_queue.input_produce(env->instruction_info, msg);
+    // the tokens of the message are taken off n_remain as the chunks are tokenized
+    env->embedding_queue.input_produce(env->instruction_info, msg);
+}
+
+void drop_user_input(session_env_t *env)
+{
+    env->embedding_queue.drop();
+    env->state.n_remain = 0;
+    env->utf8_assembler.flush();
+}
+
+inline void sample_token(session_env_t *env)
+{
+    const int32_t repeat_last_n  = env->configs.repeat_last_n;
+    const int n_ctx = env->last_n_tokens.size();
+    llama_token id = 0;
+    {
+        id = llama_sample(env->ctx,
+                env->last_n_tokens.data() + n_ctx - repeat_last_n,
+                repeat_last_n);
+
+        env->last_n_tokens.push(id);
+    }
+    env->utf8_assembler.append(llama_token_to_str(env->ctx, id));
+    std::vector<llama_token>& embd = env->embedding_queue.get_embd_output();
+    embd.push_back(id);
+    if(embd.back() == llama_token_eos())
+    {
+        env->state.n_remain = 0;
+    }
+    else
+    {
+        env->state.n_remain--;
+    }
+    if(!env->state.can_reamain())
+    {
+        env->utf8_assembler.flush();
+    }
 }
 
 QString generate_token(session_env_t *env)
 {
     QString result = "";
-    if(env->state.can_reamain())
-    {
-        if(!env->embedding_queue.input_is_empty())
-        {
-            consume_tokens(env,env->configs.n_batch);
-        }
-        process_output_embd(env);
-        const int32_t top_k          = env->configs.top_k;
-        const float   top_p          = env->configs.top_p;
-        const float   temp           = env->configs.temp;
-        const float   repeat_penalty = env->configs.repeat_penalty;
-        const int32_t repeat_last_n  = env->configs.repeat_last_n;
-        const int n_ctx = llama_n_ctx(env->ctx);
-        llama_token id = 0;
-        {
-            id = llama_sample_top_p_top_k(env->ctx,
-                    env->last_n_tokens.get_last_n_tokens().data() + n_ctx - repeat_last_n,
-                    repeat_last_n, top_k, top_p, temp, repeat_penalty);
+    if(generate_tokens(&env, 1))
+        take_output(env, result);
+    return result;
+}
 
-            env->last_n_tokens.push(id);
-        }
-        result = QString(llama_token_to_str(env->ctx, id));
-        std::vector<llama_token>& embd = env->embedding_queue.get_embd_output();
-        embd.push_back(id);
-        if(embd.back() == llama_token_eos())
-        {
-            env->state.n_remain = 0;
-        }
-        else
+void take_output(session_env_t *env, QString &output)
+{
+    env->utf8_assembler.take(output);
+}
+
+bool generate_tokens(session_env_t **envs, int n_envs)
+{
+    std::vector<session_env_t*> active;
+    for(int i=0;i<n_envs;i++)
+    {
+        session_env_t *env = envs[i];
+        if(should_generate(env))
         {
-            env->state.n_remain--;
+            embedding_queue_t &queue = env->embedding_queue;
+            if(queue.input_is_empty() && !queue.text_is_empty())
+            {
+                env->state.n_remain -= queue.text_tokenize(env->instruction_info);
+            }
+            const int32_t n_batch = prompt_batch_size(env);
+            if(!queue.input_is_empty())
+            {
+                consume_tokens(env,n_batch);
+            }
+            // the next chunk is ready by the time the queued tokens run out
+            if(!queue.text_is_empty() && queue.input_remaining() < n_batch)
+            {
+                queue.text_tokenize_begin(env->instruction_info);
+            }
+            active.push_back(env);
         }
     }
-    return result;
+    if(active.empty())
+        return true;
+    // sample only for the sessions whose message has been evaluated to its end by this step
+    std::vector<bool> sample(n_envs);
+    for(int i=0;i<n_envs;i++)
+    {
+        sample[i] = input_progress(envs[i]) < 0 && envs[i]->state.can_reamain();
+    }
+    const bool success = process_output_embd(active.data(), (int)active.size());
+    for(size_t i=0;i<active.size();i++)
+    {
+        active[i]->state.n_remain -= active[i]->embedding_queue.text_tokenize_end();
+    }
+    if(!success)
+        return false;
+    for(int i=0;i<n_envs;i++)
+    {
+        if(sample[i])
+            sample_token(envs[i]);
+    }
+    return true;
 }
 
 bool init_chat_env(session_env_t *env)
 {
-    env->instruction_info.init(env->ctx);
+    env->instruction_info.init(env->ctx, env->configs.n_threads_prompt);
     bool success = env->keep_token.init(env->ctx,"Below is an instruction that describes a task. Write a response that appropriately completes the request.");
     if(success)
     {
         env->last_n_tokens.init(env->ctx);
         env->embedding_queue.init(env->ctx);
 
-        env->embedding_queue.input_copy(env->keep_token.get_initial_token());
-        while(!env->embedding_queue.input_is_empty())
+        const std::vector<llama_token> &initial_token = env->keep_token.get_initial_token();
+        if(!restore_prefix(env, initial_token))
         {
-            consume_tokens(env,env->configs.n_batch);
-            process_output_embd(env);
+            env->embedding_queue.input_copy(initial_token);
+            while(!env->embedding_queue.input_is_empty())
+            {
+                consume_tokens(env,prompt_batch_size(env));
+                if(!process_output_embd(env))
+                    return false;
+            }
+            save_prefix(env, initial_token);
         }
     }
     else
@@ -133,9 +510,73 @@ bool init_chat_env(session_env_t *env)
     return true;
 }
 
+// bumped when the layout of the chat state changes
+static const qint32 session_state_version = 3;
+
+bool save_session(session_env_t *env, const QString &path)
+{
+    QByteArray state;
+    {
+        QDataStream out(&state, QIODevice::WriteOnly);
+        out << session_state_version;
+        out << (qint32)env->state.n_past << (qint32)env->state.n_remain;
+        env->keep_token.save(out);
+        env->embedding_queue.save(out);
+        env->last_n_tokens.save(out);
+        env->utf8_assembler.save(out);
+    }
+    std::string path_ = path.toStdString();
+    return llama_save_session_file(env->ctx, path_.c_str(), env->state.n_past,
+                                   (const uint8_t *)state.constData(), state.size()) == 0;
+}
+
+bool load_session(session_env_t *env, const QString &path)
+{
+    std::string path_ = path.toStdString();
+    const uint8_t *user_data = nullptr;
+    size_t user_size = 0;
+    const int n_past = llama_load_session_file(env->ctx, path_.c_str(), &user_data, &user_size);
+    if(n_past < 0)
+        return false;
+
+    // the blob lives in the mapping of the session file, no copy needed
+    const QByteArray state = QByteArray::fromRawData((const char *)user_data, (int)user_size);
+    QDataStream in(state);
+    qint32 version = 0;
+    in >> version;
+    if(version != session_state_version)
+    {
+        fprintf(stderr, "%s: unsupported session state version %d\n", __func__, version);
+        return false;
+    }
+    qint32 n_past_ = 0, n_remain = 0;
+    in >> n_past_ >> n_remain;
+    env->instruction_info.init(env->ctx, env->configs.n_threads_prompt);
+    env->keep_token.load(env->ctx, in);
+    env->embedding_queue.load(env->ctx, in);
+    env->last_n_tokens.load(in);
+    env->utf8_assembler.load(in);
+    if(in.status() != QDataStream::Ok || n_past_ != n_past)
+    {
+        fprintf(stderr, "%s: corrupted session state\n", __func__);
+        return false;
+    }
+    env->state.n_past = n_past_;
+    env->state.n_remain = n_remain;
+    return true;
+}
+
 bool should_generate(session_env_t *env)
 {
-    return env->state.can_reamain();
+    // the whole message is evaluated even when it leaves nothing of n_predict for the response
+    return env->state.can_reamain() || input_progress(env) >= 0;
+}
+
+int input_progress(session_env_t *env)
+{
+    if(env->embedding_queue.input_is_empty() && env->embedding_queue.text_is_empty())
+        return -1;
+    return env->embedding_queue.text_progress();
 }
 
 bool _keep_prompt_token::init(llama_context *ctx, const QString prompt)
@@ -163,21 +604,67 @@ std::vector<llama_token> &_keep_prompt_token::get_initial_token()
     return initial_token;
 }
 
+void _keep_prompt_token::save(QDataStream &out) const
+{
+    write_tokens(out, initial_token);
+    out << (qint32)n_keep;
+}
+
+void _keep_prompt_token::load(llama_context *ctx, QDataStream &in)
+{
+    m_ctx = ctx;
+    read_tokens(in, initial_token);
+    qint32 n_keep_ = 0;
+    in >> n_keep_;
+    n_keep = n_keep_;
+}
+
 void _last_n_tokens::init(llama_context *ctx)
 {
-    const int n_ctx = llama_n_ctx(ctx);
-    last_n_tokens.resize(n_ctx);
+    capacity = llama_n_ctx(ctx);
+    head = 0;
+    ring.assign(2*capacity, 0);
 }
 
 void _last_n_tokens::push(llama_token id)
 {
-    last_n_tokens.erase(last_n_tokens.begin());
-    last_n_tokens.push_back(id);
+    // overwrite the oldest token in both halves
+    ring[head] = id;
+    ring[head + capacity] = id;
+    head = (head + 1) % capacity;
+}
+
+const llama_token *_last_n_tokens::data() const
+{
+    return ring.data() + head;
+}
+
+int32_t _last_n_tokens::size() const
+{
+    return capacity;
 }
 
-std::vector<llama_token> &_last_n_tokens::get_last_n_tokens()
+void _last_n_tokens::save(QDataStream &out) const
 {
-    return last_n_tokens;
+    // oldest token first, so the ring is restored with head at 0
+    out << (qint32)capacity;
+    for(int32_t i=0;i<capacity;i++)
+        out << (qint32)ring[head + i];
+}
+
+void _last_n_tokens::load(QDataStream &in)
+{
+    qint32 capacity_ = 0;
+    in >> capacity_;
+    capacity = capacity_;
+    head = 0;
+    ring.assign(2*capacity, 0);
+    for(int32_t i=0;i<capacity;i++)
+    {
+        qint32 id = 0;
+        in >> id;
+        ring[i] = ring[i + capacity] = id;
+    }
 }
 
 void _embedding_queue::init(llama_context *ctx)
@@ -195,15 +682,91 @@ bool _embedding_queue::input_is_empty()
     return embd_input.size() <= n_consumed;
 }
 
-int _embedding_queue::input_produce(instruction_info_t &instruction_info, const QString buffer)
+// bytes of the message tokenized at once
+static const size_t text_chunk_size = 8*1024;
+
+void _embedding_queue::input_produce(instruction_info_t &instruction_info, const QString buffer)
 {
+    // the rest of a message saved in progress goes first
+    if(!text_is_empty())
+    {
+        text_chunk_tokenize(instruction_info, text_input.size(), instruction_info.get_n_threads());
+        text_chunk_queue();
+    }
     // Clear input if its consume all token
     if(input_is_empty())
     {
         embd_input.clear();
         n_consumed = 0;
     }
-    return instruction_info.inject(buffer, embd_input);
+    text_input = buffer.toStdString();
+    n_text_consumed = 0;
+    n_text_start = (int32_t)embd_input.size();
+    text_progress_max = 0;
+    text_pending = true;
+}
+
+int32_t _embedding_queue::input_remaining()
+{
+    return (int32_t)embd_input.size() - n_consumed;
+}
+
+bool _embedding_queue::text_is_empty()
+{
+    return !text_pending;
+}
+
+// the chunk ends at a token boundary, so the tokens of the chunks are the tokens of the whole message
+void _embedding_queue::text_chunk_tokenize(instruction_info_t &instruction_info, size_t n_bytes, int n_threads)
+{
+    const size_t size = text_input.size();
+    size_t end = size;
+    if(n_bytes < size - n_text_consumed)
+        end = llama_token_boundary(m_ctx, text_input.data(), size, n_text_consumed + n_bytes);
+    text_chunk.clear();
+    n_text_chunk = instruction_info.inject(text_input.substr(n_text_consumed, end - n_text_consumed), end == size, text_chunk, n_threads);
+    n_text_chunk_end = end;
+}
+
+// the state the main thread reads is only updated here, never by text_worker
+int _embedding_queue::text_chunk_queue()
+{
+    embd_input.insert(embd_input.end(), text_chunk.begin(), text_chunk.end());
+    n_text_consumed = n_text_chunk_end;
+    text_pending = n_text_consumed < text_input.size();
+    return n_text_chunk;
+}
+
+int _embedding_queue::text_tokenize(instruction_info_t &instruction_info)
+{
+    text_chunk_tokenize(instruction_info, text_chunk_size, instruction_info.get_n_threads());
+    return text_chunk_queue();
+}
+
+void _embedding_queue::text_tokenize_begin(instruction_info_t &instruction_info)
+{
+    // a single thread, the compute threads are busy with the eval
+    text_worker = std::thread(&_embedding_queue::text_chunk_tokenize, this, std::ref(instruction_info), text_chunk_size, 1);
+}
+
+int _embedding_queue::text_tokenize_end()
+{
+    if(!text_worker.joinable())
+        return 0;
+    text_worker.join();
+    return text_chunk_queue();
+}
+
+int _embedding_queue::text_progress()
+{
+    // assumes the tokens of the message not tokenized yet are as dense as the others
+    const int32_t n_tokens = (int32_t)embd_input.size() - n_text_start;
+    const int32_t n_done = std::max(n_consumed - n_text_start, 0);
+    if(n_tokens <= 0 || text_input.empty())
+        return text_progress_max;
+    const int32_t progress = (int32_t)(100.0 * n_done / n_tokens * n_text_consumed / text_input.size());
+    text_progress_max = std::max(text_progress_max, progress);
+    return text_progress_max;
 }
 
 void _embedding_queue::input_consume()
@@ -215,6 +778,13 @@ void _embedding_queue::input_consume()
     }
 }
 
+void _embedding_queue::drop()
+{
+    embd_output.clear();
+    n_consumed = (int32_t)embd_input.size();
+    text_pending = false;
+}
+
 std::vector<llama_token> &_embedding_queue::get_embd_output()
 {
     return embd_output;
@@ -225,36 +795,135 @@ bool _embedding_queue::output_is_empty()
     return embd_output.empty();
 }
 
-void _instruction_info::init(llama_context *ctx)
+void _embedding_queue::save(QDataStream &out) const
+{
+    write_tokens(out, embd_input);
+    write_tokens(out, embd_output);
+    out << (qint32)n_consumed;
+    out << QByteArray(text_input.data() + n_text_consumed, (int)(text_input.size() - n_text_consumed)) << text_pending;
+}
+
+void _embedding_queue::load(llama_context *ctx, QDataStream &in)
+{
+    m_ctx = ctx;
+    read_tokens(in, embd_input);
+    read_tokens(in, embd_output);
+    qint32 n_consumed_ = 0;
+    in >> n_consumed_;
+    n_consumed = n_consumed_;
+    QByteArray text;
+    in >> text >> text_pending;
+    text_input.assign(text.constData(), text.size());
+    n_text_consumed = 0;
+    n_text_start = (int32_t)embd_input.size();
+}
+
+void _instruction_info::init(llama_context *ctx, int n_threads)
 {
     m_ctx = ctx;
+    m_n_threads = n_threads;
     input_prefix = ::llama_tokenize(ctx, "\n\n### Instruction:\n\n", true);
     input_suffix = ::llama_tokenize(ctx, "\n\n### Response:\n\n", false);
 }
 
-int _instruction_info::inject(const QString buffer, std::vector<llama_token> &output)
+int _instruction_info::inject(const std::string &buffer, bool last, std::vector<llama_token> &output, int n_threads)
 {
     //output.insert(output.end(), input_prefix.begin(), input_prefix.end());
-    auto line_inp = ::llama_tokenize(m_ctx, buffer, false);
+    auto line_inp = ::llama_tokenize_utf8(m_ctx, buffer, false, n_threads);
     output.insert(output.end(), line_inp.begin(), line_inp.end());
-    output.insert(output.end(), input_suffix.begin(), input_suffix.end());
+    if(last)
+        output.insert(output.end(), input_suffix.begin(), input_suffix.end());
     return line_inp.size();
 }
 
+int32_t _instruction_info::get_n_threads() const
+{
+    return m_n_threads;
+}
+
 void _env_configs::init(const gpt_params &params)
 {
     n_batch = params.n_batch;
     n_keep = params.n_keep;
     n_predict = params.n_predict;
-    n_threads = params.n_threads;
+    n_threads_prompt = params.n_threads_prompt;
+    n_threads_decode = params.n_threads_decode;
     repeat_last_n = params.repeat_last_n;
     repeat_penalty = params.repeat_penalty;
     temp = params.temp;
     top_k = params.top_k;
     top_p = params.top_p;
+    typical_p = params.typical_p;
+    min_p = params.min_p;
+    model = params.model;
+    n_ctx = params.n_ctx;
+    memory_f16 = params.memory_f16;
+    kv_type = params.kv_type;
+    v_trans = params.v_trans;
 }
 
 bool _env_state::can_reamain()
 {
     return n_remain > 0;
 }
+
+// length of the sequence started by a lead byte, 0 for a continuation byte
+inline int utf8_sequence_length(uint8_t byte)
+{
+    if(byte < 0x80)
+        return 1;
+    if((byte & 0xE0) == 0xC0)
+        return 2;
+    if((byte & 0xF0) == 0xE0)
+        return 3;
+    if((byte & 0xF8) == 0xF0)
+        return 4;
+    return 0;
+}
+
+void _utf8_assembler::append(const char *bytes)
+{
+    pending.append(bytes);
+    const size_t size = pending.size();
+    // only the last code point can be incomplete, its lead byte is at most 3 bytes from the end
+    size_t complete = size;
+    for(size_t i = size; i > 0 && size - i < 4; i--)
+    {
+        const int length = utf8_sequence_length((uint8_t)pending[i - 1]);
+        if(length == 0)
+            continue;
+        if(i - 1 + length > size)
+            complete = i - 1;
+        break;
+    }
+    text.append(pending, 0, complete);
+    pending.erase(0, complete);
+}
+
+void _utf8_assembler::flush()
+{
+    // the incomplete sequence at the end of text is converted to replacement characters
+    text.append(pending);
+    pending.clear();
+}
+
+void _utf8_assembler::take(QString &output)
+{
+    if(!text.empty())
+    {
+        output += QString::fromUtf8(text.data(), (int)text.size());
+        text.clear();
+    }
+}
+
+void _utf8_assembler::save(QDataStream &out) const
+{
+    out << QByteArray(pending.data(), (int)pending.size());
+}
+
+void _utf8_assembler::load(QDataStream &in)
+{
+    QByteArray bytes;
+    in >> bytes;
+    pending.assign(bytes.constData(), bytes.size());
+}
@@ -3,11 +3,16 @@
 
 #include <QString>
 #include <QThread>
+#include <thread>
 #include "llama/llama.h"
 
+class QDataStream;
+
 struct gpt_params{
     int32_t seed            = -1; // RNG seed
-    int32_t n_threads       = QThread::idealThreadCount()/2;
+    int32_t n_threads       = QThread::idealThreadCount(); // size of the thread pool of a session
+    int32_t n_threads_prompt = 0; // threads of the prompt evals, 0 = measured with the first session of the model
+    int32_t n_threads_decode = 0; // threads of the single token evals, 0 = measured with the first session of the model
     int32_t n_predict       = 128; // new tokens to predict
     int32_t repeat_last_n   = 64;  // last n tokens to penalize
 
@@ -16,15 +21,21 @@ struct gpt_params{
     // sampling parameters
     int32_t top_k           = 40;
     float   top_p           = 0.95f;
+    float   typical_p       = 1.00f; // 1.0 = disabled
+    float   min_p           = 0.00f; // 0.0 = disabled
     float   temp            = 0.80f;
     float   repeat_penalty  = 1.30f;
 
-    int32_t n_batch         = 8; // batch size for prompt processing
+    int32_t n_batch         = 0; // batch size for prompt processing, 0 = picked for every eval
     int32_t n_keep          = 0;
+    int32_t n_graph_bucket  = 32; // positions each reused graph of the generated tokens covers, 0 = built for every token
 
     QString model           = "models/lamma-7B/ggml-model.bin"; // model path
 
     bool memory_f16        = true;  // use f16 instead of f32 for memory kv
+    int32_t kv_type        = LLAMA_KV_TYPE_DEFAULT; // quantized memory kv, overrides memory_f16
+    bool flash_attn        = true;  // fused attention, not used with a quantized kv_type
+    bool v_trans           = true;  // cache the values transposed, not used with a quantized kv_type
     bool interactive       = false; // interactive mode
 
     bool interactive_start = false; // wait for user input immediately
@@ -33,6 +44,7 @@ struct gpt_params{
     bool ignore_eos        = false; // do not stop generating after eos
     bool perplexity        = false; // compute perplexity over the prompt
     bool use_mlock         = false; // use mlock to keep model in memory
+    int32_t numa           = LLAMA_NUMA_DISABLED; // place the weights and pin the threads by NUMA node
     bool mem_test          = false; // compute maximum memory usage
     bool verbose_prompt    = false; // print prompt tokens before generation
 };
@@ -43,6 +55,8 @@ typedef struct _keep_prompt_token{
     bool init(llama_context *ctx, const QString prompt);
     int32_t get_n_keep();
     std::vector<llama_token>& get_initial_token();
+    void save(QDataStream &out) const;
+    void load(llama_context *ctx, QDataStream &in);
 private:
     std::vector<llama_token> initial_token;
     int32_t n_keep        = 0;// number of tokens to keep when resetting context
@@ -51,39 +65,90 @@ private:
 }keep_prompt_token_t;
 
 typedef struct _instruction_info{
-    void init(llama_context *ctx);
-    int inject(const QString buffer, std::vector<llama_token> &output);
+    void init(llama_context *ctx, int n_threads);
+    // the tokens of a piece of the message, the response prefix follows the last piece
+    // returns the number of tokens of the piece
+    int inject(const std::string &buffer, bool last, std::vector<llama_token> &output, int n_threads);
+    int32_t get_n_threads() const;
 private:
     std::vector<llama_token> input_prefix; // instruction prefix
     std::vector<llama_token> input_suffix; // response prefix
 private:
     llama_context *m_ctx = nullptr;
+    int32_t m_n_threads = 1;
 }instruction_info_t;
 
 typedef struct _embedding_queue{
     void init(llama_context *ctx);
     void input_copy(const std::vector<llama_token> input);
     bool input_is_empty();
-    int input_produce(instruction_info_t &instruction_info, const QString buffer);
+    // the message is tokenized a chunk at a time, see text_tokenize_begin()
+    void input_produce(instruction_info_t &instruction_info, const QString buffer);
     void input_consume();
+    int32_t input_remaining();
+    bool text_is_empty();
+    // tokenize the next chunk of the message on the calling thread, returns the number of tokens of the message
+    int text_tokenize(instruction_info_t &instruction_info);
+    // tokenize the next chunk of the message on a worker thread, while the consumed tokens are evaluated
+    void text_tokenize_begin(instruction_info_t &instruction_info);
+    // wait for the worker and queue its tokens, returns the number of tokens of the message
+    int text_tokenize_end();
+    // percent of the message consumed
+    int text_progress();
+    // the rest of the message and the tokens not evaluated yet are dropped
+    void drop();
     std::vector<llama_token>& get_embd_output();
     bool output_is_empty();
+    void save(QDataStream &out) const;
+    void load(llama_context *ctx, QDataStream &in);
 private:
     std::vector<llama_token> embd_input; // sentence embedding storage
     std::vector<llama_token> embd_output; // sentence embedding to process
     int32_t n_consumed = 0;
+    std::string text_input; // the message, tokenized from n_text_consumed on
+    size_t n_text_consumed = 0;
+    bool text_pending = false; // the last chunk and the response prefix are not queued yet
+    int32_t n_text_start = 0; // first token of the message in embd_input
+    int32_t text_progress_max = 0; // the estimate moves with the density of the chunks, never report less
+    std::vector<llama_token> text_chunk; // written by text_worker, queued by text_chunk_queue()
+    int32_t n_text_chunk = 0;
+    size_t n_text_chunk_end = 0; // n_text_consumed once the chunk is queued
+    std::thread text_worker;
+private:
+    void text_chunk_tokenize(instruction_info_t &instruction_info, size_t n_bytes, int n_threads);
+    int text_chunk_queue();
 private:
     llama_context *m_ctx = nullptr;
 }embedding_queue_t;
 
+// fixed-capacity ring of the last n_ctx tokens, every token is stored twice
+// (at pos and pos + n_ctx) so the window is always contiguous in memory
 typedef struct _last_n_tokens{
     void init(llama_context *ctx);
     void push(llama_token id);
-    std::vector<llama_token>& get_last_n_tokens();
+    const llama_token* data() const; // oldest token first, size() entries
+    int32_t size() const;
+    void save(QDataStream &out) const;
+    void load(QDataStream &in);
 private:
-    std::vector<llama_token> last_n_tokens;
+    std::vector<llama_token> ring;
+    int32_t capacity = 0;
+    int32_t head     = 0; // position of the oldest token
 }last_n_tokens_t;
 
+// joins the bytes of the sampled tokens into UTF-8 text, a code point split over
+// several byte tokens is kept back until its last byte arrives
+typedef struct _utf8_assembler{
+    void append(const char *bytes);
+    void flush(); // the incomplete tail, if any, as replacement characters
+    void take(QString &output); // the complete text appended so far, converted at once
+    void save(QDataStream &out) const;
+    void load(QDataStream &in);
+private:
+    std::string pending;
+    std::string text; // reused, keeps its capacity between the tokens
+}utf8_assembler_t;
+
 typedef struct _env_configs{
     void init(const gpt_params &params);
     int32_t n_predict       = 128; // new tokens to predict
@@ -92,12 +157,22 @@ typedef struct _env_configs{
     // sampling parameters
     int32_t top_k           = 40;
     float   top_p           = 0.95f;
+    float   typical_p       = 1.00f;
+    float   min_p           = 0.00f;
     float   temp            = 0.80f;
     float   repeat_penalty  = 1.30f;
 
-    int32_t n_batch         = 8; // batch size for prompt processing
+    int32_t n_batch         = 0; // batch size for prompt processing, 0 = picked for every eval
     int32_t n_keep          = 0;
-    int32_t n_threads       = 4;
+    int32_t n_threads_prompt = 4;
+    int32_t n_threads_decode = 4;
+
+    // identify the KV cache layout, used to share prompt snapshots between sessions
+    QString model;
+    int32_t n_ctx           = 512;
+    bool    memory_f16      = true;
+    int32_t kv_type         = LLAMA_KV_TYPE_DEFAULT;
+    bool    v_trans         = true;
 }env_configs_t;
 
 typedef struct _env_state{
@@ -106,6 +181,11 @@ typedef struct _env_state{
     int32_t n_remain = 0;
 }env_state_t;
 
+typedef struct _model_env{
+    llama_model *model = nullptr; // weights shared by all the sessions
+    gpt_params params; // params the sessions are created with
+}model_env_t;
+
 typedef struct _session_env{
     llama_context *ctx = nullptr; // context instance
     env_configs_t configs;  // params for model load and eval
@@ -113,14 +193,36 @@ typedef struct _session_env{
     keep_prompt_token_t keep_token;
     instruction_info_t instruction_info; // inject info
     embedding_queue_t embedding_queue;
+    utf8_assembler_t utf8_assembler;
     env_state_t state;
 }session_env_t;
 
-bool load_model(session_env_t *env, const gpt_params &params, llama_progress_callback progress_callback,void *progress_callback_user_data);
-void unload_model(session_env_t *env);
+bool load_model(model_env_t *env, const gpt_params &params, llama_progress_callback progress_callback,void *progress_callback_user_data);
+// every session of the model must be freed first
+void unload_model(model_env_t *env);
+
+// a session has its own KV cache and sampling state on top of the shared weights
+// abort_callback can stop an eval of the session, see llama_set_abort_callback()
+bool new_session(session_env_t *env, model_env_t *model_env, llama_abort_callback abort_callback = nullptr, void *abort_callback_user_data = nullptr);
+void free_session(session_env_t *env);
 
 bool init_chat_env(session_env_t *env);
+// the chat state of a session, the KV cache is mapped back from the file on load
+bool save_session(session_env_t *env, const QString &path);
+bool load_session(session_env_t *env, const QString &path);
 void init_user_input(session_env_t *env, const QString &msg);
+// ends the message in progress, e.g. after an eval that failed or a stop, the next message starts clean
+// an incomplete UTF-8 sequence of the reply is flushed to the output instead of joining the next reply
+void drop_user_input(session_env_t *env);
 QString generate_token(session_env_t *env);
+// one step of every session that should generate, the sessions are evaluated together
+// a session still reading its message evaluates the next tokens of the message and samples nothing
+// the sampled bytes are kept in the session until take_output(), so the text of several steps is converted at once
+// returns false when the eval failed or was aborted, an aborted step can be run again
+bool generate_tokens(session_env_t **envs, int n_envs);
+// appends the text sampled since the last call to output
+void take_output(session_env_t *env, QString &output);
 bool should_generate(session_env_t *env);
+// percent of the message evaluated, -1 once the whole message is in the KV cache
+int input_progress(session_env_t *env);
 #endif // COMMON_H
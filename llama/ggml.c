@@ -70,6 +70,51 @@ static int pthread_join(pthread_t thread, void* unused) {
     return (int) WaitForSingleObject(thread, INFINITE);
 }
 
+typedef CRITICAL_SECTION   pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+// a critical section has no static initializer, pthread_mutex_init() must still be called
+#define PTHREAD_MUTEX_INITIALIZER {0}
+#define PTHREAD_COND_INITIALIZER  CONDITION_VARIABLE_INIT
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    return 0;
+}
+
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    return SleepConditionVariableCS(cond, mutex, INFINITE) ? 0 : EINVAL;
+}
+
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
+
 static int sched_yield (void) {
     Sleep (0);
     return 0;
@@ -81,6 +126,12 @@ static int sched_yield (void) {
 typedef void* thread_ret_t;
 #endif
 
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
 // __FMA__ and __F16C__ are not defined in MSVC, however they are implied with AVX2/AVX512
 #if defined(_MSC_VER) && (defined(__AVX2__) || defined(__AVX512F__))
 #ifndef __FMA__
@@ -517,6 +568,15 @@ typedef struct {
 } block_q4_1;
 static_assert(sizeof(block_q4_1) == sizeof(float) * 2 + QK / 2, "wrong q4_1 block size/padding");
 
+// method 8
+// blocks of QK elements
+// represented with a single float (delta) and QK 8-bit signed integer factors
+typedef struct {
+    float  d;      // delta
+    int8_t qs[QK]; // quants
+} block_q8_0;
+static_assert(sizeof(block_q8_0) == sizeof(float) + QK, "wrong q8_0 block size/padding");
+
 // reference implementation for deterministic creation of model files
 static void quantize_row_q4_0_reference(const float * restrict x, block_q4_0 * restrict y, int k) {
     assert(k % QK == 0);
@@ -1195,6 +1255,46 @@ static void dequantize_row_q4_1(const void * restrict vx, float * restrict y, in
 #endif
 }
 
+static void quantize_row_q8_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    block_q8_0 * restrict y = vy;
+
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+
+        for (int l = 0; l < QK; l++) {
+            const float v = x[i*QK + l];
+            amax = MAX(amax, fabsf(v));
+        }
+
+        const float d = amax / 127.0f;
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = d;
+
+        for (int l = 0; l < QK; l++) {
+            y[i].qs[l] = (int8_t) roundf(x[i*QK + l]*id);
+        }
+    }
+}
+
+static void dequantize_row_q8_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    const block_q8_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = x[i].d;
+
+        for (int l = 0; l < QK; l++) {
+            y[i*QK + l] = x[i].qs[l]*d;
+        }
+    }
+}
+
 //
 // simd mappings
 //
@@ -2303,6 +2403,70 @@ static void ggml_vec_dot_q4_1(const int n, float * restrict s, const void * rest
     *s = sumf;
 }
 
+static void ggml_vec_dot_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK;
+
+    assert(n % QK == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    ggml_float sumf = 0.0;
+
+#if defined(__AVX2__)
+    // Initialize accumulator with zeros
+    __m256 acc = _mm256_setzero_ps();
+
+    // Main loop
+    for (int i = 0; i < nb; ++i) {
+        // Compute combined scale for the block
+        const __m256 d = _mm256_mul_ps( _mm256_broadcast_ss( &x[i].d ), _mm256_broadcast_ss( &y[i].d ) );
+
+        const __m256i bx = _mm256_loadu_si256( (const __m256i *) x[i].qs );
+        const __m256i by = _mm256_loadu_si256( (const __m256i *) y[i].qs );
+
+        // Get absolute values of x vectors
+        const __m256i ax = _mm256_sign_epi8( bx, bx );
+
+        // Sign the values of the y vectors
+        const __m256i sy = _mm256_sign_epi8( by, bx );
+
+        // Perform multiplication and create 16-bit values,
+        // the quants are in [-127 .. 127] so the pairwise sums cannot saturate
+        const __m256i dot = _mm256_maddubs_epi16( ax, sy );
+
+        // Add pairwise into 32-bit values
+        const __m256i i32 = _mm256_madd_epi16( dot, _mm256_set1_epi16( 1 ) );
+
+        // Convert int32_t to float, apply the scale, and accumulate
+        acc = _mm256_fmadd_ps( d, _mm256_cvtepi32_ps( i32 ), acc );
+    }
+
+    // Return horizontal sum of the acc vector
+    __m128 res = _mm256_extractf128_ps( acc, 1 );
+    res = _mm_add_ps( res, _mm256_castps256_ps128( acc ) );
+    res = _mm_add_ps( res, _mm_movehl_ps( res, res ) );
+    res = _mm_add_ss( res, _mm_movehdup_ps( res ) );
+
+    sumf = _mm_cvtss_f32( res );
+#else
+    // scalar
+    for (int i = 0; i < nb; i++) {
+        const int8_t * restrict p0 = x[i].qs;
+        const int8_t * restrict p1 = y[i].qs;
+
+        int sumi = 0;
+        for (int j = 0; j < QK; j++) {
+            sumi += p0[j]*p1[j];
+        }
+
+        sumf += x[i].d*y[i].d*sumi;
+    }
+#endif
+
+    *s = sumf;
+}
+
 // compute GGML_VEC_DOT_UNROLL dot products at once
 // xs - x row stride in bytes
 inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y) {
@@ -2545,6 +2709,7 @@ inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x
 //
 
 static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
+    QK,
     QK,
     QK,
     1,
@@ -2554,11 +2719,12 @@ static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
     1,
 };
 
-static_assert(GGML_TYPE_COUNT == 7, "GGML_TYPE_COUNT != 5");
+static_assert(GGML_TYPE_COUNT == 8, "GGML_TYPE_COUNT != 8");
 
 static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     sizeof(block_q4_0),
     sizeof(block_q4_1),
+    sizeof(block_q8_0),
     sizeof(int8_t ),
     sizeof(int16_t),
     sizeof(int32_t),
@@ -2567,7 +2733,7 @@ static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
 };
 
 // don't forget to update the array above when adding new types
-static_assert(GGML_TYPE_COUNT == 7, "GGML_TYPE_COUNT != 5");
+static_assert(GGML_TYPE_COUNT == 8, "GGML_TYPE_COUNT != 8");
 
 static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "NONE",
@@ -2685,6 +2851,7 @@ struct ggml_context {
     bool   mem_buffer_owned;
     bool   mem_buffer_mlocked;
     bool   no_alloc;
+    size_t no_alloc_size; // data of the tensors of a no_alloc context, had it been allocated in the memory pool
 
     int    n_objects;
 
@@ -2972,6 +3139,7 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         /*.mem_buffer_owned   =*/ params.mem_buffer ? false : true,
         /*.mem_buffer_mlocked =*/ false,
         /*.no_alloc           =*/ params.no_alloc,
+        /*.no_alloc_size      =*/ 0,
         /*.n_objects          =*/ 0,
         /*.objects_begin      =*/ NULL,
         /*.objects_end        =*/ NULL,
@@ -3031,8 +3199,21 @@ size_t ggml_used_mem(const struct ggml_context * ctx) {
     return ctx->objects_end->offs + ctx->objects_end->size;
 }
 
+size_t ggml_tensor_overhead(void) {
+    return GGML_OBJECT_SIZE + sizeof(struct ggml_tensor);
+}
+
+size_t ggml_measured_mem(const struct ggml_context * ctx) {
+    return ggml_used_mem(ctx) + ctx->no_alloc_size;
+}
+
+// a scratch buffer without data defers the tensors to ggml_graph_alloc(), the offset still advances
+static bool ggml_scratch_is_set(const struct ggml_context * ctx) {
+    return ctx->scratch.data != NULL || ctx->scratch.size > 0;
+}
+
 size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch) {
-    const size_t result = ctx->scratch.data ? ctx->scratch.offs : 0;
+    const size_t result = ggml_scratch_is_set(ctx) ? ctx->scratch.offs : 0;
 
     ctx->scratch = scratch;
 
@@ -3083,12 +3264,22 @@ bool ggml_mlock(
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// a view shares the data of view_src from view_offs on, also when view_src has none yet
 struct ggml_tensor * ggml_new_tensor_impl(
         struct ggml_context * ctx,
         enum   ggml_type type,
         int    n_dims,
         const int* ne,
-        void*  data) {
+        struct ggml_tensor * view_src,
+        size_t view_offs) {
+    // the views of a view share the data of its source
+    if (view_src != NULL && view_src->view_src != NULL) {
+        view_offs += view_src->view_offs;
+        view_src   = view_src->view_src;
+    }
+
+    void * data = view_src != NULL && view_src->data != NULL ? (char *) view_src->data + view_offs : NULL;
+
     // always insert objects at the end of the context's memory pool
     struct ggml_object * obj_cur = ctx->objects_end;
 
@@ -3098,7 +3289,7 @@ struct ggml_tensor * ggml_new_tensor_impl(
 
     size_t size_needed = 0;
 
-    if (data == NULL && !ctx->no_alloc) {
+    if (view_src == NULL) {
         size_needed += GGML_TYPE_SIZE[type]*(ne[0]/GGML_BLCK_SIZE[type]);
         for (int i = 1; i < n_dims; i++) {
             size_needed *= ne[i];
@@ -3110,7 +3301,14 @@ struct ggml_tensor * ggml_new_tensor_impl(
     char * const mem_buffer = ctx->mem_buffer;
     struct ggml_object * const obj_new = (struct ggml_object *)(mem_buffer + cur_end);
 
-    if (ctx->scratch.data == NULL || data != NULL) {
+    bool deferred = false;
+
+    if (!ggml_scratch_is_set(ctx) || view_src != NULL) {
+        if (ctx->no_alloc) {
+            ctx->no_alloc_size += size_needed;
+            size_needed = 0;
+        }
+
         size_needed += sizeof(struct ggml_tensor);
 
         if (cur_end + size_needed + GGML_OBJECT_SIZE > ctx->mem_size) {
@@ -3139,7 +3337,8 @@ struct ggml_tensor * ggml_new_tensor_impl(
             return NULL;
         }
 
-        data = (char * const) ctx->scratch.data + ctx->scratch.offs;
+        data     = ctx->scratch.data ? (char * const) ctx->scratch.data + ctx->scratch.offs : NULL;
+        deferred = ctx->scratch.data == NULL;
 
         *obj_new = (struct ggml_object) {
             .offs = cur_end + GGML_OBJECT_SIZE,
@@ -3182,7 +3381,10 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
-        /*.data         =*/ (data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
+        /*.data         =*/ (view_src == NULL && data == NULL && !deferred && !ctx->no_alloc) ? (void *)(result + 1) : data,
+        /*.view_src     =*/ view_src,
+        /*.view_offs    =*/ view_offs,
+        /*.deferred     =*/ deferred,
         /*.pad          =*/ { 0 },
     };
 
@@ -3209,7 +3411,7 @@ struct ggml_tensor * ggml_new_tensor(
         enum   ggml_type type,
         int    n_dims,
         const int * ne) {
-    return ggml_new_tensor_impl(ctx, type, n_dims, ne, NULL);
+    return ggml_new_tensor_impl(ctx, type, n_dims, ne, NULL, 0);
 }
 
 struct ggml_tensor * ggml_new_tensor_1d(
@@ -3251,32 +3453,36 @@ struct ggml_tensor * ggml_new_tensor_4d(
 
 struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
     ctx->scratch_save = ctx->scratch;
-    ctx->scratch.data = NULL;
+    ctx->scratch = (struct ggml_scratch) { 0, 0, NULL };
 
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
 
     ctx->scratch = ctx->scratch_save;
 
-    ggml_set_i32(result, value);
+    if (result->data) {
+        ggml_set_i32(result, value);
+    }
 
     return result;
 }
 
 struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
     ctx->scratch_save = ctx->scratch;
-    ctx->scratch.data = NULL;
+    ctx->scratch = (struct ggml_scratch) { 0, 0, NULL };
 
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
 
     ctx->scratch = ctx->scratch_save;
 
-    ggml_set_f32(result, value);
+    if (result->data) {
+        ggml_set_f32(result, value);
+    }
 
     return result;
 }
 
 struct ggml_tensor * ggml_dup_tensor(struct ggml_context * ctx, const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL);
+    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL, 0);
 }
 
 struct ggml_tensor * ggml_set_zero(struct ggml_tensor * tensor) {
@@ -3297,6 +3503,7 @@ struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3357,6 +3564,7 @@ struct ggml_tensor * ggml_set_f32(struct ggml_tensor * tensor, float value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3411,6 +3619,7 @@ int32_t ggml_get_i32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3455,6 +3664,7 @@ void ggml_set_i32_1d(const struct ggml_tensor * tensor, int i, int32_t value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3497,6 +3707,7 @@ float ggml_get_f32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3541,6 +3752,7 @@ void ggml_set_f32_1d(const struct ggml_tensor * tensor, int i, float value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3588,7 +3800,14 @@ float * ggml_get_data_f32(const struct ggml_tensor * tensor) {
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
         const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, (struct ggml_tensor *) src, 0);
+
+    // keep the strides of a src that is not contiguous, e.g. the strided destination of a ggml_cpy()
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        result->nb[i] = src->nb[i];
+    }
+
+    return result;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -4365,7 +4584,7 @@ struct ggml_tensor * ggml_reshape(
         is_node = true;
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4391,7 +4610,7 @@ struct ggml_tensor * ggml_reshape_2d(
     }
 
     const int ne[2] = { ne0, ne1 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4418,7 +4637,7 @@ struct ggml_tensor * ggml_reshape_3d(
     }
 
     const int ne[3] = { ne0, ne1, ne2 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4439,7 +4658,7 @@ struct ggml_tensor * ggml_view_1d(
         GGML_ASSERT(false); // gradient propagation is not supported
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, a, offset);
 
     result->op   = GGML_OP_VIEW;
     result->grad = NULL;
@@ -4464,7 +4683,7 @@ struct ggml_tensor * ggml_view_2d(
 
     const int ne[GGML_MAX_DIMS] = { ne0, ne1, 1, 1 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a, offset);
 
     result->nb[1] = nb1;
     result->nb[2] = result->nb[1]*ne1;
@@ -4478,6 +4697,37 @@ struct ggml_tensor * ggml_view_2d(
     return result;
 }
 
+// ggml_view_3d
+
+struct ggml_tensor * ggml_view_3d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        size_t                nb1,
+        size_t                nb2,
+        size_t                offset) {
+    if (a->grad) {
+        GGML_ASSERT(false); // gradient propagation is not supported
+    }
+
+    const int ne[GGML_MAX_DIMS] = { ne0, ne1, ne2, 1 };
+
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a, offset);
+
+    result->nb[1] = nb1;
+    result->nb[2] = nb2;
+    result->nb[3] = result->nb[2]*ne2;
+
+    result->op   = GGML_OP_VIEW;
+    result->grad = NULL;
+    result->src0 = a;
+    result->src1 = NULL; // TODO: maybe store the offset here?
+
+    return result;
+}
+
 // ggml_permute
 
 struct ggml_tensor * ggml_permute(
@@ -4664,10 +4914,19 @@ struct ggml_tensor * ggml_rope(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
+    // set now, it must not be deferred
+    ctx->scratch_save = ctx->scratch;
+    ctx->scratch = (struct ggml_scratch) { 0, 0, NULL };
+
     struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
-    ((int32_t *) b->data)[0] = n_past;
-    ((int32_t *) b->data)[1] = n_dims;
-    ((int32_t *) b->data)[2] = mode;
+
+    ctx->scratch = ctx->scratch_save;
+
+    if (b->data) {
+        ((int32_t *) b->data)[0] = n_past;
+        ((int32_t *) b->data)[1] = n_dims;
+        ((int32_t *) b->data)[2] = mode;
+    }
 
     result->op   = GGML_OP_ROPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4733,14 +4992,17 @@ struct ggml_tensor * ggml_conv_1d_2s(
 
 // ggml_flash_attn
 
-struct ggml_tensor * ggml_flash_attn(
+static struct ggml_tensor * ggml_flash_attn_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * q,
         struct ggml_tensor  * k,
         struct ggml_tensor  * v,
-        bool                  masked) {
+        int                   n_past,
+        bool                  v_trans) {
     GGML_ASSERT(ggml_can_mul_mat(k, q));
-    // TODO: check if vT can be multiplied by (k*qT)
+    GGML_ASSERT(v_trans ? v->ne[0] == k->ne[1] && v->ne[1] == k->ne[0] && v->ne[2] == k->ne[2]
+                        : ggml_are_same_shape(k, v));
+    GGML_ASSERT(n_past + q->ne[1] <= k->ne[1]);
 
     bool is_node = false;
 
@@ -4752,16 +5014,49 @@ struct ggml_tensor * ggml_flash_attn(
     //struct ggml_tensor * result = ggml_dup_tensor(ctx, q);
     struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, q->ne);
 
+    // set now, it must not be deferred
+    ctx->scratch_save = ctx->scratch;
+    ctx->scratch = (struct ggml_scratch) { 0, 0, NULL };
+
+    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 2);
+
+    ctx->scratch = ctx->scratch_save;
+
+    if (b->data) {
+        ((int32_t *) b->data)[0] = n_past;
+        ((int32_t *) b->data)[1] = v_trans ? 1 : 0;
+    }
+
     result->op   = GGML_OP_FLASH_ATTN;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = q;
     result->src1 = k;
     result->opt[0] = v;
-    result->opt[1] = ggml_new_i32(ctx, masked ? 1 : 0);
+    result->opt[1] = b;
 
     return result;
 }
 
+struct ggml_tensor * ggml_flash_attn(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        bool                  masked) {
+    return ggml_flash_attn_impl(ctx, q, k, v, masked ? k->ne[1] - q->ne[1] : -1, true);
+}
+
+struct ggml_tensor * ggml_flash_attn_past(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        int                   n_past,
+        bool                  v_trans) {
+    GGML_ASSERT(n_past >= 0);
+    return ggml_flash_attn_impl(ctx, q, k, v, n_past, v_trans);
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -4806,6 +5101,30 @@ void ggml_set_param(
     tensor->grad = ggml_dup_tensor(ctx, tensor);
 }
 
+static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_Q4_0] = {
+        .dequantize_row_q = dequantize_row_q4_0,
+        .quantize_row_q   = quantize_row_q4_0,
+        .vec_dot_q        = ggml_vec_dot_q4_0,
+    },
+    [GGML_TYPE_Q4_1] = {
+        .dequantize_row_q = dequantize_row_q4_1,
+        .quantize_row_q   = quantize_row_q4_1,
+        .vec_dot_q        = ggml_vec_dot_q4_1,
+    },
+    [GGML_TYPE_Q8_0] = {
+        .dequantize_row_q = dequantize_row_q8_0,
+        .quantize_row_q   = quantize_row_q8_0,
+        .vec_dot_q        = ggml_vec_dot_q8_0,
+    },
+};
+
+// For internal use, e.g. by llama.cpp to convert quantized rows of the KV cache
+quantize_fns_t ggml_internal_get_quantize_fn(size_t i) {
+    GGML_ASSERT(i < GGML_TYPE_COUNT);
+    return quantize_fns[i];
+}
+
 // ggml_compute_forward_dup
 
 static void ggml_compute_forward_dup_f16(
@@ -4972,6 +5291,27 @@ static void ggml_compute_forward_dup_f32(
                     }
                 }
             }
+        } else if (quantize_fns[dst->type].quantize_row_q) {
+            // the blocks do not cross rows, so the rows can be quantized one at a time
+            GGML_ASSERT(ne00 % GGML_BLCK_SIZE[dst->type] == 0);
+
+            quantize_row_q_t const quantize_row_q = quantize_fns[dst->type].quantize_row_q;
+
+            size_t id = 0;
+            const size_t rs = ne00*GGML_TYPE_SIZE[dst->type]/GGML_BLCK_SIZE[dst->type];
+
+            for (int i03 = 0; i03 < ne03; i03++) {
+                for (int i02 = 0; i02 < ne02; i02++) {
+                    for (int i01 = 0; i01 < ne01; i01++) {
+                        const float * src0_ptr = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                        char * dst_ptr = (char *) dst->data + id*rs;
+
+                        quantize_row_q(src0_ptr, dst_ptr, ne00);
+
+                        id++;
+                    }
+                }
+            }
         } else {
             GGML_ASSERT(false); // TODO: implement
         }
@@ -5016,55 +5356,148 @@ static void ggml_compute_forward_dup_f32(
     }
 }
 
-static void ggml_compute_forward_dup(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        struct ggml_tensor * dst) {
-    switch (src0->type) {
-        case GGML_TYPE_F16:
-            {
-                ggml_compute_forward_dup_f16(params, src0, dst);
-            } break;
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_dup_f32(params, src0, dst);
-            } break;
-        case GGML_TYPE_Q4_0:
-        case GGML_TYPE_Q4_1:
-        case GGML_TYPE_I8:
-        case GGML_TYPE_I16:
-        case GGML_TYPE_I32:
-        case GGML_TYPE_COUNT:
-            {
-                GGML_ASSERT(false);
-            } break;
-    }
-}
-
-// ggml_compute_forward_add
-
-static void ggml_compute_forward_add_f32(
+static void ggml_compute_forward_dup_q(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(params->ith == 0);
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int ith = params->ith;
-    const int nth = params->nth;
-
-    const int n  = ggml_nrows(src0);
-    const int nc = src0->ne[0];
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+    const int ne03 = src0->ne[3];
 
-    const size_t nb00 = src0->nb[0];
     const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
 
-    const size_t nb10 = src1->nb[0];
-    const size_t nb11 = src1->nb[1];
+    const enum ggml_type type = src0->type;
+
+    if (ggml_is_contiguous(src0) && src0->type == dst->type) {
+        memcpy(dst->data, src0->data, ggml_nbytes(dst));
+        return;
+    }
+
+    // only dequantization of whole rows is supported
+    GGML_ASSERT(src0->nb[0] == GGML_TYPE_SIZE[type]);
+    GGML_ASSERT(dst->type == GGML_TYPE_F32);
+
+    dequantize_row_q_t const dequantize_row_q = quantize_fns[type].dequantize_row_q;
+
+    size_t id = 0;
+    float * dst_ptr = (float *) dst->data;
+
+    for (int i03 = 0; i03 < ne03; i03++) {
+        for (int i02 = 0; i02 < ne02; i02++) {
+            for (int i01 = 0; i01 < ne01; i01++) {
+                const char * src0_ptr = (char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
+
+                dequantize_row_q(src0_ptr, dst_ptr + id, ne00);
+
+                id += ne00;
+            }
+        }
+    }
+}
+
+// dst of the same shape but not contiguous, e.g. a transposed view: copy element by element
+static void ggml_compute_forward_dup_strided(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(params->ith == 0);
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(src0->type == GGML_TYPE_F16 || src0->type == GGML_TYPE_F32);
+    GGML_ASSERT(dst->type  == GGML_TYPE_F16 || dst->type  == GGML_TYPE_F32);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    for (int i03 = 0; i03 < src0->ne[3]; i03++) {
+        for (int i02 = 0; i02 < src0->ne[2]; i02++) {
+            for (int i01 = 0; i01 < src0->ne[1]; i01++) {
+                for (int i00 = 0; i00 < src0->ne[0]; i00++) {
+                    const char * src0_ptr = (char *) src0->data + i00*src0->nb[0] + i01*src0->nb[1] + i02*src0->nb[2] + i03*src0->nb[3];
+                          char * dst_ptr  = (char *) dst->data  + i00*dst->nb[0]  + i01*dst->nb[1]  + i02*dst->nb[2]  + i03*dst->nb[3];
+
+                    const float v = src0->type == GGML_TYPE_F16 ? GGML_FP16_TO_FP32(*(ggml_fp16_t *) src0_ptr) : *(float *) src0_ptr;
+
+                    if (dst->type == GGML_TYPE_F16) {
+                        *(ggml_fp16_t *) dst_ptr = GGML_FP32_TO_FP16(v);
+                    } else {
+                        *(float *) dst_ptr = v;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_dup(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    if (!ggml_is_contiguous(dst)) {
+        ggml_compute_forward_dup_strided(params, src0, dst);
+        return;
+    }
+
+    switch (src0->type) {
+        case GGML_TYPE_F16:
+            {
+                ggml_compute_forward_dup_f16(params, src0, dst);
+            } break;
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_dup_f32(params, src0, dst);
+            } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_dup_q(params, src0, dst);
+            } break;
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_add
+
+static void ggml_compute_forward_add_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int n  = ggml_nrows(src0);
+    const int nc = src0->ne[0];
+
+    const size_t nb00 = src0->nb[0];
+    const size_t nb01 = src0->nb[1];
+
+    const size_t nb10 = src1->nb[0];
+    const size_t nb11 = src1->nb[1];
 
     const size_t nb0 = dst->nb[0];
     const size_t nb1 = dst->nb[1];
@@ -5108,6 +5541,7 @@ static void ggml_compute_forward_add(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5160,6 +5594,7 @@ static void ggml_compute_forward_sub(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5212,6 +5647,7 @@ static void ggml_compute_forward_mul(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5264,6 +5700,7 @@ static void ggml_compute_forward_div(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5312,6 +5749,7 @@ static void ggml_compute_forward_sqr(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5360,6 +5798,7 @@ static void ggml_compute_forward_sqrt(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5418,6 +5857,7 @@ static void ggml_compute_forward_sum(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5495,6 +5935,7 @@ static void ggml_compute_forward_mean(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5559,6 +6000,7 @@ static void ggml_compute_forward_repeat(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5607,6 +6049,7 @@ static void ggml_compute_forward_abs(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5655,6 +6098,7 @@ static void ggml_compute_forward_sgn(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5703,6 +6147,7 @@ static void ggml_compute_forward_neg(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5751,6 +6196,7 @@ static void ggml_compute_forward_step(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5799,6 +6245,7 @@ static void ggml_compute_forward_relu(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5864,6 +6311,7 @@ static void ggml_compute_forward_gelu(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5931,6 +6379,7 @@ static void ggml_compute_forward_silu(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6017,6 +6466,7 @@ static void ggml_compute_forward_norm(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6097,6 +6547,7 @@ static void ggml_compute_forward_rms_norm(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6109,6 +6560,53 @@ static void ggml_compute_forward_rms_norm(
 }
 
 
+//
+// NUMA
+//
+
+#define GGML_NUMA_MAX_NODES 8
+
+struct ggml_numa_nodes {
+    enum ggml_numa_strategy strategy;
+    int n_nodes; // nodes with cpus the process may run on, 0 when NUMA is off
+#if defined(__linux__)
+    int       ids [GGML_NUMA_MAX_NODES];
+    cpu_set_t cpus[GGML_NUMA_MAX_NODES];
+#endif
+};
+
+static struct ggml_numa_nodes g_numa = { 0 };
+
+bool ggml_is_numa(void) {
+    return g_numa.n_nodes > 1;
+}
+
+// the rows [*ir0, *ir1) of nr rows computed by thread ith of nth
+// with NUMA, the rows are split between the nodes like ggml_numa_place() does, then between the threads of each node
+static void ggml_compute_rows(int nr, int ith, int nth, int * ir0, int * ir1) {
+    const int n_nodes = g_numa.n_nodes;
+
+    if (n_nodes > 1 && nth >= n_nodes) {
+        const int node     = ith % n_nodes;
+        const int ith_node = ith / n_nodes;
+        const int nth_node = (nth - node + n_nodes - 1)/n_nodes;
+
+        const int r0 = (int) (((int64_t) nr*node)/n_nodes);
+        const int r1 = (int) (((int64_t) nr*(node + 1))/n_nodes);
+        const int dr = (r1 - r0 + nth_node - 1)/nth_node;
+
+        *ir0 = MIN(r0 + dr*ith_node, r1);
+        *ir1 = MIN(*ir0 + dr, r1);
+        return;
+    }
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    *ir0 = dr*ith;
+    *ir1 = MIN(*ir0 + dr, nr);
+}
+
 // ggml_compute_forward_mul_mat
 
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
@@ -6257,12 +6755,9 @@ static void ggml_compute_forward_mul_mat_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
     // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    int ir0, ir1;
+    ggml_compute_rows(nr, ith, nth, &ir0, &ir1);
 
     for (int ir = ir0; ir < ir1; ++ir) {
         // src0 indices
@@ -6448,12 +6943,9 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
     // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    int ir0, ir1;
+    ggml_compute_rows(nr, ith, nth, &ir0, &ir1);
 
     ggml_fp16_t * wdata = params->wdata;
 
@@ -6493,29 +6985,6 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     //}
 }
 
-typedef void (*dequantize_row_q_t)(const void * restrict x, float * restrict y, int k);
-typedef void (*quantize_row_q_t)(const float * restrict x, void * restrict y, int k);
-typedef void (*vec_dot_q_t)(const int n, float * restrict s, const void * restrict x, const void * restrict y);
-
-typedef struct {
-    dequantize_row_q_t dequantize_row_q;
-    quantize_row_q_t   quantize_row_q;
-    vec_dot_q_t        vec_dot_q;
-} quantize_fns_t;
-
-static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
-    [GGML_TYPE_Q4_0] = {
-        .dequantize_row_q = dequantize_row_q4_0,
-        .quantize_row_q   = quantize_row_q4_0,
-        .vec_dot_q        = ggml_vec_dot_q4_0,
-    },
-    [GGML_TYPE_Q4_1] = {
-        .dequantize_row_q = dequantize_row_q4_1,
-        .quantize_row_q   = quantize_row_q4_1,
-        .vec_dot_q        = ggml_vec_dot_q4_1,
-    },
-};
-
 static void ggml_compute_forward_mul_mat_q_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -6656,12 +7125,9 @@ static void ggml_compute_forward_mul_mat_q_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
     // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    int ir0, ir1;
+    ggml_compute_rows(nr, ith, nth, &ir0, &ir1);
 
     void * wdata = params->wdata;
     const size_t row_size = ne00*GGML_TYPE_SIZE[type]/GGML_BLCK_SIZE[type];
@@ -6712,6 +7178,7 @@ static void ggml_compute_forward_mul_mat(
     switch (src0->type) {
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 ggml_compute_forward_mul_mat_q_f32(params, src0, src1, dst);
             } break;
@@ -6810,6 +7277,7 @@ static void ggml_compute_forward_scale(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6966,6 +7434,7 @@ static void ggml_compute_forward_get_rows(
     switch (src0->type) {
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 ggml_compute_forward_get_rows_q(params, src0, src1, dst);
             } break;
@@ -7055,6 +7524,7 @@ static void ggml_compute_forward_diag_mask_inf(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -7149,6 +7619,7 @@ static void ggml_compute_forward_soft_max(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -7291,6 +7762,7 @@ static void ggml_compute_forward_rope(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -7559,6 +8031,7 @@ static void ggml_compute_forward_conv_1d_1s(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -7827,6 +8300,7 @@ static void ggml_compute_forward_conv_1d_2s(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -7844,7 +8318,8 @@ static void ggml_compute_forward_flash_attn_f32(
         const struct ggml_tensor * q,
         const struct ggml_tensor * k,
         const struct ggml_tensor * v,
-        const bool masked,
+        const int n_past,
+        const bool v_trans,
              struct ggml_tensor * dst) {
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
@@ -7859,7 +8334,7 @@ static void ggml_compute_forward_flash_attn_f32(
     //const int nek2 = k->ne[2];
     //const int nek3 = k->ne[3];
 
-    //const int nev0 = v->ne[0];
+    const int nev0 = v->ne[0];
     const int nev1 = v->ne[1];
     //const int nev2 = v->ne[2];
     //const int nev3 = v->ne[3];
@@ -7894,14 +8369,13 @@ static void ggml_compute_forward_flash_attn_f32(
 
     const int D = neq0;
     const int N = neq1;
-    const int P = nek1 - N;
-    const int M = P + N;
+    const int M = nek1;
 
     const int Mup = ggml_up(M, GGML_SOFT_MAX_UNROLL);
 
     GGML_ASSERT(ne0 == D);
     GGML_ASSERT(ne1 == N);
-    GGML_ASSERT(P >= 0);
+    GGML_ASSERT(n_past + N <= M);
 
     GGML_ASSERT(nbq0 == sizeof(float));
     GGML_ASSERT(nbk0 == sizeof(float));
@@ -7909,11 +8383,7 @@ static void ggml_compute_forward_flash_attn_f32(
 
     GGML_ASSERT(neq0 == D);
     GGML_ASSERT(nek0 == D);
-    GGML_ASSERT(nev1 == D);
-
-    GGML_ASSERT(neq1 == N);
-    GGML_ASSERT(nek1 == N + P);
-    GGML_ASSERT(nev1 == D);
+    GGML_ASSERT(v_trans ? nev0 == M && nev1 == D : nev0 == D && nev1 == M);
 
     // dst cannot be transposed or permuted
     GGML_ASSERT(nb0 == sizeof(float));
@@ -7943,7 +8413,7 @@ static void ggml_compute_forward_flash_attn_f32(
 
     const float scale = 1.0f/sqrtf(D);
 
-    //printf("P=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", P, N, D, ir0, ir1, scale);
+    //printf("n_past=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", n_past, N, D, ir0, ir1, scale);
 
     for (int ir = ir0; ir < ir1; ++ir) {
         // q indices
@@ -7951,13 +8421,17 @@ static void ggml_compute_forward_flash_attn_f32(
         const int iq2 = (ir - iq3*neq2*neq1)/neq1;
         const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
+        // the keys after n_past + iq1 are masked, they are not computed
+        const int M1   = n_past < 0 ? M : n_past + iq1 + 1;
+        const int M1up = ggml_up(M1, GGML_SOFT_MAX_UNROLL);
+
         float * S = (float *) params->wdata + ith*(Mup + CACHE_LINE_SIZE_F32);
 
-        for (int i = M; i < Mup; ++i) {
+        for (int i = M1; i < M1up; ++i) {
             S[i] = -INFINITY;
         }
 
-        for (int ic = 0; ic < nek1; ++ic) {
+        for (int ic = 0; ic < M1; ++ic) {
             // k indices
             const int ik3 = iq3;
             const int ik2 = iq2;
@@ -7973,33 +8447,25 @@ static void ggml_compute_forward_flash_attn_f32(
         }
 
         // scale
-        ggml_vec_scale_f32(nek1, S, scale);
-
-        if (masked) {
-            for (int i = P; i < M; i++) {
-                if (i > P + iq1) {
-                    S[i] = -INFINITY;
-                }
-            }
-        }
+        ggml_vec_scale_f32(M1, S, scale);
 
         // softmax
         {
             float max = -INFINITY;
-            ggml_vec_max_f32(M, &max, S);
+            ggml_vec_max_f32(M1, &max, S);
 
             ggml_float sum = 0.0;
             {
 #ifdef GGML_SOFT_MAX_ACCELERATE
                 max = -max;
-                vDSP_vsadd(S, 1, &max, S, 1, Mup);
-                vvexpf(S, S, &Mup);
-                ggml_vec_sum_f32(Mup, &sum, S);
+                vDSP_vsadd(S, 1, &max, S, 1, M1up);
+                vvexpf(S, S, &M1up);
+                ggml_vec_sum_f32(M1up, &sum, S);
 #else
                 uint16_t   scvt[GGML_SOFT_MAX_UNROLL];
                 ggml_float sump[GGML_SOFT_MAX_UNROLL] = { 0.0 };
 
-                for (int i = 0; i < Mup; i += GGML_SOFT_MAX_UNROLL) {
+                for (int i = 0; i < M1up; i += GGML_SOFT_MAX_UNROLL) {
                     float * SS = S + i;
 
                     for (int j = 0; j < GGML_SOFT_MAX_UNROLL; ++j) {
@@ -8024,26 +8490,37 @@ static void ggml_compute_forward_flash_attn_f32(
             assert(sum > 0.0);
 
             sum = 1.0/sum;
-            ggml_vec_scale_f32(M, S, sum);
+            ggml_vec_scale_f32(M1, S, sum);
 
 #ifndef NDEBUG
-            for (int i = 0; i < M; ++i) {
+            for (int i = 0; i < M1; ++i) {
                 assert(!isnan(S[i]));
                 assert(!isinf(S[i]));
             }
 #endif
         }
 
-        for (int ic = 0; ic < nev1; ++ic) {
-            // dst indices
-            const int i1 = iq1;
-            const int i2 = iq2;
-            const int i3 = iq3;
+        // dst indices
+        const int i1 = iq1;
+        const int i2 = iq2;
+        const int i3 = iq3;
 
-            ggml_vec_dot_f32(nek1,
-                    (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
-                    (float *) ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
-                    S);
+        if (v_trans) {
+            for (int ic = 0; ic < nev1; ++ic) {
+                ggml_vec_dot_f32(M1,
+                        (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
+                        (float *) ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
+                        S);
+            }
+        } else {
+            // the values are rows as the keys: sum them weighted by S
+            float * y = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+
+            ggml_vec_set_f32(D, y, 0.0f);
+
+            for (int ic = 0; ic < M1; ++ic) {
+                ggml_vec_mad_f32(D, y, (float *) ((char *) v->data + (ic*nbv1 + i2*nbv2 + i3*nbv3)), S[ic]);
+            }
         }
     }
 }
@@ -8053,7 +8530,8 @@ static void ggml_compute_forward_flash_attn_f16(
         const struct ggml_tensor * q,
         const struct ggml_tensor * k,
         const struct ggml_tensor * v,
-        const bool masked,
+        const int n_past,
+        const bool v_trans,
              struct ggml_tensor * dst) {
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
@@ -8068,7 +8546,7 @@ static void ggml_compute_forward_flash_attn_f16(
     //const int nek2 = k->ne[2];
     //const int nek3 = k->ne[3];
 
-    //const int nev0 = v->ne[0];
+    const int nev0 = v->ne[0];
     const int nev1 = v->ne[1];
     //const int nev2 = v->ne[2];
     //const int nev3 = v->ne[3];
@@ -8103,26 +8581,23 @@ static void ggml_compute_forward_flash_attn_f16(
 
     const int D = neq0;
     const int N = neq1;
-    const int P = nek1 - N;
-    const int M = P + N;
+    const int M = nek1;
 
     const int Mup = ggml_up(M, GGML_SOFT_MAX_UNROLL);
 
     GGML_ASSERT(ne0 == D);
     GGML_ASSERT(ne1 == N);
-    GGML_ASSERT(P >= 0);
+    GGML_ASSERT(n_past + N <= M);
 
-    GGML_ASSERT(nbq0 == sizeof(ggml_fp16_t));
+    // an F32 q is converted row by row
+    GGML_ASSERT(q->type == GGML_TYPE_F16 || q->type == GGML_TYPE_F32);
+    GGML_ASSERT(nbq0 == (int) GGML_TYPE_SIZE[q->type]);
     GGML_ASSERT(nbk0 == sizeof(ggml_fp16_t));
     GGML_ASSERT(nbv0 == sizeof(ggml_fp16_t));
 
     GGML_ASSERT(neq0 == D);
     GGML_ASSERT(nek0 == D);
-    GGML_ASSERT(nev1 == D);
-
-    GGML_ASSERT(neq1 == N);
-    GGML_ASSERT(nek1 == N + P);
-    GGML_ASSERT(nev1 == D);
+    GGML_ASSERT(v_trans ? nev0 == M && nev1 == D : nev0 == D && nev1 == M);
 
     // dst cannot be transposed or permuted
     GGML_ASSERT(nb0 == sizeof(float));
@@ -8152,7 +8627,13 @@ static void ggml_compute_forward_flash_attn_f16(
 
     const float scale = 1.0f/sqrtf(D);
 
-    //printf("P=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", P, N, D, ir0, ir1, scale);
+    //printf("n_past=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", n_past, N, D, ir0, ir1, scale);
+
+    // S, the values of one row in F32, S and the q row in F16
+    float       * S   = (float *) params->wdata + ith*(2*(Mup + D) + CACHE_LINE_SIZE_F32);
+    float       * V32 = S + Mup;
+    ggml_fp16_t * S16 = (ggml_fp16_t *) (V32 + D);
+    ggml_fp16_t * Q16 = S16 + Mup;
 
     for (int ir = ir0; ir < ir1; ++ir) {
         // q indices
@@ -8160,14 +8641,25 @@ static void ggml_compute_forward_flash_attn_f16(
         const int iq2 = (ir - iq3*neq2*neq1)/neq1;
         const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-        float * S = (float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32);
+        // the keys after n_past + iq1 are masked, they are not computed
+        const int M1   = n_past < 0 ? M : n_past + iq1 + 1;
+        const int M1up = ggml_up(M1, GGML_SOFT_MAX_UNROLL);
 
-        for (int i = M; i < Mup; ++i) {
+        for (int i = M1; i < M1up; ++i) {
             S[i] = -INFINITY;
         }
 
-        if (GGML_VEC_DOT_UNROLL > 2 || nek1 % GGML_VEC_DOT_UNROLL != 0) {
-            for (int ic = 0; ic < nek1; ++ic) {
+        ggml_fp16_t * qr = (ggml_fp16_t *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+
+        if (q->type == GGML_TYPE_F32) {
+            for (int i = 0; i < D; ++i) {
+                Q16[i] = GGML_FP32_TO_FP16(((float *) qr)[i]);
+            }
+            qr = Q16;
+        }
+
+        if (GGML_VEC_DOT_UNROLL > 2 || M1 % GGML_VEC_DOT_UNROLL != 0) {
+            for (int ic = 0; ic < M1; ++ic) {
                 // k indices
                 const int ik3 = iq3;
                 const int ik2 = iq2;
@@ -8179,10 +8671,10 @@ static void ggml_compute_forward_flash_attn_f16(
                 ggml_vec_dot_f16(neq0,
                         S + i1,
                         (ggml_fp16_t *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                        (ggml_fp16_t *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
+                        qr);
             }
         } else {
-            for (int ic = 0; ic < nek1; ic += GGML_VEC_DOT_UNROLL) {
+            for (int ic = 0; ic < M1; ic += GGML_VEC_DOT_UNROLL) {
                 // k indices
                 const int ik3 = iq3;
                 const int ik2 = iq2;
@@ -8194,38 +8686,30 @@ static void ggml_compute_forward_flash_attn_f16(
                 ggml_vec_dot_f16_unroll(neq0, nbk1,
                         S + i1,
                         ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                        (ggml_fp16_t *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
+                        qr);
             }
         }
 
         // scale
-        ggml_vec_scale_f32(nek1, S, scale);
-
-        if (masked) {
-            for (int i = P; i < M; i++) {
-                if (i > P + iq1) {
-                    S[i] = -INFINITY;
-                }
-            }
-        }
+        ggml_vec_scale_f32(M1, S, scale);
 
         // softmax
         {
             float max = -INFINITY;
-            ggml_vec_max_f32(M, &max, S);
+            ggml_vec_max_f32(M1, &max, S);
 
             ggml_float sum = 0.0;
             {
 #ifdef GGML_SOFT_MAX_ACCELERATE
                 max = -max;
-                vDSP_vsadd(S, 1, &max, S, 1, Mup);
-                vvexpf(S, S, &Mup);
-                ggml_vec_sum_f32(Mup, &sum, S);
+                vDSP_vsadd(S, 1, &max, S, 1, M1up);
+                vvexpf(S, S, &M1up);
+                ggml_vec_sum_f32(M1up, &sum, S);
 #else
                 uint16_t   scvt[GGML_SOFT_MAX_UNROLL];
                 ggml_float sump[GGML_SOFT_MAX_UNROLL] = { 0.0 };
 
-                for (int i = 0; i < Mup; i += GGML_SOFT_MAX_UNROLL) {
+                for (int i = 0; i < M1up; i += GGML_SOFT_MAX_UNROLL) {
                     float * SS = S + i;
 
                     for (int j = 0; j < GGML_SOFT_MAX_UNROLL; ++j) {
@@ -8250,42 +8734,54 @@ static void ggml_compute_forward_flash_attn_f16(
             assert(sum > 0.0);
 
             sum = 1.0/sum;
-            ggml_vec_scale_f32(M, S, sum);
+            ggml_vec_scale_f32(M1, S, sum);
 
 #ifndef NDEBUG
-            for (int i = 0; i < M; ++i) {
+            for (int i = 0; i < M1; ++i) {
                 assert(!isnan(S[i]));
                 assert(!isinf(S[i]));
             }
 #endif
         }
 
-        ggml_fp16_t * S16 = (ggml_fp16_t *) ((float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32) + Mup);
+        // dst indices
+        const int i1 = iq1;
+        const int i2 = iq2;
+        const int i3 = iq3;
 
-        for (int i = 0; i < M; i++) {
+        if (!v_trans) {
+            // the values are rows as the keys: sum them weighted by S
+            float * y = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+
+            ggml_vec_set_f32(D, y, 0.0f);
+
+            for (int ic = 0; ic < M1; ++ic) {
+                const ggml_fp16_t * vr = (ggml_fp16_t *) ((char *) v->data + (ic*nbv1 + i2*nbv2 + i3*nbv3));
+
+                for (int i = 0; i < D; ++i) {
+                    V32[i] = GGML_FP16_TO_FP32(vr[i]);
+                }
+
+                ggml_vec_mad_f32(D, y, V32, S[ic]);
+            }
+
+            continue;
+        }
+
+        for (int i = 0; i < M1; i++) {
             S16[i] = GGML_FP32_TO_FP16(S[i]);
         }
 
         if (GGML_VEC_DOT_UNROLL == 1 || (nev1 % GGML_VEC_DOT_UNROLL != 0)) {
             for (int ic = 0; ic < nev1; ++ic) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
-
-                ggml_vec_dot_f16(nek1,
+                ggml_vec_dot_f16(M1,
                         (float *)       ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
                         (ggml_fp16_t *) ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
                         S16);
             }
         } else {
             for (int ic = 0; ic < nev1; ic += GGML_VEC_DOT_UNROLL) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
-
-                ggml_vec_dot_f16_unroll(nek1, nbv1,
+                ggml_vec_dot_f16_unroll(M1, nbv1,
                         (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
                         ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
                         S16);
@@ -8299,19 +8795,21 @@ static void ggml_compute_forward_flash_attn(
         const struct ggml_tensor * q,
         const struct ggml_tensor * k,
         const struct ggml_tensor * v,
-        const bool masked,
+        const int n_past,
+        const bool v_trans,
         struct ggml_tensor * dst) {
-    switch (q->type) {
+    switch (k->type) {
         case GGML_TYPE_F16:
             {
-                ggml_compute_forward_flash_attn_f16(params, q, k, v, masked, dst);
+                ggml_compute_forward_flash_attn_f16(params, q, k, v, n_past, v_trans, dst);
             } break;
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_flash_attn_f32(params, q, k, v, masked, dst);
+                ggml_compute_forward_flash_attn_f32(params, q, k, v, n_past, v_trans, dst);
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -8523,6 +9021,7 @@ static void ggml_compute_forward_flash_ff(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -8669,10 +9168,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_FLASH_ATTN:
             {
-                int32_t t = ggml_get_i32_1d(tensor->opt[1], 0);
-                GGML_ASSERT(t == 0 || t == 1);
-                bool masked = t != 0;
-                ggml_compute_forward_flash_attn(params, tensor->src0, tensor->src1, tensor->opt[0], masked, tensor);
+                const int32_t n_past  = ((int32_t *) tensor->opt[1]->data)[0];
+                const int32_t v_trans = ((int32_t *) tensor->opt[1]->data)[1];
+                GGML_ASSERT(v_trans == 0 || v_trans == 1);
+                ggml_compute_forward_flash_attn(params, tensor->src0, tensor->src1, tensor->opt[0], n_past, v_trans != 0, tensor);
             } break;
         case GGML_OP_FLASH_FF:
             {
@@ -9011,6 +9510,8 @@ static void ggml_build_forward_impl(struct ggml_cgraph * cgraph, struct ggml_ten
     if (n_new > 0) {
         // the last added node should always be starting point
         GGML_ASSERT(cgraph->nodes[cgraph->n_nodes - 1] == tensor);
+
+        cgraph->n_threads_planned = 0;
     }
 }
 
@@ -9023,6 +9524,12 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.n_nodes      =*/ 0,
         /*.n_leafs      =*/ 0,
         /*.n_threads    =*/ 0,
+        /*.n_spin       =*/ 0,
+        /*.threadpool   =*/ NULL,
+        /*.abort_callback      =*/ NULL,
+        /*.abort_callback_data =*/ NULL,
+        /*.aborted      =*/ false,
+        /*.n_threads_planned   =*/ 0,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
         /*.nodes        =*/ { NULL },
@@ -9079,73 +9586,80 @@ struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cg
 //
 // thread data
 //
-// synchronization is done via busy loops
-// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
-//
-
-#ifdef __APPLE__
-
-//#include <os/lock.h>
-//
-//typedef os_unfair_lock ggml_lock_t;
+// synchronization is done via busy loops that fall back to sleeping on a condition variable
+// after n_spin iterations, so idle workers do not keep burning a core while the main thread
+// is busy with single-threaded work (or not computing at all)
 //
-//#define ggml_lock_init(x)    UNUSED(x)
-//#define ggml_lock_destroy(x) UNUSED(x)
-//#define ggml_lock_lock       os_unfair_lock_lock
-//#define ggml_lock_unlock     os_unfair_lock_unlock
-//
-//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
-
-typedef int ggml_lock_t;
-
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
-
-#define GGML_LOCK_INITIALIZER 0
 
 typedef pthread_t ggml_thread_t;
 
 #define ggml_thread_create pthread_create
 #define ggml_thread_join   pthread_join
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define ggml_cpu_relax() _mm_pause()
+#elif defined(__aarch64__)
+#define ggml_cpu_relax() __asm__ __volatile__("yield")
 #else
-
-//typedef pthread_spinlock_t ggml_lock_t;
-
-//#define ggml_lock_init(x) pthread_spin_init(x, PTHREAD_PROCESS_PRIVATE)
-//#define ggml_lock_destroy pthread_spin_destroy
-//#define ggml_lock_lock    pthread_spin_lock
-//#define ggml_lock_unlock  pthread_spin_unlock
-
-typedef int ggml_lock_t;
-
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
-
-#define GGML_LOCK_INITIALIZER 0
-
-typedef pthread_t ggml_thread_t;
-
-#define ggml_thread_create pthread_create
-#define ggml_thread_join   pthread_join
-
+#define ggml_cpu_relax()
 #endif
 
 struct ggml_compute_state_shared {
-    ggml_lock_t spin;
-
     int n_threads;
+    int n_spin; // busy-wait iterations before a waiting thread goes to sleep, < 0 to never sleep
 
     // synchronization primitives
     atomic_int  n_ready;
     atomic_bool has_work;
     atomic_bool stop; // stop all threads
+
+    // used only by the threads that ran out of spin iterations
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    atomic_int      n_sleeping;
 };
 
+typedef bool (*ggml_compute_wait_cond)(struct ggml_compute_state_shared * shared);
+
+static bool ggml_compute_has_work(struct ggml_compute_state_shared * shared) {
+    return atomic_load(&shared->has_work) || atomic_load(&shared->stop);
+}
+
+static bool ggml_compute_no_work(struct ggml_compute_state_shared * shared) {
+    return !atomic_load(&shared->has_work) || atomic_load(&shared->stop);
+}
+
+static bool ggml_compute_none_ready(struct ggml_compute_state_shared * shared) {
+    return atomic_load(&shared->n_ready) <= 0;
+}
+
+// spin until cond is satisfied, then sleep until another thread calls ggml_compute_notify()
+static void ggml_compute_wait(struct ggml_compute_state_shared * shared, ggml_compute_wait_cond cond) {
+    for (int i = 0; shared->n_spin < 0 || i < shared->n_spin; i++) {
+        if (cond(shared)) {
+            return;
+        }
+        ggml_cpu_relax();
+    }
+
+    pthread_mutex_lock(&shared->mutex);
+    atomic_fetch_add(&shared->n_sleeping, 1);
+    while (!cond(shared)) {
+        pthread_cond_wait(&shared->cond, &shared->mutex);
+    }
+    atomic_fetch_sub(&shared->n_sleeping, 1);
+    pthread_mutex_unlock(&shared->mutex);
+}
+
+// must be called after every change of n_ready, has_work or stop
+static void ggml_compute_notify(struct ggml_compute_state_shared * shared) {
+    if (atomic_load(&shared->n_sleeping) > 0) {
+        pthread_mutex_lock(&shared->mutex);
+        pthread_cond_broadcast(&shared->cond);
+        pthread_mutex_unlock(&shared->mutex);
+    }
+}
+
 struct ggml_compute_state {
     ggml_thread_t thrd;
 
@@ -9153,307 +9667,907 @@ struct ggml_compute_state {
     struct ggml_tensor * node;
 
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * pool; // NULL if the thread was created for a single graph
 };
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+struct ggml_threadpool {
+    int n_threads; // including the thread that calls ggml_graph_compute()
 
-    const int n_threads = state->shared->n_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
 
+    // guarded by mutex
+    int  n_graph;  // incremented every time a new graph is handed to the workers
+    int  n_active; // number of workers that take part in the current graph
+    int  n_busy;   // workers that have not finished the current graph yet
+    bool quit;
+
+    struct ggml_compute_state * workers;
+};
+
+#if defined(__linux__)
+// "0-3,8-11"
+static void ggml_numa_parse_list(const char * list, cpu_set_t * set) {
+    CPU_ZERO(set);
+
+    const char * p = list;
     while (true) {
-        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
-            atomic_store(&state->shared->has_work, false);
-        } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
+        char * end;
+        const long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1) {
+                break;
             }
+            p = end;
         }
-
-        atomic_fetch_sub(&state->shared->n_ready, 1);
-
-        // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
+        for (long i = first; i <= last && i < CPU_SETSIZE; i++) {
+            if (i >= 0) {
+                CPU_SET(i, set);
             }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
         }
-
-        // check if we should stop
-        if (atomic_load(&state->shared->stop)) {
+        if (*p != ',') {
             break;
         }
+        p++;
+    }
+}
 
-        if (state->node) {
-            if (state->params.ith < state->params.nth) {
-                ggml_compute_forward(&state->params, state->node);
-            }
+static bool ggml_numa_read_list(const char * path, cpu_set_t * set) {
+    char buf[4096];
 
-            state->node = NULL;
-        } else {
-            break;
-        }
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
     }
+    const bool ok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
 
-    return 0;
+    if (ok) {
+        ggml_numa_parse_list(buf, set);
+    }
+    return ok;
 }
+#endif
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    const int n_threads = cgraph->n_threads;
+void ggml_numa_init(enum ggml_numa_strategy strategy) {
+    g_numa.strategy = strategy;
+    g_numa.n_nodes  = 0;
 
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
-    };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+#if defined(__linux__)
+    if (strategy == GGML_NUMA_DISABLED) {
+        return;
+    }
 
-    // create thread pool
-    if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
+    cpu_set_t allowed;
+    cpu_set_t online;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ||
+        !ggml_numa_read_list("/sys/devices/system/node/online", &online)) {
+        return;
+    }
 
-        atomic_store(&state_shared.has_work, true);
+    int n_nodes = 0;
+    for (int id = 0; id < CPU_SETSIZE && n_nodes < GGML_NUMA_MAX_NODES; id++) {
+        if (!CPU_ISSET(id, &online)) {
+            continue;
+        }
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
-            };
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
 
-            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
+        cpu_set_t * cpus = &g_numa.cpus[n_nodes];
+        if (!ggml_numa_read_list(path, cpus)) {
+            continue;
+        }
+
+        // a node the process may not run on (numactl --cpunodebind) is left out
+        CPU_AND(cpus, cpus, &allowed);
+        if (CPU_COUNT(cpus) > 0) {
+            g_numa.ids[n_nodes++] = id;
         }
     }
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
-
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
-
-            switch (node->op) {
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_ADD:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_MUL:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_SUM:
-                case GGML_OP_MEAN:
-                case GGML_OP_REPEAT:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_GELU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SILU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_NORM:
-                case GGML_OP_RMS_NORM:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        node->n_tasks = n_threads;
-
-                        // TODO: use different scheduling for different matrix sizes
-                        //const int nr0 = ggml_nrows(node->src0);
-                        //const int nr1 = ggml_nrows(node->src1);
-
-                        //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                        //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
-
-                        size_t cur = 0;
-
-                        if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                   //       the threads are still spinning
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                                //printf("src0: ne0 = %d, ne1 = %d, ne = %d\n", node->src0->ne[0], node->src0->ne[1], node->src0->ne[0]*node->src0->ne[1]);
-                                //printf("src1: ne0 = %d, ne1 = %d, ne = %d\n", node->src1->ne[0], node->src1->ne[1], node->src1->ne[0]*node->src1->ne[1]);
-                                //printf("cur = %zu\n", cur);
-                            } else {
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
-                            }
+    g_numa.n_nodes = n_nodes > 1 ? n_nodes : 0;
+#endif
+}
+
+// run the calling thread on the cpus of the node of compute thread ith
+static void ggml_numa_pin_thread(int ith) {
+#if defined(__linux__)
+    if (ggml_is_numa()) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &g_numa.cpus[ith % g_numa.n_nodes]);
+    }
 #else
+    UNUSED(ith);
+#endif
+}
+
+struct ggml_numa_place_state {
+    struct ggml_tensor ** tensors;
+    int n_tensors;
+    int node; // index in g_numa
+};
+
+static thread_ret_t ggml_numa_place_thread(void * data) {
+#if defined(__linux__)
+    const struct ggml_numa_place_state * state = (const struct ggml_numa_place_state *) data;
+
+    const int n_nodes = g_numa.n_nodes;
+    const int node    = state->node;
+
+    ggml_numa_pin_thread(node);
+
+#if defined(SYS_set_mempolicy)
+    // the pages of shared file mappings follow the policy of the thread that faults them in, not mbind()
+    if (g_numa.strategy == GGML_NUMA_INTERLEAVE) {
+        const int bits = 8*sizeof(unsigned long);
+        unsigned long mask[CPU_SETSIZE/(8*sizeof(unsigned long))] = { 0 };
+        for (int k = 0; k < n_nodes; k++) {
+            mask[g_numa.ids[k]/bits] |= 1UL << (g_numa.ids[k]%bits);
+        }
+        syscall(SYS_set_mempolicy, 3 /* MPOL_INTERLEAVE */, mask, (unsigned long) CPU_SETSIZE);
+    }
+#endif
+
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+
+    for (int i = 0; i < state->n_tensors; i++) {
+        const struct ggml_tensor * t = state->tensors[i];
+
+        // same split as ggml_compute_rows()
+        const int64_t nr = (int64_t) t->ne[1]*t->ne[2]*t->ne[3];
+        const uintptr_t p0 = (uintptr_t) t->data + ((nr*node)/n_nodes)*t->nb[1];
+        const uintptr_t p1 = (uintptr_t) t->data + ((nr*(node + 1))/n_nodes)*t->nb[1];
+
+        // a page shared with the rows of the previous node is left to that node
+        for (uintptr_t p = (p0 + page - 1) & ~(page - 1); p < p1; p += page) {
+            (void) *(const volatile char *) p;
+        }
+    }
+#else
+    UNUSED(data);
+#endif
+
+    return 0;
+}
+
+void ggml_numa_place(struct ggml_tensor ** tensors, int n_tensors) {
+    if (!ggml_is_numa()) {
+        return;
+    }
+
+    ggml_thread_t threads[GGML_NUMA_MAX_NODES];
+    struct ggml_numa_place_state states[GGML_NUMA_MAX_NODES];
+
+    for (int k = 0; k < g_numa.n_nodes; k++) {
+        states[k] = (struct ggml_numa_place_state) {
+            .tensors   = tensors,
+            .n_tensors = n_tensors,
+            .node      = k,
+        };
+
+        int rc = ggml_thread_create(&threads[k], NULL, ggml_numa_place_thread, &states[k]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    for (int k = 0; k < g_numa.n_nodes; k++) {
+        int rc = ggml_thread_join(threads[k], NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+}
+
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_compute_state_shared * shared = state->shared;
+
+    const int n_threads = shared->n_threads;
+
+    // the threads of a pool are pinned once, when they start
+    if (state->pool == NULL) {
+        ggml_numa_pin_thread(state->params.ith);
+    }
+
+    while (true) {
+        if (atomic_fetch_add(&shared->n_ready, 1) == n_threads - 1) {
+            atomic_store(&shared->has_work, false);
+            ggml_compute_notify(shared);
+        } else {
+            ggml_compute_wait(shared, ggml_compute_no_work);
+            if (atomic_load(&shared->stop)) {
+                return 0;
+            }
+        }
+
+        atomic_fetch_sub(&shared->n_ready, 1);
+        ggml_compute_notify(shared);
+
+        // wait for work
+        ggml_compute_wait(shared, ggml_compute_has_work);
+
+        // check if we should stop
+        if (atomic_load(&shared->stop)) {
+            break;
+        }
+
+        if (state->node) {
+            if (state->params.ith < state->params.nth) {
+                ggml_compute_forward(&state->params, state->node);
+            }
+
+            state->node = NULL;
+        } else {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * pool  = state->pool;
+
+    const int ith = (int) (state - pool->workers) + 1;
+
+    ggml_numa_pin_thread(ith);
+
+    int n_graph = 0;
+
+    while (true) {
+        bool active = false;
+
+        // sleep until there is a new graph to compute
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->quit && pool->n_graph == n_graph) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        n_graph = pool->n_graph;
+        active  = ith <= pool->n_active;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (active) {
+            ggml_graph_compute_thread(state);
+
+            pthread_mutex_lock(&pool->mutex);
+            if (--pool->n_busy == 0) {
+                pthread_cond_broadcast(&pool->cond);
+            }
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    GGML_ASSERT(n_threads >= 1);
+
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->n_threads = n_threads;
+    pool->n_graph   = 0;
+    pool->n_active  = 0;
+    pool->n_busy    = 0;
+    pool->quit      = false;
+    pool->workers   = n_threads > 1 ? malloc(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init (&pool->cond,  NULL);
+
+    for (int j = 0; j < n_threads - 1; j++) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd   = 0,
+            .params = { 0 },
+            .node   = NULL,
+            .shared = NULL,
+            .pool   = pool,
+        };
+
+        int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_thread, &pool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    pthread_cond_destroy (&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
+//
+// graph allocator
+//
+
+#define GGML_ALLOC_MAX_FREE 256
+
+struct ggml_alloc_block {
+    size_t offs;
+    size_t size;
+};
+
+// the used part of the buffer ends at top, the free blocks below it are sorted by offset
+struct ggml_alloc_arena {
+    size_t top;
+    size_t peak;
+
+    int n_free;
+    struct ggml_alloc_block free[GGML_ALLOC_MAX_FREE];
+};
+
+static size_t ggml_alloc_arena_take(struct ggml_alloc_arena * arena, size_t size) {
+    // best fit, the top grows only when no free block is large enough
+    int best = -1;
+    for (int i = 0; i < arena->n_free; i++) {
+        if (arena->free[i].size >= size && (best < 0 || arena->free[i].size < arena->free[best].size)) {
+            best = i;
+        }
+    }
+
+    if (best < 0) {
+        const size_t offs = arena->top;
+        arena->top += size;
+        arena->peak = MAX(arena->peak, arena->top);
+        return offs;
+    }
+
+    struct ggml_alloc_block * block = &arena->free[best];
+    const size_t offs = block->offs;
+    block->offs += size;
+    block->size -= size;
+    if (block->size == 0) {
+        memmove(block, block + 1, (arena->n_free - best - 1)*sizeof(struct ggml_alloc_block));
+        arena->n_free--;
+    }
+
+    return offs;
+}
+
+static void ggml_alloc_arena_give(struct ggml_alloc_arena * arena, size_t offs, size_t size) {
+    if (offs + size == arena->top) {
+        arena->top = offs;
+
+        const struct ggml_alloc_block * last = arena->n_free > 0 ? &arena->free[arena->n_free - 1] : NULL;
+        if (last && last->offs + last->size == arena->top) {
+            arena->top = last->offs;
+            arena->n_free--;
+        }
+        return;
+    }
+
+    int i = 0;
+    while (i < arena->n_free && arena->free[i].offs < offs) {
+        i++;
+    }
+
+    const bool merge_prev = i > 0 && arena->free[i - 1].offs + arena->free[i - 1].size == offs;
+    const bool merge_next = i < arena->n_free && offs + size == arena->free[i].offs;
+
+    if (merge_prev && merge_next) {
+        arena->free[i - 1].size += size + arena->free[i].size;
+        memmove(&arena->free[i], &arena->free[i + 1], (arena->n_free - i - 1)*sizeof(struct ggml_alloc_block));
+        arena->n_free--;
+    } else if (merge_prev) {
+        arena->free[i - 1].size += size;
+    } else if (merge_next) {
+        arena->free[i].offs  = offs;
+        arena->free[i].size += size;
+    } else if (arena->n_free < GGML_ALLOC_MAX_FREE) {
+        memmove(&arena->free[i + 1], &arena->free[i], (arena->n_free - i)*sizeof(struct ggml_alloc_block));
+        arena->free[i] = (struct ggml_alloc_block) { offs, size };
+        arena->n_free++;
+    }
+    // else the block is not reused by this graph
+}
+
+struct ggml_alloc_info {
+    const struct ggml_tensor * tensor;
+
+    int  n_children; // nodes that have not read the tensor yet
+    int  n_views;    // views of the tensor that are still read
+    bool output;     // read after the graph, never released
+    bool placed;
+    bool released;
+
+    size_t offs;
+};
+
+struct ggml_graph_allocator {
+    char * buffer; // NULL to measure
+    size_t size;
+
+    struct ggml_alloc_arena arena;
+
+    int n_infos; // power of 2
+    struct ggml_alloc_info * infos;
+};
+
+static struct ggml_alloc_info * ggml_alloc_get_info(struct ggml_graph_allocator * alloc, const struct ggml_tensor * tensor) {
+    int i = (int) (((uintptr_t) tensor/GGML_MEM_ALIGN)*2654435761u) & (alloc->n_infos - 1);
+    while (alloc->infos[i].tensor != NULL && alloc->infos[i].tensor != tensor) {
+        i = (i + 1) & (alloc->n_infos - 1);
+    }
+    alloc->infos[i].tensor = tensor;
+    return &alloc->infos[i];
+}
+
+static size_t ggml_alloc_size(const struct ggml_tensor * tensor) {
+    return ((ggml_nbytes(tensor) + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
+}
+
+static void ggml_alloc_place(struct ggml_graph_allocator * alloc, struct ggml_tensor * tensor) {
+    if (tensor->view_src != NULL) {
+        ggml_alloc_place(alloc, tensor->view_src);
+        if (alloc->buffer != NULL && tensor->data == NULL && tensor->view_src->data != NULL) {
+            tensor->data = (char *) tensor->view_src->data + tensor->view_offs;
+        }
+        return;
+    }
+
+    if (!tensor->deferred) {
+        return;
+    }
+
+    struct ggml_alloc_info * info = ggml_alloc_get_info(alloc, tensor);
+    if (info->placed || info->released) {
+        return;
+    }
+
+    const size_t size = ggml_alloc_size(tensor);
+
+    info->offs   = ggml_alloc_arena_take(&alloc->arena, size);
+    info->placed = true;
+
+    if (alloc->buffer != NULL && info->offs + size <= alloc->size) {
+        tensor->data = alloc->buffer + info->offs;
+    }
+}
+
+// called when no node reads the tensor anymore
+static void ggml_alloc_release(struct ggml_graph_allocator * alloc, struct ggml_tensor * tensor) {
+    if (tensor->view_src != NULL) {
+        struct ggml_alloc_info * info = ggml_alloc_get_info(alloc, tensor->view_src);
+        if (--info->n_views == 0 && info->n_children == 0) {
+            ggml_alloc_release(alloc, tensor->view_src);
+        }
+        return;
+    }
+
+    struct ggml_alloc_info * info = ggml_alloc_get_info(alloc, tensor);
+    if (info->placed && !info->output) {
+        ggml_alloc_arena_give(&alloc->arena, info->offs, ggml_alloc_size(tensor));
+        info->placed   = false;
+        info->released = true;
+    }
+}
+
+size_t ggml_graph_alloc(
+        struct ggml_cgraph * cgraph,
+        void * buffer,
+        size_t size,
+        struct ggml_tensor ** outputs,
+        int n_outputs) {
+    struct ggml_graph_allocator alloc = {
+        /*.buffer  =*/ buffer,
+        /*.size    =*/ size,
+        /*.arena   =*/ { 0 },
+        /*.n_infos =*/ 16,
+        /*.infos   =*/ NULL,
+    };
+
+    while (alloc.n_infos < 2*(cgraph->n_nodes + cgraph->n_leafs)) {
+        alloc.n_infos *= 2;
+    }
+    alloc.infos = calloc(alloc.n_infos, sizeof(struct ggml_alloc_info));
+    GGML_ASSERT(alloc.infos != NULL);
+
+    for (int i = 0; i < n_outputs; i++) {
+        struct ggml_tensor * t = outputs[i]->view_src ? outputs[i]->view_src : outputs[i];
+        ggml_alloc_get_info(&alloc, t)->output = true;
+    }
+
+    for (int i = 0; i < cgraph->n_leafs; i++) {
+        if (cgraph->leafs[i]->view_src) {
+            ggml_alloc_get_info(&alloc, cgraph->leafs[i]->view_src)->n_views++;
+        }
+    }
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (node->view_src) {
+            ggml_alloc_get_info(&alloc, node->view_src)->n_views++;
+        }
+
+        struct ggml_tensor * parents[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+        memcpy(parents + 2, node->opt, sizeof(node->opt));
+
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            if (parents[j]) {
+                ggml_alloc_get_info(&alloc, parents[j])->n_children++;
+            }
+        }
+    }
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        struct ggml_tensor * parents[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+        memcpy(parents + 2, node->opt, sizeof(node->opt));
+
+        // the deferred leafs are placed when they are first read
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            if (parents[j]) {
+                ggml_alloc_place(&alloc, parents[j]);
+            }
+        }
+
+        ggml_alloc_place(&alloc, node);
+
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            if (parents[j]) {
+                struct ggml_alloc_info * info = ggml_alloc_get_info(&alloc, parents[j]);
+                if (--info->n_children == 0 && info->n_views == 0) {
+                    ggml_alloc_release(&alloc, parents[j]);
+                }
+            }
+        }
+
+        // only written, e.g. a copy to a view
+        struct ggml_alloc_info * info = ggml_alloc_get_info(&alloc, node);
+        if (info->n_children == 0 && info->n_views == 0) {
+            ggml_alloc_release(&alloc, node);
+        }
+    }
+
+    free(alloc.infos);
+
+    return alloc.arena.peak;
+}
+
+// sets the number of tasks of every node, returns the size of the work buffer needed by the graph
+static size_t ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
+    size_t work_size = 0;
+
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        switch (node->op) {
+            case GGML_OP_DUP:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_ADD:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_SUB:
+            case GGML_OP_MUL:
+            case GGML_OP_DIV:
+            case GGML_OP_SQR:
+            case GGML_OP_SQRT:
+            case GGML_OP_SUM:
+            case GGML_OP_MEAN:
+            case GGML_OP_REPEAT:
+            case GGML_OP_ABS:
+            case GGML_OP_SGN:
+            case GGML_OP_NEG:
+            case GGML_OP_STEP:
+            case GGML_OP_RELU:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_GELU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_SILU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_NORM:
+            case GGML_OP_RMS_NORM:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    node->n_tasks = n_threads;
+
+                    // TODO: use different scheduling for different matrix sizes
+                    //const int nr0 = ggml_nrows(node->src0);
+                    //const int nr1 = ggml_nrows(node->src1);
+
+                    //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
+
+                    size_t cur = 0;
+
+                    if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1; // TODO: this actually is doing nothing
+                                               //       the threads are still spinning
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                            //printf("src0: ne0 = %d, ne1 = %d, ne = %d\n", node->src0->ne[0], node->src0->ne[1], node->src0->ne[0]*node->src0->ne[1]);
+                            //printf("src1: ne0 = %d, ne1 = %d, ne = %d\n", node->src1->ne[0], node->src1->ne[1], node->src1->ne[0]*node->src1->ne[1]);
+                            //printf("cur = %zu\n", cur);
+                        } else {
                             cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+                        }
+#else
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
 #endif
-                        } else if (node->src0->type == GGML_TYPE_F32 && node->src1->type == GGML_TYPE_F32) {
-                            cur = 0;
-                        } else if (quantize_fns[node->src0->type].vec_dot_q && node->src1->type == GGML_TYPE_F32) {
+                    } else if (node->src0->type == GGML_TYPE_F32 && node->src1->type == GGML_TYPE_F32) {
+                        cur = 0;
+                    } else if (quantize_fns[node->src0->type].vec_dot_q && node->src1->type == GGML_TYPE_F32) {
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1;
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            } else
+                        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1;
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                        } else
 #endif
-                            {
-                                cur = GGML_TYPE_SIZE[node->src0->type]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[node->src0->type];
-                            }
-                        } else {
-                            GGML_ASSERT(false);
+                        {
+                            cur = GGML_TYPE_SIZE[node->src0->type]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[node->src0->type];
                         }
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_CPY:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_DIAG_MASK_INF:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ROPE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_CONV_1D_1S:
-                case GGML_OP_CONV_1D_2S:
-                    {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
-
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_CPY:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+            case GGML_OP_GET_ROWS:
+            case GGML_OP_DIAG_MASK_INF:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_SOFT_MAX:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_ROPE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_CONV_1D_1S:
+            case GGML_OP_CONV_1D_2S:
+                {
+                    node->n_tasks = n_threads;
+
+                    GGML_ASSERT(node->src0->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[2] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
+
+                    size_t cur = 0;
+                    const int nk = node->src0->ne[0];
+
+                    if (node->src0->type == GGML_TYPE_F16 &&
+                        node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        const int ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+                    const int ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        // S and a row of the values in F32, S and a row of q in F16
+                        cur = sizeof(float)*2*(ne11 + node->src1->ne[0])*node->n_tasks;
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_FF:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        GGML_ASSERT(false);
-                    } break;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_NONE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    GGML_ASSERT(false);
+                } break;
+        }
+    }
+
+    return work_size > 0 ? work_size + CACHE_LINE_SIZE*(n_threads - 1) : 0;
+}
+
+size_t ggml_graph_work_size(struct ggml_cgraph * cgraph) {
+    return ggml_graph_plan(cgraph, cgraph->n_threads);
+}
+
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    const int n_threads = cgraph->n_threads;
+
+    struct ggml_threadpool * pool = cgraph->threadpool;
+    GGML_ASSERT(pool == NULL || n_threads <= pool->n_threads);
+
+    struct ggml_compute_state_shared state_shared = {
+        /*.n_threads  =*/ n_threads,
+        /*.n_spin     =*/ cgraph->n_spin == 0 ? GGML_DEFAULT_N_SPIN : cgraph->n_spin,
+        /*.n_ready    =*/ 0,
+        /*.has_work   =*/ false,
+        /*.stop       =*/ false,
+        // initialized with pthread_mutex_init() and pthread_cond_init() when there are workers
+        /*.mutex      =*/ PTHREAD_MUTEX_INITIALIZER,
+        /*.cond       =*/ PTHREAD_COND_INITIALIZER,
+        /*.n_sleeping =*/ 0,
+    };
+    struct ggml_compute_state * workers = NULL;
+    if (n_threads > 1) {
+        workers = pool ? pool->workers : alloca(sizeof(struct ggml_compute_state)*(n_threads - 1));
+    }
+
+#if defined(__linux__)
+    // the calling thread computes the rows of thread 0, it gets its cpus back at the end
+    cpu_set_t caller_cpus;
+    const bool caller_pinned = ggml_is_numa() && n_threads >= g_numa.n_nodes &&
+        pthread_getaffinity_np(pthread_self(), sizeof(caller_cpus), &caller_cpus) == 0;
+    if (caller_pinned) {
+        ggml_numa_pin_thread(0);
+    }
+#endif
+
+    // create thread pool
+    if (n_threads > 1) {
+        pthread_mutex_init(&state_shared.mutex, NULL);
+        pthread_cond_init (&state_shared.cond,  NULL);
+        atomic_store(&state_shared.n_sleeping, 0);
+
+        atomic_store(&state_shared.has_work, true);
+
+        for (int j = 0; j < n_threads - 1; j++) {
+            workers[j].params = (struct ggml_compute_params) {
+                .type  = GGML_TASK_COMPUTE,
+                .ith   = j + 1,
+                .nth   = n_threads,
+                .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+                .wdata = cgraph->work ? cgraph->work->data : NULL,
+            };
+            workers[j].node   = NULL;
+            workers[j].shared = &state_shared;
+
+            if (pool == NULL) {
+                workers[j].thrd = 0;
+                workers[j].pool = NULL;
+
+                int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+                GGML_ASSERT(rc == 0);
+                UNUSED(rc);
             }
         }
 
+        // wake up the persistent workers
+        if (pool) {
+            pthread_mutex_lock(&pool->mutex);
+            pool->n_active = n_threads - 1;
+            pool->n_busy   = n_threads - 1;
+            pool->n_graph++;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+
+    // initialize tasks + work buffer, a graph computed again with as many threads keeps them
+    if (cgraph->n_threads_planned != n_threads) {
+        const size_t work_size = ggml_graph_plan(cgraph, n_threads);
+
         if (cgraph->work != NULL && work_size > cgraph->work_size) {
             GGML_ASSERT(false); // TODO: better handling
         }
 
         if (work_size > 0 && cgraph->work == NULL) {
-            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+            cgraph->work_size = work_size;
 
             GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
             cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
         }
+
+        cgraph->n_threads_planned = n_threads;
     }
 
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
+    cgraph->aborted = false;
+
     for (int i = 0; i < cgraph->n_nodes; i++) {
         GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
 
         struct ggml_tensor * node = cgraph->nodes[i];
 
+        // the workers are waiting for the next node, so they can be released at this point
+        if (cgraph->abort_callback && cgraph->abort_callback(cgraph->abort_callback_data)) {
+            cgraph->aborted = true;
+            break;
+        }
+
         // TODO: this could be used to avoid unnecessary computations, but it needs to be improved
         //if (node->grad == NULL && node->perf_runs > 0) {
         //    continue;
@@ -9477,12 +10591,10 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         if (node->n_tasks > 1) {
             if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
                 atomic_store(&state_shared.has_work, false);
+                ggml_compute_notify(&state_shared);
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(&state_shared, ggml_compute_no_work);
 
             // launch thread pool
             for (int j = 0; j < n_threads - 1; j++) {
@@ -9497,13 +10609,12 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             }
 
             atomic_fetch_sub(&state_shared.n_ready, 1);
+            ggml_compute_notify(&state_shared);
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(&state_shared, ggml_compute_none_ready);
 
             atomic_store(&state_shared.has_work, true);
+            ggml_compute_notify(&state_shared);
         }
 
         params.type = GGML_TASK_COMPUTE;
@@ -9513,31 +10624,25 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         if (node->n_tasks > 1) {
             if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
                 atomic_store(&state_shared.has_work, false);
+                ggml_compute_notify(&state_shared);
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(&state_shared, ggml_compute_no_work);
 
             atomic_fetch_sub(&state_shared.n_ready, 1);
+            ggml_compute_notify(&state_shared);
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(&state_shared, ggml_compute_none_ready);
         }
 
         // FINALIZE
         if (node->n_tasks > 1) {
             if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
                 atomic_store(&state_shared.has_work, false);
+                ggml_compute_notify(&state_shared);
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(&state_shared, ggml_compute_no_work);
 
             // launch thread pool
             for (int j = 0; j < n_threads - 1; j++) {
@@ -9552,13 +10657,12 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             }
 
             atomic_fetch_sub(&state_shared.n_ready, 1);
+            ggml_compute_notify(&state_shared);
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(&state_shared, ggml_compute_none_ready);
 
             atomic_store(&state_shared.has_work, true);
+            ggml_compute_notify(&state_shared);
         }
 
         params.type = GGML_TASK_FINALIZE;
@@ -9568,19 +10672,15 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         if (node->n_tasks > 1) {
             if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
                 atomic_store(&state_shared.has_work, false);
+                ggml_compute_notify(&state_shared);
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(&state_shared, ggml_compute_no_work);
 
             atomic_fetch_sub(&state_shared.n_ready, 1);
+            ggml_compute_notify(&state_shared);
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(&state_shared, ggml_compute_none_ready);
         }
 
         // performance stats (node)
@@ -9598,14 +10698,25 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     if (n_threads > 1) {
         atomic_store(&state_shared.stop, true);
         atomic_store(&state_shared.has_work, true);
+        ggml_compute_notify(&state_shared);
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
+        if (pool) {
+            // the workers go back to sleep once they are done with this graph
+            pthread_mutex_lock(&pool->mutex);
+            while (pool->n_busy > 0) {
+                pthread_cond_wait(&pool->cond, &pool->mutex);
+            }
+            pthread_mutex_unlock(&pool->mutex);
+        } else {
+            for (int j = 0; j < n_threads - 1; j++) {
+                int rc = ggml_thread_join(workers[j].thrd, NULL);
+                GGML_ASSERT(rc == 0);
+                UNUSED(rc);
+            }
         }
 
-        ggml_lock_destroy(&state_shared.spin);
+        pthread_cond_destroy (&state_shared.cond);
+        pthread_mutex_destroy(&state_shared.mutex);
     }
 
     // performance stats (graph)
@@ -9624,6 +10735,12 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 (double) perf_time_us_cur     / 1000.0,
                 (double) cgraph->perf_time_us / 1000.0 / cgraph->perf_runs);
     }
+
+#if defined(__linux__)
+    if (caller_pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(caller_cpus), &caller_cpus);
+    }
+#endif
 }
 
 void ggml_graph_reset(struct ggml_cgraph * cgraph) {
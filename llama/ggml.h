@@ -200,6 +200,7 @@ struct ggml_context;
 enum ggml_type {
     GGML_TYPE_Q4_0,
     GGML_TYPE_Q4_1,
+    GGML_TYPE_Q8_0,
     GGML_TYPE_I8,
     GGML_TYPE_I16,
     GGML_TYPE_I32,
@@ -283,14 +284,37 @@ struct ggml_tensor {
     int64_t perf_time_us;
 
     void * data;
-    char padding[8];
+
+    // a view shares the data of view_src from view_offs on
+    struct ggml_tensor * view_src;
+    size_t view_offs;
+
+    bool deferred; // the data is placed by ggml_graph_alloc()
+
+    char padding[7];
 };
 
+// default number of busy-wait iterations in the compute threads before they go to sleep
+#define GGML_DEFAULT_N_SPIN 8192
+
+struct ggml_threadpool;
+
 // computation graph
 struct ggml_cgraph {
     int n_nodes;
     int n_leafs;
     int n_threads;
+    int n_spin; // busy-wait iterations before a waiting thread sleeps, 0 for GGML_DEFAULT_N_SPIN, < 0 to never sleep
+
+    // optional persistent worker threads - if NULL, the threads are created on every ggml_graph_compute()
+    struct ggml_threadpool * threadpool;
+
+    // optional, called by the main thread before every node - the computation stops when it returns true
+    bool (*abort_callback)(void * data);
+    void * abort_callback_data;
+    bool   aborted; // set by ggml_graph_compute() when the computation was stopped
+
+    int n_threads_planned; // the tasks of the nodes are set for this many threads, 0 for not yet
 
     size_t work_size;
     struct ggml_tensor * work;
@@ -342,6 +366,14 @@ void ggml_free(struct ggml_context * ctx);
 
 size_t ggml_used_mem(const struct ggml_context * ctx);
 
+// memory pool bytes taken by a tensor besides its data
+size_t ggml_tensor_overhead(void);
+
+// the memory a no_alloc context would use if the data of its tensors was allocated
+size_t ggml_measured_mem(const struct ggml_context * ctx);
+
+// a scratch buffer with size > 0 and no data defers the tensors created while it is set: they get their data
+// from ggml_graph_alloc(), ggml_set_scratch() still returns how much of the buffer they would have used
 size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch);
 
 bool ggml_mlock_supported(void);
@@ -558,6 +590,16 @@ struct ggml_tensor * ggml_view_2d(
         size_t                nb1, // row stride in bytes
         size_t                offset);
 
+struct ggml_tensor * ggml_view_3d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        size_t                nb1, // row stride in bytes
+        size_t                nb2, // slice stride in bytes
+        size_t                offset);
+
 struct ggml_tensor * ggml_permute(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -613,6 +655,8 @@ struct ggml_tensor * ggml_conv_1d_2s(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// soft_max(k*q/sqrt(D))*v without writing the scores, with q: [D, N, ...], k: [D, M, ...], v: [M, D, ...]
+// if masked, the keys after M - N + i are masked for the i-th query
 struct ggml_tensor * ggml_flash_attn(
         struct ggml_context * ctx,
         struct ggml_tensor  * q,
@@ -620,6 +664,17 @@ struct ggml_tensor * ggml_flash_attn(
         struct ggml_tensor  * v,
         bool                  masked);
 
+// the keys after n_past + i are masked for the i-th query, as in ggml_diag_mask_inf(), and not computed
+// if v_trans, v is [M, D, ...] as in ggml_flash_attn(), otherwise it has the layout of k
+// k and v are F16 or F32, an F32 q with F16 keys is converted
+struct ggml_tensor * ggml_flash_attn_past(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        int                   n_past,
+        bool                  v_trans);
+
 struct ggml_tensor * ggml_flash_ff(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -642,8 +697,51 @@ struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
 struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
+
+// size of the work buffer ggml_graph_compute() allocates in its context for cgraph->n_threads threads
+size_t ggml_graph_work_size(struct ggml_cgraph * cgraph);
+
+// gives the deferred tensors of the graph their data in buffer, reusing the memory of a tensor once
+// every node that reads it (directly or through a view) has been computed; outputs are kept alive
+// returns the peak size of the buffer, the graph only got its data if that is <= size
+// a NULL buffer only measures
+size_t ggml_graph_alloc(
+        struct ggml_cgraph * cgraph,
+        void * buffer,
+        size_t size,
+        struct ggml_tensor ** outputs,
+        int n_outputs);
+
 void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+// thread pool that is created once and reused by every graph computation
+// n_threads includes the thread calling ggml_graph_compute(), so n_threads - 1 workers are started
+// a graph using the pool must have cgraph->n_threads <= ggml_threadpool_n_threads(pool)
+struct ggml_threadpool * ggml_threadpool_new (int n_threads);
+void                     ggml_threadpool_free(struct ggml_threadpool * pool);
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool);
+
+// NUMA
+//
+// on a system with several nodes, compute thread ith runs on the cpus of node ith % n_nodes and the rows of a
+// matrix multiplication are split between the nodes before the threads, so a thread multiplies the rows that
+// ggml_numa_place() faulted in on its node
+enum ggml_numa_strategy {
+    GGML_NUMA_DISABLED   = 0,
+    GGML_NUMA_DISTRIBUTE = 1, // the rows multiplied by the threads of a node are placed on that node
+    GGML_NUMA_INTERLEAVE = 2, // the pages are spread round-robin over the nodes
+};
+
+// reads the nodes from sysfs, only the cpus the process may run on count (numactl --cpunodebind, taskset)
+// call it before computing any graph, NUMA stays off on a single node or when the nodes cannot be read
+void ggml_numa_init(enum ggml_numa_strategy strategy);
+bool ggml_is_numa(void);
+
+// fault in the pages of the tensors from threads running on each node, following the strategy
+// the pages already in memory, for example in the page cache, stay where they are
+void ggml_numa_place(struct ggml_tensor ** tensors, int n_tensors);
+
 // print info and performance information for the graph
 void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
@@ -756,6 +854,29 @@ enum ggml_opt_result ggml_opt(
 size_t ggml_quantize_q4_0(const float * src, void * dst, int n, int k, int64_t * hist);
 size_t ggml_quantize_q4_1(const float * src, void * dst, int n, int k, int64_t * hist);
 
+//
+// internal types and functions exposed for the row-wise conversion of quantized data
+//
+
+#ifdef  __cplusplus
+#define GGML_RESTRICT
+#else
+#define GGML_RESTRICT restrict
+#endif
+
+typedef void (*dequantize_row_q_t)(const void * GGML_RESTRICT x, float * GGML_RESTRICT y, int k);
+typedef void (*quantize_row_q_t)(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int k);
+typedef void (*vec_dot_q_t)(const int n, float * GGML_RESTRICT s, const void * GGML_RESTRICT x, const void * GGML_RESTRICT y);
+
+typedef struct {
+    dequantize_row_q_t dequantize_row_q;
+    quantize_row_q_t   quantize_row_q;
+    vec_dot_q_t        vec_dot_q;
+} quantize_fns_t;
+
+// all members are NULL for the types that are not quantized
+quantize_fns_t ggml_internal_get_quantize_fn(size_t i);
+
 //
 // system info
 //
@@ -7,10 +7,12 @@
 #include <random>
 #include <map>
 #include <unordered_map>
-#include <queue>
+#include <algorithm>
 #include <regex>
 #include <cassert>
 #include <cstring>
+#include <sstream>
+#include <thread>
 
 #if defined(_WIN32) && !defined(_POSIX_MAPPED_FILES)
 #define WIN32_LEAN_AND_MEAN
@@ -26,7 +28,6 @@
 #define Max(X, Y) ((Y) < (X) ? (X) : (Y))
 
 #define LLAMA_USE_SCRATCH
-#define LLAMA_MAX_SCRATCH_BUFFERS 16
 
 #define LLAMA_ASSERT(x) \
     do { \
@@ -56,25 +57,7 @@ enum e_model {
 
 static const size_t MB = 1024*1024;
 
-// computed for n_ctx == 2048
-// TODO: dynamically determine these sizes
-//       needs modifications in ggml
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH0 = {
-    { MODEL_7B,    512ull*MB },
-    { MODEL_13B,   512ull*MB },
-    { MODEL_30B,   512ull*MB },
-    { MODEL_65B,   512ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH1 = {
-    { MODEL_7B,    512ull*MB },
-    { MODEL_13B,   512ull*MB },
-    { MODEL_30B,   512ull*MB },
-    { MODEL_65B,   512ull*MB },
-};
-
-// 2*n_embd*n_ctx*n_layer*sizeof(float16)
+// 2*n_embd*n_ctx*n_layer*sizeof(float16) for n_ctx == 2048
 static const std::map<e_model, size_t> MEM_REQ_KV_SELF = {
     { MODEL_7B,   1026ull*MB },
     { MODEL_13B,  1608ull*MB },
@@ -82,15 +65,6 @@ static const std::map<e_model, size_t> MEM_REQ_KV_SELF = {
     { MODEL_65B,  5120ull*MB },
 };
 
-// this is mostly needed for temporary mul_mat buffers to dequantize the data
-// not actually needed if BLAS is disabled
-static const std::map<e_model, size_t> MEM_REQ_EVAL = {
-    { MODEL_7B,   768ull*MB },
-    { MODEL_13B, 1024ull*MB },
-    { MODEL_30B, 1280ull*MB },
-    { MODEL_65B, 1536ull*MB },
-};
-
 // default hparams (LLaMA 7B)
 struct llama_hparams {
     int32_t n_vocab = 32000;
@@ -123,21 +97,62 @@ struct llama_layer {
 };
 
 struct llama_kv_cache {
-    struct ggml_tensor * k;
-    struct ggml_tensor * v;
+    struct ggml_tensor * k = NULL;
+    struct ggml_tensor * v = NULL;
 
-    struct ggml_context * ctx;
+    struct ggml_context * ctx = NULL;
 
     std::vector<uint8_t> buf;
 
     int n; // number of tokens currently in the cache
+
+    int n_ctx = 0; // number of positions per layer
+
+    // the values of each layer are [n_embd][n_ctx] instead of [n_ctx][n_embd], in the orientation the
+    // attention reads them: a new position is scattered over n_embd rows, the values are never transposed
+    bool v_trans = false;
+
+    // session file mapped copy-on-write, k->data and v->data point into it instead of buf when set
+    void * mm_addr = NULL;
+    uint64_t mm_length = 0;
+
+    void * k_data = NULL; // k->data and v->data in buf
+    void * v_data = NULL;
+};
+
+struct llama_vocab {
+    using id    = int32_t;
+    using token = std::string;
+
+    struct token_score {
+        token tok;
+        float score;
+    };
+
+    std::unordered_map<token, id> token_to_id;
+    std::vector<token_score> id_to_token;
+
+    // open addressing table of the ids by the hash of their text, so the tokenizer can look up
+    // a range of the input without building a std::string
+    std::vector<id> lookup;
+
+    // the pairs of bytes that occur next to each other inside a token, indexed by 256*first + second
+    // no merge can cross two bytes that are not in it
+    std::vector<bool> joined;
+
+    void build_lookup();
+    id find(const char * text, size_t n) const;
+    bool can_split(const char * text, size_t pos) const;
 };
 
+// the weights and the vocabulary, read-only once loaded and shared by all the contexts created with them
 struct llama_model {
     e_model type = MODEL_UNKNOWN;
 
     llama_hparams hparams;
 
+    llama_vocab vocab;
+
     struct ggml_tensor * tok_embeddings;
 
     struct ggml_tensor * norm;
@@ -146,11 +161,7 @@ struct llama_model {
     std::vector<llama_layer> layers;
 
     // context
-    struct ggml_context * ctx;
-
-    // key + value cache for the self attention
-    // TODO: move to llama_state
-    struct llama_kv_cache kv_self;
+    struct ggml_context * ctx = NULL;
 
     // the model memory buffer
     std::vector<uint8_t> buf;
@@ -162,22 +173,86 @@ struct llama_model {
     // tensors
     int n_loaded;
     std::unordered_map<std::string, struct ggml_tensor *> tensors;
+
+    int64_t t_start_us = 0;
+    int64_t t_load_us  = 0;
 };
 
-struct llama_vocab {
-    using id    = int32_t;
-    using token = std::string;
+struct llama_sampler_candidate {
+    float logit;
+    float p;   // probability, valid when llama_sampler::has_probs is set
+    float key; // per-stage sort key
+    llama_vocab::id id;
+};
 
-    struct token_score {
-        token tok;
-        float score;
+struct llama_sampler {
+    std::vector<llama_sampler_stage> stages;
+
+    // reserved when the context is created and reused for every sampled token
+    std::vector<llama_sampler_candidate> candidates;
+    std::vector<llama_vocab::id>         penalty_tokens;
+
+    bool by_id     = false; // candidates[i].id == i
+    bool sorted    = false; // candidates are sorted by descending logit
+    bool has_probs = false; // candidates[i].p is up to date with the logits
+};
+
+struct llama_sp_symbol {
+    using index = int;
+    index prev;
+    index next;
+    const char * text;
+    size_t n;
+};
+
+struct llama_sp_bigram {
+    struct comparator {
+        bool operator()(const llama_sp_bigram & l, const llama_sp_bigram & r) const {
+            return (l.score < r.score) || (l.score == r.score && l.left > r.left);
+        }
     };
+    using queue_storage = std::vector<llama_sp_bigram>;
+    llama_sp_symbol::index left;
+    llama_sp_symbol::index right;
+    float score;
+    size_t size;
+};
 
-    std::unordered_map<token, id> token_to_id;
-    std::vector<token_score> id_to_token;
+// buffers of the tokenizer, kept by the context so tokenizing does not allocate once they have grown
+struct llama_tokenizer_scratch {
+    std::vector<llama_sp_symbol> symbols;
+    llama_sp_bigram::queue_storage work_queue; // binary heap ordered by llama_sp_bigram::comparator
+    std::vector<llama_vocab::id> output;
+};
+
+// graph of the single token evals, built once for n_kv positions of the KV cache and reused while
+// n_past < n_kv: the positions after n_past are masked, the ops that depend on n_past are patched
+struct llama_decode_graph {
+    std::vector<uint8_t> buf;
+
+    struct ggml_context * ctx = NULL;
+
+    ggml_cgraph gf;
+
+    int n_kv   = 0; // 0 when no graph is built
+    int n_past = 0; // the graph is patched for
+
+    // the data of the KV cache when the graph was built, a mapped session moves it
+    void * k_data = NULL;
+    void * v_data = NULL;
+
+    struct ggml_tensor * embd       = NULL;
+    struct ggml_tensor * logits     = NULL;
+    struct ggml_tensor * embeddings = NULL;
+
+    std::vector<struct ggml_tensor *> n_past_params; // i32 params of the rope, mask and attention ops, n_past first
+    std::vector<std::pair<struct ggml_tensor *, size_t>> kv_stores; // views of the KV cache the new key and value go to, bytes per position
 };
 
+// the state of one session: KV cache, logits, compute buffers and RNG
 struct llama_context {
+    llama_context(llama_model & model) : model(model), vocab(model.vocab) {}
+
     std::mt19937 rng;
 
     int64_t t_load_us = 0;
@@ -192,8 +267,14 @@ struct llama_context {
     int32_t n_eval   = 0; // number of eval calls
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
 
-    llama_model model;
-    llama_vocab vocab;
+    llama_model & model;
+    llama_vocab & vocab;
+
+    // the model is freed with the context when it was loaded by llama_init_from_file()
+    bool model_owner = false;
+
+    // key + value cache for the self attention
+    struct llama_kv_cache kv_self;
 
     size_t mem_per_token = 0;
 
@@ -204,42 +285,53 @@ struct llama_context {
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
 
-    // memory buffers used to evaluate the model
-    // TODO: move in llama_state
-    std::vector<uint8_t> buf_compute;
-    std::vector<uint8_t> buf_scratch[LLAMA_MAX_SCRATCH_BUFFERS];
+    llama_sampler sampler;
 
-    int    buf_last = 0;
-    size_t buf_max_size[LLAMA_MAX_SCRATCH_BUFFERS] = { 0 };
+    llama_tokenizer_scratch tokenizer_scratch;
 
-    void use_buf(struct ggml_context * ctx, int i) {
-#if defined(LLAMA_USE_SCRATCH)
-        size_t last_size = 0;
+    // one per chunk of llama_tokenize_parallel()
+    std::vector<llama_tokenizer_scratch> tokenizer_chunks;
 
-        if (i == -1) {
-            last_size = ggml_set_scratch(ctx, { 0, 0, nullptr, });
-        } else {
-            auto & buf = buf_scratch[i];
-            last_size = ggml_set_scratch(ctx, { 0, buf.size(), buf.data(), });
-        }
+    // persistent worker threads used by ggml_graph_compute()
+    struct ggml_threadpool * threadpool = nullptr;
+    int n_spin = 0;
 
-        if (buf_last >= 0) {
-            buf_max_size[buf_last] = Max(buf_max_size[buf_last], last_size);
-        }
+    // positions of the KV cache covered by each decode graph, 0 to build the graph of every eval
+    int n_graph_bucket = 0;
+    llama_decode_graph decode_graph;
 
-        buf_last = i;
-#else
-        (void) i;
-        (void) ctx;
-#endif
-    }
+    // fused attention for the F16 and F32 KV caches, see llama_context_params
+    bool flash_attn = false;
 
-    size_t get_buf_max_mem(int i) const {
+    // checked between the nodes of the graph, stops llama_eval() when it returns true
+    llama_abort_callback abort_callback = nullptr;
+    void * abort_callback_data = nullptr;
+
+    bool eval_aborted    = false; // the last eval was stopped by an abort callback
+    bool batch_evaluated = false; // the group of the context was evaluated by the last llama_eval_batch()
+
+    // memory buffers used to evaluate the model, sized by llama_measure_eval() for n_batch tokens
+    // TODO: move in llama_state
+    std::vector<uint8_t> buf_compute;
+
+    // data of the intermediate tensors, placed by ggml_graph_alloc() so a tensor's memory is reused once
+    // the nodes that read it are computed
+    std::vector<uint8_t> buf_alloc;
+    size_t alloc_peak = 0;
+
+    int n_batch       = 0; // most tokens of an eval
+    int n_threads_max = 1; // most threads of an eval
+
+    // tensor headers of the graphs built by llama_measure_eval()
+    std::vector<uint8_t> buf_measure;
+
+    // the tensors created while i != -1 are deferred to buf_alloc
+    void use_buf(struct ggml_context * ctx, int i) {
 #if defined(LLAMA_USE_SCRATCH)
-        return buf_max_size[i];
+        ggml_set_scratch(ctx, { 0, i == -1 ? 0 : SIZE_MAX, nullptr, });
 #else
         (void) i;
-        return 0;
+        (void) ctx;
 #endif
     }
 };
@@ -251,15 +343,18 @@ struct llama_context {
 static bool kv_cache_init(
         const struct llama_hparams & hparams,
              struct llama_kv_cache & cache,
-                         ggml_type   wtype,
-                               int   n_ctx) {
+                         ggml_type   ktype,
+                         ggml_type   vtype,
+                               int   n_ctx,
+                              bool   v_trans) {
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
 
     const int n_mem      = n_layer*n_ctx;
     const int n_elements = n_embd*n_mem;
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2u*MB);
+    cache.buf.resize(n_elements/ggml_blck_size(ktype)*ggml_type_size(ktype) +
+                     n_elements/ggml_blck_size(vtype)*ggml_type_size(vtype) + 2u*MB);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size();
@@ -273,12 +368,154 @@ static bool kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, ktype, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, vtype, n_elements);
+
+    cache.k_data = cache.k->data;
+    cache.v_data = cache.v->data;
+
+    cache.n_ctx   = n_ctx;
+    cache.v_trans = v_trans;
 
     return true;
 }
 
+// size in bytes of the keys (or the values) of one position in one layer, cache.k (or cache.v) is passed
+static size_t kv_cache_row_size(const struct ggml_tensor * kv, int n_embd) {
+    return ggml_type_size(kv->type)*n_embd/ggml_blck_size(kv->type);
+}
+
+// the positions of the values are runs of a fixed stride: one run per layer, or one per row of a layer
+// when the values are transposed
+struct llama_kv_runs {
+    int    n;        // number of runs
+    size_t stride;   // bytes from the start of a run to the next
+    size_t pos_size; // bytes of one position in a run
+};
+
+static llama_kv_runs kv_cache_v_runs(const struct llama_kv_cache & cache, const struct llama_hparams & hparams) {
+    if (cache.v_trans) {
+        const size_t elem_size = ggml_element_size(cache.v);
+        return { hparams.n_layer*hparams.n_embd, elem_size*cache.n_ctx, elem_size };
+    }
+
+    const size_t row_size = kv_cache_row_size(cache.v, hparams.n_embd);
+    return { hparams.n_layer, row_size*cache.n_ctx, row_size };
+}
+
+// the keys are laid out as [n_layer][n_ctx][n_embd], the values as well or as [n_layer][n_embd][n_ctx], a prefix
+// of n_tokens positions is n_layer separate blocks of K and the runs of V, see kv_cache_v_runs()
+static size_t kv_cache_copy_prefix(
+        const struct llama_hparams & hparams,
+             struct llama_kv_cache & cache,
+                           uint8_t * dst,
+                     const uint8_t * src,
+                               int   n_tokens) {
+    const int n_ctx   = cache.n_ctx;
+    const int n_layer = hparams.n_layer;
+
+    const size_t row_size   = kv_cache_row_size(cache.k, hparams.n_embd);
+    const size_t layer_size = row_size*n_ctx;
+    const size_t block_size = row_size*n_tokens;
+
+    const llama_kv_runs v_runs = kv_cache_v_runs(cache, hparams);
+    const size_t v_block_size  = v_runs.pos_size*n_tokens;
+
+    uint8_t * k = (uint8_t *) cache.k->data;
+    uint8_t * v = (uint8_t *) cache.v->data;
+
+    size_t offs = 0;
+    for (int il = 0; il < n_layer; ++il) {
+        if (dst) {
+            memcpy(dst + offs, k + il*layer_size, block_size);
+        } else {
+            memcpy(k + il*layer_size, src + offs, block_size);
+        }
+        offs += block_size;
+    }
+    for (int ir = 0; ir < v_runs.n; ++ir) {
+        if (dst) {
+            memcpy(dst + offs, v + ir*v_runs.stride, v_block_size);
+        } else {
+            memcpy(v + ir*v_runs.stride, src + offs, v_block_size);
+        }
+        offs += v_block_size;
+    }
+
+    return offs;
+}
+
+// rotate the RoPE pairs of n_rows cached keys by delta positions, the inverse of the rotation in
+// ggml_compute_forward_rope() composes with it: R(p)*R(delta) = R(p + delta)
+static void kv_cache_rope_shift(
+        struct llama_kv_cache & cache,
+                         void * data,
+                          int   n_rows,
+                          int   n_embd,
+                          int   n_rot,
+                          int   delta) {
+    std::vector<float> cos_theta(n_rot/2);
+    std::vector<float> sin_theta(n_rot/2);
+    for (int i0 = 0; i0 < n_rot; i0 += 2) {
+        const float theta = powf(10000.0, ((float)-i0)/n_rot);
+
+        cos_theta[i0/2] = cosf(delta*theta);
+        sin_theta[i0/2] = sinf(delta*theta);
+    }
+
+    const int n_pairs = n_rows*n_embd/2;
+
+    if (cache.k->type == GGML_TYPE_F32) {
+        float * x = (float *) data;
+        for (int i = 0; i < n_pairs; ++i) {
+            const int j = i % (n_rot/2);
+
+            const float x0 = x[2*i + 0];
+            const float x1 = x[2*i + 1];
+
+            x[2*i + 0] = x0*cos_theta[j] - x1*sin_theta[j];
+            x[2*i + 1] = x0*sin_theta[j] + x1*cos_theta[j];
+        }
+    } else if (cache.k->type == GGML_TYPE_F16) {
+        ggml_fp16_t * x = (ggml_fp16_t *) data;
+        for (int i = 0; i < n_pairs; ++i) {
+            const int j = i % (n_rot/2);
+
+            const float x0 = ggml_fp16_to_fp32(x[2*i + 0]);
+            const float x1 = ggml_fp16_to_fp32(x[2*i + 1]);
+
+            x[2*i + 0] = ggml_fp32_to_fp16(x0*cos_theta[j] - x1*sin_theta[j]);
+            x[2*i + 1] = ggml_fp32_to_fp16(x0*sin_theta[j] + x1*cos_theta[j]);
+        }
+    } else {
+        // quantized: rotate a dequantized copy of every row
+        const quantize_fns_t qfns = ggml_internal_get_quantize_fn(cache.k->type);
+        LLAMA_ASSERT(qfns.dequantize_row_q && qfns.quantize_row_q);
+
+        const size_t row_size = kv_cache_row_size(cache.k, n_embd);
+
+        std::vector<float> row(n_embd);
+        for (int ir = 0; ir < n_rows; ++ir) {
+            char * q = (char *) data + ir*row_size;
+
+            qfns.dequantize_row_q(q, row.data(), n_embd);
+
+            float * x = row.data();
+            for (int i = 0; i < n_embd/2; ++i) {
+                const int j = i % (n_rot/2);
+
+                const float x0 = x[2*i + 0];
+                const float x1 = x[2*i + 1];
+
+                x[2*i + 0] = x0*cos_theta[j] - x1*sin_theta[j];
+                x[2*i + 1] = x0*sin_theta[j] + x1*cos_theta[j];
+            }
+
+            qfns.quantize_row_q(row.data(), q, n_embd);
+        }
+    }
+}
+
 static void kv_cache_free(struct llama_kv_cache & cache) {
     if (cache.ctx) {
         ggml_free(cache.ctx);
@@ -291,7 +528,14 @@ struct llama_context_params llama_context_default_params() {
         /*.n_ctx                       =*/ 512,
         /*.n_parts                     =*/ -1,
         /*.seed                        =*/ 0,
+        /*.n_threads                   =*/ 0,
+        /*.n_spin                      =*/ 0,
+        /*.n_batch                     =*/ 512,
+        /*.n_graph_bucket              =*/ 0,
+        /*.kv_type                     =*/ LLAMA_KV_TYPE_DEFAULT,
         /*.f16_kv                      =*/ false,
+        /*.flash_attn                  =*/ false,
+        /*.v_trans                     =*/ false,
         /*.logits_all                  =*/ false,
         /*.vocab_only                  =*/ false,
         /*.use_mlock                   =*/ false,
@@ -307,7 +551,8 @@ struct llama_context_params llama_context_default_params() {
 // model loading
 //
 
-static void *mmap_file(const char *fname, uint64_t *mm_length) {
+// copy_on_write maps the file writable, the writes stay private to the process
+static void *mmap_file(const char *fname, uint64_t *mm_length, bool copy_on_write = false) {
 #if defined(_WIN32) && !defined(_POSIX_MAPPED_FILES)
     HANDLE hFile = CreateFileA(fname,
                                GENERIC_READ,
@@ -321,17 +566,18 @@ static void *mmap_file(const char *fname, uint64_t *mm_length) {
     fileSize.QuadPart = -1;
     GetFileSizeEx(hFile, &fileSize);
     int64_t length = fileSize.QuadPart;
-    HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    HANDLE hMapping = CreateFileMappingA(hFile, NULL, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
     CloseHandle(hFile);
     if (!hMapping) return 0;
-    void *addr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    void *addr = MapViewOfFile(hMapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
     CloseHandle(hMapping);
     if (!addr) return 0;
 #else
     int fd = open(fname, O_RDONLY);
     if (fd == -1) return 0;
     int64_t length = lseek(fd, 0, SEEK_END);
-    void *addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    void *addr = copy_on_write ? mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                               : mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
     close(fd);
     if (addr == MAP_FAILED) return 0;
 #endif
@@ -339,6 +585,18 @@ static void *mmap_file(const char *fname, uint64_t *mm_length) {
     return addr;
 }
 
+// evict the file from the page cache, so that its pages are placed again when they are faulted in
+static void drop_file_cache(const char *fname) {
+#if defined(__linux__)
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#else
+    (void) fname;
+#endif
+}
+
 static void munmap_file(void * addr, size_t length) {
 #if defined(_WIN32) && !defined(_POSIX_MAPPED_FILES)
     UnmapViewOfFile(addr);
@@ -361,7 +619,7 @@ static bool report_bad_magic(const char *path, uint32_t got, uint32_t want) {
 
 static bool llama_model_load(
         const std::string & fname,
-        llama_context & lctx,
+        llama_model & model,
         int n_ctx,
         int n_parts,
         ggml_type memory_type,
@@ -370,10 +628,9 @@ static bool llama_model_load(
         void *progress_callback_user_data) {
     fprintf(stderr, "%s: loading model from '%s' - please wait ...\n", __func__, fname.c_str());
 
-    lctx.t_start_us = ggml_time_us();
+    model.t_start_us = ggml_time_us();
 
-    auto & model = lctx.model;
-    auto & vocab = lctx.vocab;
+    auto & vocab = model.vocab;
 
     auto fin = std::ifstream(fname, std::ios::binary);
     if (!fin) {
@@ -497,6 +754,8 @@ static bool llama_model_load(
             tok_score.tok = word;
             tok_score.score = score;
         }
+
+        vocab.build_lookup();
     }
 
     if (vocab_only) {
@@ -523,6 +782,10 @@ static bool llama_model_load(
 
     // map model into memory
     char *mm_addr = NULL;
+    if (ggml_is_numa()) {
+        // pages cached by an earlier run stay on the node that read them
+        drop_file_cache(fname.c_str());
+    }
     model.mm_addr = mmap_file(fname.c_str(), &model.mm_length);
     if (model.mm_addr == NULL) {
         fprintf(stderr, "%s: failed to mmap '%s'\n", __func__, fname.c_str());
@@ -543,19 +806,16 @@ static bool llama_model_load(
 
     // print memory requirements
     {
-        const size_t scale = memory_type == GGML_TYPE_F32 ? 2 : 1;
+        const float scale = ggml_type_sizef(memory_type)/ggml_type_sizef(GGML_TYPE_F16);
 
-        // this is the total memory required to run the inference
+        // the weights, the compute buffers are sized for every context when it is created
         const size_t mem_required =
             ctx_size +
-            model.mm_length +
-            MEM_REQ_SCRATCH0.at(model.type) +
-            MEM_REQ_SCRATCH1.at(model.type) +
-            MEM_REQ_EVAL.at    (model.type);
+            model.mm_length;
 
         // this is the memory required by one llama_state
         const size_t mem_required_state =
-            scale*MEM_REQ_KV_SELF.at(model.type);
+            (size_t) (scale*MEM_REQ_KV_SELF.at(model.type));
 
         fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per state)\n", __func__,
                 mem_required / 1024.0 / 1024.0, mem_required_state / 1024.0 / 1024.0);
@@ -563,11 +823,11 @@ static bool llama_model_load(
 
     // create the ggml context
     {
-        lctx.model.buf.resize(ctx_size);
+        model.buf.resize(ctx_size);
 
         struct ggml_init_params params = {
-            /*.mem_size   =*/ lctx.model.buf.size(),
-            /*.mem_buffer =*/ lctx.model.buf.data(),
+            /*.mem_size   =*/ model.buf.size(),
+            /*.mem_buffer =*/ model.buf.data(),
             /*.no_alloc   =*/ true,
         };
 
@@ -728,9 +988,22 @@ static bool llama_model_load(
         }
     }
 
+    if (ggml_is_numa()) {
+        // fault the rows of each weight in on the node whose threads multiply them
+        std::vector<ggml_tensor *> tensors;
+        tensors.reserve(model.tensors.size());
+        for (auto & it : model.tensors) {
+            tensors.push_back(it.second);
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+        ggml_numa_place(tensors.data(), (int) tensors.size());
+        fprintf(stderr, "%s: placed the weights on the NUMA nodes in %.2f ms\n", __func__, (ggml_time_us() - t_start_us)/1000.0);
+    }
+
     // loading time will be recalculate after the first eval, so
     // we take page faults deferred by mmap() into consideration
-    lctx.t_load_us = ggml_time_us() - lctx.t_start_us;
+    model.t_load_us = ggml_time_us() - model.t_start_us;
 
     if (progress_callback) {
         progress_callback(1.0, progress_callback_user_data);
@@ -739,55 +1012,53 @@ static bool llama_model_load(
     return true;
 }
 
-// evaluate the transformer
+// build the graph evaluating the tokens of n_seq contexts, returns the logits
 //
-//   - lctx:      llama context
-//   - tokens:    new batch of tokens to process
-//   - n_past:    the context size so far
-//   - n_threads: number of threads to use
+// with tokens == NULL the input tokens are left unset, for a graph that is only measured or one that is
+// kept in decode: the attention then covers decode->n_kv positions and the tensors that depend on n_past
+// are recorded
 //
-static bool llama_eval_internal(
-        llama_context & lctx,
-    const llama_token * tokens,
-            const int   n_tokens,
-            const int   n_past,
-            const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
-
-    const int N = n_tokens;
+static struct ggml_tensor * llama_build_graph(
+        llama_context ** lctxs,
+    const llama_token  * tokens,
+            const int  * seq_n_tokens,
+            const int  * seq_n_past,
+            const int    n_seq,
+  struct ggml_context  * ctx0,
+          ggml_cgraph  & gf,
+   struct ggml_tensor ** embeddings,
+   llama_decode_graph  * decode = nullptr) {
+    llama_context & lctx = *lctxs[0];
+
+    int N = 0;
+    for (int is = 0; is < n_seq; ++is) {
+        N += seq_n_tokens[is];
+    }
 
     const auto & model   = lctx.model;
     const auto & hparams = model.hparams;
 
-    auto & kv_self = model.kv_self;
-
-    LLAMA_ASSERT(!!kv_self.ctx);
-
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
     const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
     const int n_rot   = hparams.n_embd/hparams.n_head;
 
-    auto & mem_per_token = lctx.mem_per_token;
-    auto & buf_compute   = lctx.buf_compute;
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    if (tokens) {
+        memcpy(embd->data, tokens, N*ggml_element_size(embd));
+    }
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ buf_compute.size(),
-        /*.mem_buffer =*/ buf_compute.data(),
-        /*.no_alloc   =*/ false,
+    // the ops taking n_past as a param
+    auto n_past_op = [decode](struct ggml_tensor * op) -> struct ggml_tensor * {
+        if (decode) {
+            decode->n_past_params.push_back(op->op == GGML_OP_FLASH_ATTN ? op->opt[1] : op->src1);
+        }
+        return op;
     };
 
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    // for big prompts, if BLAS is enabled, it is better to use only one thread
-    // otherwise, the threads are spin-lock waiting for the BLAS calls and are degrading the performance
-    ggml_cgraph gf = {};
-    gf.n_threads = N >= 32 && ggml_cpu_has_blas() ? 1 : n_threads;
-
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
+    if (decode) {
+        decode->embd = embd;
+    }
 
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
 
@@ -814,75 +1085,158 @@ static bool llama_eval_internal(
             struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
             struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
 
-            // store key and value to memory
-            if (N >= 1) {
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd, (ggml_element_size(kv_self.k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctx0, kv_self.v, N*n_embd, (ggml_element_size(kv_self.v)*n_embd)*(il*n_ctx + n_past));
+            // the attention of every context is written to its columns of KQV_all
+            struct ggml_tensor * KQV_all = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
-            }
+            for (int is = 0, i_tok = 0; is < n_seq; i_tok += seq_n_tokens[is], ++is) {
+                const llama_context & sctx = *lctxs[is];
 
-            // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_rope(ctx0,
-                            ggml_cpy(ctx0,
-                                Qcur,
-                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
-                            n_past, n_rot, 0),
-                        0, 2, 1, 3);
-
-            // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_rope(ctx0,
-                            ggml_reshape_3d(ctx0,
-                                ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(kv_self.k)*n_embd),
-                                n_embd/n_head, n_head, n_past + N),
-                            n_past, n_rot, 1),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctx0,
-                        KQ,
-                        ggml_new_f32(ctx0, 1.0f/sqrtf(float(n_embd)/n_head)));
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
-            struct ggml_tensor * V_trans =
-                ggml_cpy(ctx0,
+                const auto & kv_self = sctx.kv_self;
+
+                const int N      = seq_n_tokens[is];
+                const int n_past = seq_n_past[is];
+                const int n_ctx  = kv_self.n_ctx;
+                const int n_kv   = decode ? decode->n_kv : n_past + N;
+
+                const size_t k_row_size   = kv_cache_row_size(kv_self.k, n_embd);
+                const size_t v_row_size   = kv_cache_row_size(kv_self.v, n_embd);
+                const size_t v_elem_size  = ggml_element_size(kv_self.v);
+                const bool   k_quantized  = ggml_blck_size(kv_self.k->type) > 1;
+                const bool   v_quantized  = ggml_blck_size(kv_self.v->type) > 1;
+
+                // quantized keys cannot be rotated in place in the cache, and in a decode graph that would
+                // rotate the whole bucket: store them already rotated
+                const bool k_rotated = k_quantized || decode;
+
+                struct ggml_tensor * Qcur_s = ggml_view_2d(ctx0, Qcur, n_embd, N, Qcur->nb[1], i_tok*Qcur->nb[1]);
+                struct ggml_tensor * Kcur_s = ggml_view_2d(ctx0, Kcur, n_embd, N, Kcur->nb[1], i_tok*Kcur->nb[1]);
+                struct ggml_tensor * Vcur_s = ggml_view_2d(ctx0, Vcur, n_embd, N, Vcur->nb[1], i_tok*Vcur->nb[1]);
+
+                // store key and value to memory
+                {
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd, k_row_size*(il*n_ctx + n_past));
+                    struct ggml_tensor * v;
+
+                    if (k_rotated) {
+                        Kcur_s = n_past_op(ggml_rope(ctx0, ggml_reshape_3d(ctx0, Kcur_s, n_embd/n_head, n_head, N), n_past, n_rot, 0));
+                    }
+
+                    if (kv_self.v_trans) {
+                        // scatter the N positions over the n_embd rows of the layer
+                        v = ggml_view_2d(ctx0, kv_self.v, N, n_embd, n_ctx*v_elem_size, (il*n_ctx*n_embd + n_past)*v_elem_size);
+                        Vcur_s = ggml_transpose(ctx0, Vcur_s);
+                    } else {
+                        v = ggml_view_1d(ctx0, kv_self.v, N*n_embd, v_row_size*(il*n_ctx + n_past));
+                    }
+
+                    struct ggml_tensor * k_store = ggml_cpy(ctx0, Kcur_s, k);
+                    struct ggml_tensor * v_store = ggml_cpy(ctx0, Vcur_s, v);
+
+                    ggml_build_forward_expand(&gf, k_store);
+                    ggml_build_forward_expand(&gf, v_store);
+
+                    if (decode) {
+                        const size_t v_pos_size = kv_self.v_trans ? v_elem_size : v_row_size;
+
+                        decode->kv_stores.insert(decode->kv_stores.end(),
+                                { { k, k_row_size }, { k_store, k_row_size }, { v, v_pos_size }, { v_store, v_pos_size } });
+                    }
+                }
+
+                // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
+                struct ggml_tensor * Q =
                     ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
-                                ggml_view_1d(ctx0, kv_self.v, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(kv_self.v)*n_embd),
-                                n_embd/n_head, n_head, n_past + N),
-                            1, 2, 0, 3),
-                    ggml_new_tensor_3d(ctx0, kv_self.v->type, n_past + N, n_embd/n_head, n_head));
+                            n_past_op(ggml_rope(ctx0,
+                                ggml_cpy(ctx0,
+                                    Qcur_s,
+                                    ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
+                                n_past, n_rot, 0)),
+                            0, 2, 1, 3);
+
+                // K = Kmem.view(n_embd/n_head, n_head, n_kv).permute(0, 2, 1, 3)
+                struct ggml_tensor * Kmem =
+                    ggml_reshape_3d(ctx0,
+                            ggml_view_1d(ctx0, kv_self.k, n_kv*n_embd, il*n_ctx*k_row_size),
+                            n_embd/n_head, n_head, n_kv);
+
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            k_rotated ? Kmem : n_past_op(ggml_rope(ctx0, Kmem, n_past, n_rot, 1)),
+                            0, 2, 1, 3);
+
+                // Vmem = the values of the first n_kv positions, rows of n_embd or, transposed, the first n_kv columns of
+                // the n_embd rows of the layer viewed as [n_head][n_embd/n_head][n_kv]
+                struct ggml_tensor * Vmem = kv_self.v_trans
+                    ? ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd/n_head, n_head,
+                            n_ctx*v_elem_size,
+                            n_ctx*(n_embd/n_head)*v_elem_size,
+                            il*n_ctx*n_embd*v_elem_size)
+                    : ggml_view_1d(ctx0, kv_self.v, n_kv*n_embd, il*n_ctx*v_row_size);
+
+                struct ggml_tensor * KQV;
+
+                if (lctx.flash_attn && !k_quantized && !v_quantized) {
+                    // V = Vmem.view(n_embd/n_head, n_head, n_kv).permute(0, 2, 1, 3), or Vmem already transposed
+                    struct ggml_tensor * V = kv_self.v_trans ? Vmem :
+                        ggml_permute(ctx0,
+                                ggml_reshape_3d(ctx0, Vmem, n_embd/n_head, n_head, n_kv),
+                                0, 2, 1, 3);
+
+                    // KQV = soft_max(mask_past(K * Q / sqrt(n_embd/n_head))) * V, the scores stay in the work buffer
+                    KQV = n_past_op(ggml_flash_attn_past(ctx0, Q, K, V, n_past, kv_self.v_trans));
+                } else {
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                    // KQ_scaled = KQ / sqrt(n_embd/n_head)
+                    struct ggml_tensor * KQ_scaled =
+                        ggml_scale(ctx0,
+                                KQ,
+                                ggml_new_f32(ctx0, 1.0f/sqrtf(float(n_embd)/n_head)));
+
+                    // KQ_masked = mask_past(KQ_scaled)
+                    struct ggml_tensor * KQ_masked = n_past_op(ggml_diag_mask_inf(ctx0, KQ_scaled, n_past));
+
+                    // KQ = soft_max(KQ_masked)
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+                    struct ggml_tensor * V_trans = Vmem;
 
-            // KQV = transpose(V) * KQ_soft_max
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+                    if (!kv_self.v_trans) {
+                        // quantized blocks cannot be transposed, dequantize the values first
+                        if (v_quantized) {
+                            Vmem = ggml_cpy(ctx0, Vmem, ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_kv*n_embd));
+                        }
+
+                        // V_trans = Vmem.view(n_embd/n_head, n_head, n_kv).permute(1, 2, 0, 3).contiguous()
+                        V_trans =
+                            ggml_cpy(ctx0,
+                                ggml_permute(ctx0,
+                                        ggml_reshape_3d(ctx0,
+                                            Vmem,
+                                            n_embd/n_head, n_head, n_kv),
+                                        1, 2, 0, 3),
+                                ggml_new_tensor_3d(ctx0, Vmem->type, n_kv, n_embd/n_head, n_head));
+                    }
 
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                    // KQV = transpose(V) * KQ_soft_max
+                    KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+                }
+
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+                // KQV_all[:, i_tok:i_tok + N] = KQV_merged.contiguous().view(n_embd, N)
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_view_2d(ctx0, KQV_all, n_embd, N, KQV_all->nb[1], i_tok*KQV_all->nb[1])));
+            }
 
             // projection (no bias)
             cur = ggml_mul_mat(ctx0,
                     model.layers[il].wo,
-                    cur);
+                    KQV_all);
         }
 
         lctx.use_buf(ctx0, 1);
@@ -927,9 +1281,6 @@ static bool llama_eval_internal(
 
     lctx.use_buf(ctx0, 0);
 
-    // used at the end to optionally extract the embeddings
-    struct ggml_tensor * embeddings = NULL;
-
     // norm
     {
 
@@ -940,7 +1291,7 @@ static bool llama_eval_internal(
                     ggml_repeat(ctx0, model.norm, inpL),
                     inpL);
 
-        embeddings = inpL;
+        *embeddings = inpL;
     }
 
     // lm_head
@@ -951,67 +1302,373 @@ static bool llama_eval_internal(
     // logits -> probs
     //inpL = ggml_soft_max(ctx0, inpL);
 
-    // run the computation
     ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute       (ctx0, &gf);
 
-    //if (n_past%100 == 0) {
-    //    ggml_graph_print   (&gf);
-    //    ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
-    //}
+    return inpL;
+}
 
-    //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+// the contexts of an eval group share one graph
+struct llama_group_abort {
+    llama_context ** lctxs;
+    int n_seq;
+};
 
-    // extract logits
-    {
-        auto & logits_out = lctx.logits;
+// the group stops when one of its contexts asks, the other groups of a batch are not affected
+static bool llama_group_abort_callback(void * data) {
+    const llama_group_abort * group = (const llama_group_abort *) data;
 
-        if (lctx.logits_all) {
-            logits_out.resize(n_vocab * N);
-            memcpy(logits_out.data(), (float *) ggml_get_data(inpL), sizeof(float)*n_vocab*N);
-        } else {
-            // return result for just the last token
-            logits_out.resize(n_vocab);
-            memcpy(logits_out.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    for (int is = 0; is < group->n_seq; ++is) {
+        const llama_context & sctx = *group->lctxs[is];
+        if (sctx.abort_callback && sctx.abort_callback(sctx.abort_callback_data)) {
+            return true;
         }
     }
 
-    // extract embeddings
-    if (lctx.embedding.size()) {
-        auto & embedding_out = lctx.embedding;
+    return false;
+}
 
-        embedding_out.resize(n_embd);
-        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(N - 1)), sizeof(float)*n_embd);
+static void llama_decode_graph_free(llama_decode_graph & dg) {
+    if (dg.ctx) {
+        ggml_free(dg.ctx);
+        dg.ctx = NULL;
     }
 
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
-    }
+    dg.n_kv = 0;
+}
 
-#if 0
-    printf("\n%s: used_mem = %.3f MB, scratch -- %.3f MB %.3f MB\n", __func__,
-            ggml_used_mem(ctx0)/1024.0/1024.0,
-            lctx.get_buf_max_mem(0)/1024.0/1024.0,
-            lctx.get_buf_max_mem(1)/1024.0/1024.0);
-#endif
+// the decode graph of the bucket of n_past, built when the bucket changes and patched for n_past
+static bool llama_decode_graph_prepare(llama_context & lctx, int n_past) {
+    auto & dg      = lctx.decode_graph;
+    auto & kv_self = lctx.kv_self;
 
-    ggml_free(ctx0);
+    const int n_bucket = lctx.n_graph_bucket;
+    const int n_kv     = Min(kv_self.n_ctx, ((n_past + n_bucket)/n_bucket)*n_bucket);
 
-    // measure the performance only for the single-token evals
-    if (N == 1) {
-        lctx.t_eval_us += ggml_time_us() - t_start_us;
-        lctx.n_eval++;
-    }
-    else if (N > 1) {
-        lctx.t_p_eval_us += ggml_time_us() - t_start_us;
-        lctx.n_p_eval += N;
-    }
+    if (dg.n_kv != n_kv || dg.k_data != kv_self.k->data || dg.v_data != kv_self.v->data) {
+        llama_decode_graph_free(dg);
 
-    return true;
-}
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ dg.buf.size(),
+            /*.mem_buffer =*/ dg.buf.data(),
+            /*.no_alloc   =*/ false,
+        };
 
-//
+        dg.ctx = ggml_init(params);
+
+        dg.gf     = {};
+        dg.n_kv   = n_kv;
+        dg.n_past = n_past;
+        dg.k_data = kv_self.k->data;
+        dg.v_data = kv_self.v->data;
+
+        dg.n_past_params.clear();
+        dg.kv_stores.clear();
+
+        llama_context * lctxs[1] = { &lctx };
+        const int n_tokens = 1;
+
+        dg.embeddings = NULL;
+        dg.logits     = llama_build_graph(lctxs, nullptr, &n_tokens, &n_past, 1, dg.ctx, dg.gf, &dg.embeddings, &dg);
+
+        // the work buffer is allocated now, for the most threads of an eval
+        dg.gf.n_threads = lctx.n_threads_max;
+        dg.gf.work_size = ggml_graph_work_size(&dg.gf);
+        if (dg.gf.work_size > 0) {
+            dg.gf.work = ggml_new_tensor_1d(dg.ctx, GGML_TYPE_I8, dg.gf.work_size);
+        }
+
+        struct ggml_tensor * outputs[2] = { dg.logits, dg.embeddings };
+
+        const size_t alloc_size = ggml_graph_alloc(&dg.gf, lctx.buf_alloc.data(), lctx.buf_alloc.size(), outputs, dg.embeddings ? 2 : 1);
+        if (alloc_size > lctx.buf_alloc.size()) {
+            fprintf(stderr, "%s: the tensors need %zu bytes, the arena has %zu\n", __func__, alloc_size, lctx.buf_alloc.size());
+            llama_decode_graph_free(dg);
+            return false;
+        }
+
+        lctx.alloc_peak = Max(lctx.alloc_peak, alloc_size);
+
+        return true;
+    }
+
+    if (dg.n_past != n_past) {
+        for (auto * t : dg.n_past_params) {
+            ((int32_t *) t->data)[0] = n_past;
+        }
+
+        for (auto & store : dg.kv_stores) {
+            struct ggml_tensor * t = store.first;
+
+            t->view_offs = t->view_offs - dg.n_past*store.second + n_past*store.second;
+            t->data      = (char *) t->view_src->data + t->view_offs;
+        }
+
+        dg.n_past = n_past;
+    }
+
+    return true;
+}
+
+// evaluate the transformer
+//
+//   - lctxs:     llama contexts of the same model, the first one provides the compute buffers and threads
+//   - tokens:    new batch of tokens to process, the tokens of each context one after the other
+//   - seq_n_tokens: number of tokens of each context
+//   - seq_n_past:   the context size so far of each context
+//   - n_seq:     number of contexts
+//   - n_threads: number of threads to use
+//
+// the contexts only have separate attention, every other op works on the tokens of all the
+// contexts at once so the weights are read once per batch
+//
+static bool llama_eval_internal(
+        llama_context ** lctxs,
+    const llama_token  * tokens,
+            const int  * seq_n_tokens,
+            const int  * seq_n_past,
+            const int    n_seq,
+            const int    n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    llama_context & lctx = *lctxs[0];
+
+    lctx.eval_aborted = false;
+
+    int N = 0;
+    for (int is = 0; is < n_seq; ++is) {
+        LLAMA_ASSERT(&lctxs[is]->model == &lctx.model);
+        LLAMA_ASSERT(!!lctxs[is]->kv_self.ctx);
+        LLAMA_ASSERT(seq_n_tokens[is] > 0);
+        N += seq_n_tokens[is];
+    }
+
+    if (N > lctx.n_batch) {
+        fprintf(stderr, "%s: %d tokens do not fit in the compute buffers sized for n_batch = %d\n", __func__, N, lctx.n_batch);
+        return false;
+    }
+
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_vocab = hparams.n_vocab;
+
+    auto & mem_per_token = lctx.mem_per_token;
+    auto & buf_compute   = lctx.buf_compute;
+
+    // the single token evals of a context reuse its decode graph
+    const bool decode = n_seq == 1 && N == 1 && lctx.n_graph_bucket > 0;
+
+    struct ggml_context * ctx0 = NULL;
+
+    ggml_cgraph   gf_eval;
+    ggml_cgraph & gf = decode ? lctx.decode_graph.gf : gf_eval;
+
+    // used at the end to optionally extract the embeddings
+    struct ggml_tensor * embeddings = NULL;
+
+    struct ggml_tensor * inpL = NULL;
+
+    if (decode) {
+        if (!llama_decode_graph_prepare(lctx, seq_n_past[0])) {
+            return false;
+        }
+
+        ctx0       = lctx.decode_graph.ctx;
+        inpL       = lctx.decode_graph.logits;
+        embeddings = lctx.decode_graph.embeddings;
+
+        memcpy(lctx.decode_graph.embd->data, tokens, sizeof(llama_token));
+    } else {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ buf_compute.size(),
+            /*.mem_buffer =*/ buf_compute.data(),
+            /*.no_alloc   =*/ false,
+        };
+
+        ctx0 = ggml_init(params);
+
+        gf = {};
+
+        inpL = llama_build_graph(lctxs, tokens, seq_n_tokens, seq_n_past, n_seq, ctx0, gf, &embeddings);
+
+        struct ggml_tensor * outputs[2] = { inpL, embeddings };
+
+        const size_t alloc_size = ggml_graph_alloc(&gf, lctx.buf_alloc.data(), lctx.buf_alloc.size(), outputs, embeddings ? 2 : 1);
+        if (alloc_size > lctx.buf_alloc.size()) {
+            fprintf(stderr, "%s: the tensors need %zu bytes, the arena has %zu\n", __func__, alloc_size, lctx.buf_alloc.size());
+            ggml_free(ctx0);
+            return false;
+        }
+
+        lctx.alloc_peak = Max(lctx.alloc_peak, alloc_size);
+    }
+
+    // for big prompts, if BLAS is enabled, it is better to use only one thread
+    // otherwise, the threads are spin-lock waiting for the BLAS calls and are degrading the performance
+    // the work buffer in buf_compute is sized for at most n_threads_max threads
+    gf.n_threads = N >= 32 && ggml_cpu_has_blas() ? 1 : Min(n_threads, lctx.n_threads_max);
+    gf.n_spin    = lctx.n_spin;
+
+    llama_group_abort group = { lctxs, n_seq };
+
+    if (n_seq == 1) {
+        gf.abort_callback      = lctx.abort_callback;
+        gf.abort_callback_data = lctx.abort_callback_data;
+    } else {
+        gf.abort_callback      = llama_group_abort_callback;
+        gf.abort_callback_data = &group;
+    }
+
+    // reuse the context's threads instead of creating new ones for every token
+    if (lctx.threadpool && gf.n_threads <= ggml_threadpool_n_threads(lctx.threadpool)) {
+        gf.threadpool = lctx.threadpool;
+    } else {
+        gf.threadpool = NULL;
+    }
+
+    // run the computation
+    ggml_graph_compute(ctx0, &gf);
+
+    lctx.eval_aborted = gf.aborted;
+
+    // the logits are incomplete, the KV cache positions from n_past on are left as they are
+    if (gf.aborted) {
+        if (!decode) {
+            ggml_free(ctx0);
+        }
+        return false;
+    }
+
+    //if (n_past%100 == 0) {
+    //    ggml_graph_print   (&gf);
+    //    ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
+    //}
+
+    //embd_w.resize(n_vocab*N);
+    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+
+    for (int is = 0, i_tok = 0; is < n_seq; i_tok += seq_n_tokens[is], ++is) {
+        llama_context & sctx = *lctxs[is];
+
+        const int N = seq_n_tokens[is];
+
+        // extract logits
+        {
+            auto & logits_out = sctx.logits;
+
+            const float * logits = (float *) ggml_get_data(inpL) + n_vocab*i_tok;
+
+            if (sctx.logits_all) {
+                logits_out.resize(n_vocab * N);
+                memcpy(logits_out.data(), logits, sizeof(float)*n_vocab*N);
+            } else {
+                // return result for just the last token
+                logits_out.resize(n_vocab);
+                memcpy(logits_out.data(), logits + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+            }
+        }
+
+        // extract embeddings
+        if (sctx.embedding.size()) {
+            auto & embedding_out = sctx.embedding;
+
+            embedding_out.resize(n_embd);
+            memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(i_tok + N - 1)), sizeof(float)*n_embd);
+        }
+    }
+
+    if (mem_per_token == 0) {
+        mem_per_token = ggml_used_mem(ctx0)/N;
+    }
+
+#if 0
+    printf("\n%s: used_mem = %.3f MB, arena peak = %.3f MB\n", __func__,
+            ggml_used_mem(ctx0)/1024.0/1024.0,
+            lctx.alloc_peak/1024.0/1024.0);
+#endif
+
+    // the decode graph is kept for the next token
+    if (!decode) {
+        ggml_free(ctx0);
+    }
+
+    // measure the performance only for the single-token evals
+    // every context of a batch is charged the time of the whole batch
+    const int64_t t_eval_us = ggml_time_us() - t_start_us;
+
+    for (int is = 0; is < n_seq; ++is) {
+        llama_context & sctx = *lctxs[is];
+
+        if (seq_n_tokens[is] == 1) {
+            sctx.t_eval_us += t_eval_us;
+            sctx.n_eval++;
+        } else {
+            sctx.t_p_eval_us += t_eval_us;
+            sctx.n_p_eval += seq_n_tokens[is];
+        }
+    }
+
+    return true;
+}
+
+struct llama_buf_sizes {
+    size_t compute; // tensor data and work buffer in buf_compute
+    size_t headers; // tensor headers in buf_compute
+    size_t alloc;   // peak of buf_alloc
+};
+
+// the sizes of the buffers of lctxs[0] needed by llama_eval_internal() for these tokens, found by building
+// its graph without allocating the tensors, or the decode graph of decode->n_kv positions
+static llama_buf_sizes llama_measure_eval(
+        llama_context ** lctxs,
+            const int  * seq_n_tokens,
+            const int  * seq_n_past,
+            const int    n_seq,
+    llama_decode_graph * decode = nullptr) {
+    llama_context & lctx = *lctxs[0];
+
+    if (lctx.buf_measure.empty()) {
+        lctx.buf_measure.resize(2*GGML_MAX_NODES*ggml_tensor_overhead());
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ lctx.buf_measure.size(),
+        /*.mem_buffer =*/ lctx.buf_measure.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph gf = {};
+    gf.n_threads = lctx.n_threads_max;
+
+    struct ggml_tensor * embeddings = NULL;
+    struct ggml_tensor * logits = llama_build_graph(lctxs, nullptr, seq_n_tokens, seq_n_past, n_seq, ctx0, gf, &embeddings, decode);
+
+    struct ggml_tensor * outputs[2] = { logits, embeddings };
+
+    // allocated by ggml_graph_compute() after the graph
+    const size_t work_size = ggml_graph_work_size(&gf);
+    if (work_size > 0) {
+        ggml_new_tensor_1d(ctx0, GGML_TYPE_I8, work_size);
+    }
+
+    llama_buf_sizes sizes;
+    sizes.headers = ggml_used_mem(ctx0);
+    sizes.compute = ggml_measured_mem(ctx0) - sizes.headers;
+    sizes.alloc   = ggml_graph_alloc(&gf, NULL, 0, outputs, embeddings ? 2 : 1);
+
+    ggml_free(ctx0);
+
+    return sizes;
+}
+
+static bool llama_buf_sizes_fit(const llama_context & lctx, const llama_buf_sizes & sizes) {
+    return sizes.compute + sizes.headers <= lctx.buf_compute.size() && sizes.alloc <= lctx.buf_alloc.size();
+}
+
+//
 // tokenizer
 //
 
@@ -1021,47 +1678,106 @@ static size_t utf8_len(char src) {
     return lookup[highbits];
 }
 
-struct llama_sp_symbol {
-    using index = int;
-    index prev;
-    index next;
-    const char * text;
-    size_t n;
-};
+// FNV-1a
+static uint32_t llama_hash_bytes(const char * text, size_t n) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < n; ++i) {
+        hash ^= (uint8_t) text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-struct llama_sp_bigram {
-    struct comparator {
-        bool operator()(llama_sp_bigram & l, llama_sp_bigram & r) {
-            return (l.score < r.score) || (l.score == r.score && l.left > r.left);
+void llama_vocab::build_lookup() {
+    size_t size = 1;
+    while (size < 2*id_to_token.size()) {
+        size *= 2;
+    }
+
+    lookup.assign(size, -1);
+
+    for (id i = 0; i < (id) id_to_token.size(); ++i) {
+        const token & tok = id_to_token[i].tok;
+
+        size_t slot = llama_hash_bytes(tok.data(), tok.size()) & (size - 1);
+        while (lookup[slot] != -1 && id_to_token[lookup[slot]].tok != tok) {
+            slot = (slot + 1) & (size - 1);
         }
-    };
-    using queue_storage = std::vector<llama_sp_bigram>;
-    using queue = std::priority_queue<llama_sp_bigram, queue_storage, comparator>;
-    llama_sp_symbol::index left;
-    llama_sp_symbol::index right;
-    float score;
-    size_t size;
-};
+
+        // the last duplicate wins, like in token_to_id
+        lookup[slot] = i;
+    }
+
+    joined.assign(256*256, false);
+
+    for (const auto & tok_score : id_to_token) {
+        const token & tok = tok_score.tok;
+        for (size_t i = 1; i < tok.size(); ++i) {
+            joined[256*(uint8_t) tok[i - 1] + (uint8_t) tok[i]] = true;
+        }
+    }
+}
+
+llama_vocab::id llama_vocab::find(const char * text, size_t n) const {
+    if (lookup.empty()) {
+        return -1;
+    }
+
+    const size_t mask = lookup.size() - 1;
+
+    for (size_t slot = llama_hash_bytes(text, n) & mask; lookup[slot] != -1; slot = (slot + 1) & mask) {
+        const token & tok = id_to_token[lookup[slot]].tok;
+        if (tok.size() == n && memcmp(tok.data(), text, n) == 0) {
+            return lookup[slot];
+        }
+    }
+
+    return -1;
+}
+
+// true when tokenizing text[0, pos) and text[pos, ...) separately gives the same tokens as the whole text
+bool llama_vocab::can_split(const char * text, size_t pos) const {
+    if (pos == 0 || (text[pos] != ' ' && text[pos] != '\n')) {
+        return false;
+    }
+
+    if (joined.empty() || joined[256*(uint8_t) text[pos - 1] + (uint8_t) text[pos]]) {
+        return false;
+    }
+
+    // the tokenizer starts with one symbol per utf8 char, pos must not be inside one
+    for (size_t i = 1; i <= 3 && i <= pos; ++i) {
+        if (utf8_len(text[pos - i]) > i) {
+            return false;
+        }
+    }
+
+    return true;
+}
 
 // original implementation:
 // https://github.com/ggerganov/llama.cpp/commit/074bea2eb1f1349a0118239c4152914aecaa1be4
 struct llama_tokenizer {
-    llama_tokenizer(const llama_vocab & vocab): vocab_(vocab) {}
+    llama_tokenizer(const llama_vocab & vocab, llama_tokenizer_scratch & scratch):
+        vocab_(vocab), symbols_(scratch.symbols), work_queue_(scratch.work_queue) {}
+
+    void tokenize(const char * text, size_t size, std::vector<llama_vocab::id> & output) {
+        symbols_.clear();
+        work_queue_.clear();
 
-    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
-        while (offs < text.size()) {
+        while (offs < size) {
             llama_sp_symbol sym;
-            size_t char_len = Min(text.size() - offs, utf8_len(text[offs]));
-            sym.text = text.c_str() + offs;
+            size_t char_len = Min(size - offs, utf8_len(text[offs]));
+            sym.text = text + offs;
             sym.n = char_len;
             offs += char_len;
             sym.prev = index - 1;
-            sym.next = offs == text.size() ? -1 : index + 1;
+            sym.next = offs == size ? -1 : index + 1;
             index++;
-            symbols_.emplace_back(std::move(sym));
+            symbols_.push_back(sym);
         }
 
         // seed the work queue with all possible 2-character tokens.
@@ -1071,8 +1787,9 @@ struct llama_tokenizer {
 
         // keep substituting the highest frequency pairs for as long as we can.
         while (!work_queue_.empty()) {
-            auto bigram = work_queue_.top();
-            work_queue_.pop();
+            std::pop_heap(work_queue_.begin(), work_queue_.end(), llama_sp_bigram::comparator());
+            auto bigram = work_queue_.back();
+            work_queue_.pop_back();
 
             auto & left_sym = symbols_[bigram.left];
             auto & right_sym = symbols_[bigram.right];
@@ -1102,16 +1819,16 @@ struct llama_tokenizer {
 
         for (int i = 0; i != -1; i = symbols_[i].next) {
             auto & symbol = symbols_[i];
-            auto token = vocab_.token_to_id.find(std::string(symbol.text, symbol.n));
+            const llama_vocab::id token = vocab_.find(symbol.text, symbol.n);
 
-            if (token == vocab_.token_to_id.end()) {
+            if (token == -1) {
                 // output any symbols that did not form tokens as bytes.
                 for (int j = 0; j < (int) symbol.n; ++j) {
                     llama_vocab::id token_id = static_cast<uint8_t>(symbol.text[j]) + 3;
                     output.push_back(token_id);
                 }
             } else {
-                output.push_back((*token).second);
+                output.push_back(token);
             }
         }
     }
@@ -1122,150 +1839,334 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols_[left].text, symbols_[left].n + symbols_[right].n);
-        auto token = vocab_.token_to_id.find(text);
+        const size_t size = symbols_[left].n + symbols_[right].n;
+        const llama_vocab::id token = vocab_.find(symbols_[left].text, size);
 
-        if (token == vocab_.token_to_id.end()) {
+        if (token == -1) {
             return;
         }
 
-        if (static_cast<size_t>((*token).second) >= vocab_.id_to_token.size()) {
-            return;
-        }
-
-        const auto &tok_score = vocab_.id_to_token[(*token).second];
+        const auto &tok_score = vocab_.id_to_token[token];
 
         llama_sp_bigram bigram;
         bigram.left = left;
         bigram.right = right;
         bigram.score = tok_score.score;
-        bigram.size = text.size();
-        work_queue_.push(bigram);
+        bigram.size = size;
+        work_queue_.push_back(bigram);
+        std::push_heap(work_queue_.begin(), work_queue_.end(), llama_sp_bigram::comparator());
     }
 
     const llama_vocab & vocab_;
-    std::vector<llama_sp_symbol> symbols_;
-    llama_sp_bigram::queue work_queue_;
+    std::vector<llama_sp_symbol> & symbols_;
+    llama_sp_bigram::queue_storage & work_queue_;
 };
 
-static std::vector<llama_vocab::id> llama_tokenize(const llama_vocab & vocab, const std::string & text, bool bos) {
-    llama_tokenizer tokenizer(vocab);
-    std::vector<llama_vocab::id> output;
+// the tokens are written to scratch.output
+static void llama_tokenize(const llama_vocab & vocab, llama_tokenizer_scratch & scratch, const char * text, size_t size, bool bos) {
+    llama_tokenizer tokenizer(vocab, scratch);
+    std::vector<llama_vocab::id> & output = scratch.output;
 
-    if (text.size() == 0) {
-        return output;
+    output.clear();
+
+    if (size == 0) {
+        return;
     }
 
     if (bos) {
         output.push_back(1);
     }
 
-    tokenizer.tokenize(text, output);
-    return output;
+    tokenizer.tokenize(text, size, output);
 }
 
 //
 // sampling
 //
 
-static void sample_top_k(std::vector<std::pair<float, llama_vocab::id>> & logits_id, int top_k) {
-    // find the top k tokens
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + top_k, logits_id.end(),
-            [](const std::pair<float, llama_vocab::id> & a, const std::pair<float, llama_vocab::id> & b) {
-        return a.first > b.first;
+// the candidate buffer starts as the full vocab, indexed by token id
+static void llama_sampler_reset(llama_sampler & sampler, const float * logits, int n_logits) {
+    auto & candidates = sampler.candidates;
+
+    candidates.resize(n_logits);
+    for (int i = 0; i < n_logits; ++i) {
+        candidates[i] = { logits[i], 0.0f, 0.0f, i };
+    }
+
+    sampler.by_id     = true;
+    sampler.sorted    = false;
+    sampler.has_probs = false;
+}
+
+static void llama_sampler_sort(llama_sampler & sampler) {
+    if (sampler.sorted) {
+        return;
+    }
+
+    std::sort(sampler.candidates.begin(), sampler.candidates.end(),
+            [](const llama_sampler_candidate & a, const llama_sampler_candidate & b) {
+        return a.logit > b.logit;
     });
 
-    logits_id.resize(top_k);
+    sampler.by_id  = false;
+    sampler.sorted = true;
 }
 
-static llama_vocab::id llama_sample_top_p_top_k(
-        llama_context & lctx,
-        const std::vector<llama_vocab::id> & last_n_tokens,
-        int top_k,
-        float top_p,
-        float temp,
-        float repeat_penalty) {
-    auto & rng = lctx.rng;
+// sorts the candidates and computes their normalized probabilities
+static void llama_sampler_softmax(llama_sampler & sampler) {
+    llama_sampler_sort(sampler);
 
-    const int n_logits = lctx.model.hparams.n_vocab;
+    auto & candidates = sampler.candidates;
 
-    const auto & logits = lctx.logits;
-    const auto * plogits = logits.data() + logits.size() - n_logits;
+    const float maxl = candidates[0].logit;
 
-    std::vector<std::pair<float, llama_vocab::id>> logits_id;
-    logits_id.reserve(n_logits);
+    double sum = 0.0;
+    for (auto & c : candidates) {
+        c.p = expf(c.logit - maxl);
+        sum += c.p;
+    }
 
-    {
-        const float scale = 1.0f/temp;
-        for (int i = 0; i < n_logits; ++i) {
-            // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
-            // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
-            if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
-                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
-                if (plogits[i] < 0.0f) {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale*repeat_penalty, i));
-                } else {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale/repeat_penalty, i));
-                }
-            } else {
-                logits_id.push_back(std::make_pair(plogits[i]*scale, i));
+    for (auto & c : candidates) {
+        c.p /= sum;
+    }
+
+    sampler.has_probs = true;
+}
+
+static void llama_sampler_temp(llama_sampler & sampler, float temp) {
+    auto & candidates = sampler.candidates;
+
+    if (temp <= 0.0f) {
+        // greedy - keep only the most likely candidate
+        auto best = std::max_element(candidates.begin(), candidates.end(),
+                [](const llama_sampler_candidate & a, const llama_sampler_candidate & b) {
+            return a.logit < b.logit;
+        });
+        candidates[0] = *best;
+        candidates.resize(1);
+
+        sampler.by_id  = false;
+        sampler.sorted = true;
+        return;
+    }
+
+    const float scale = 1.0f/temp;
+    for (auto & c : candidates) {
+        c.logit *= scale;
+    }
+
+    sampler.has_probs = false;
+}
+
+// repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
+// credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
+static void llama_sampler_repeat_penalty(
+        llama_sampler & sampler,
+        const llama_vocab::id * last_n_tokens,
+        int n_last,
+        float penalty) {
+    if (n_last <= 0 || penalty == 1.0f) {
+        return;
+    }
+
+    auto & candidates = sampler.candidates;
+    auto & tokens     = sampler.penalty_tokens;
+
+    tokens.assign(last_n_tokens, last_n_tokens + n_last);
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+    const auto apply = [penalty](llama_sampler_candidate & c) {
+        // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
+        if (c.logit < 0.0f) {
+            c.logit *= penalty;
+        } else {
+            c.logit /= penalty;
+        }
+    };
+
+    sampler.has_probs = false;
+
+    if (sampler.by_id) {
+        // only visit the distinct tokens of the window
+        for (const auto id : tokens) {
+            if (id >= 0 && id < (int) candidates.size()) {
+                apply(candidates[id]);
             }
         }
+    } else {
+        for (auto & c : candidates) {
+            if (std::binary_search(tokens.begin(), tokens.end(), c.id)) {
+                apply(c);
+            }
+        }
+        sampler.sorted = false;
     }
+}
 
-    sample_top_k(logits_id, top_k);
+static void llama_sampler_top_k(llama_sampler & sampler, int top_k) {
+    auto & candidates = sampler.candidates;
 
-    float maxl = -std::numeric_limits<float>::infinity();
-    for (const auto & kv : logits_id) {
-        maxl = Max(maxl, kv.first);
+    if (top_k <= 0 || top_k >= (int) candidates.size()) {
+        return;
     }
 
-    // compute probs for the top k tokens
-    std::vector<float> probs;
-    probs.reserve(logits_id.size());
+    if (!sampler.sorted) {
+        std::partial_sort(
+                candidates.begin(),
+                candidates.begin() + top_k, candidates.end(),
+                [](const llama_sampler_candidate & a, const llama_sampler_candidate & b) {
+            return a.logit > b.logit;
+        });
+    }
 
-    double sum = 0.0;
-    for (const auto & kv : logits_id) {
-        const float p = expf(kv.first - maxl);
-        probs.push_back(p);
-        sum += p;
+    candidates.resize(top_k);
+
+    sampler.by_id  = false;
+    sampler.sorted = true;
+}
+
+static void llama_sampler_top_p(llama_sampler & sampler, float top_p) {
+    if (top_p >= 1.0f) {
+        return;
+    }
+
+    llama_sampler_softmax(sampler);
+
+    auto & candidates = sampler.candidates;
+
+    double cumsum = 0.0;
+    for (int i = 0; i < (int) candidates.size(); i++) {
+        cumsum += candidates[i].p;
+        if (cumsum >= top_p) {
+            candidates.resize(i + 1);
+            break;
+        }
     }
+}
 
-    // normalize the probs
-    for (auto & p : probs) {
-        p /= sum;
+// locally typical sampling (https://arxiv.org/abs/2202.00666)
+static void llama_sampler_typical(llama_sampler & sampler, float typical_p) {
+    if (typical_p >= 1.0f) {
+        return;
     }
 
-    if (top_p < 1.0) {
-        double cumsum = 0.0;
-        for (int i = 0; i < (int) probs.size(); i++) {
-            cumsum += probs[i];
-            if (cumsum >= top_p) {
-                probs.resize(i + 1);
-                logits_id.resize(i + 1);
-                break;
-            }
+    llama_sampler_softmax(sampler);
+
+    auto & candidates = sampler.candidates;
+
+    double entropy = 0.0;
+    for (const auto & c : candidates) {
+        if (c.p > 0.0f) {
+            entropy -= c.p*logf(c.p);
         }
+    }
+
+    // distance of each candidate's information content from the entropy
+    for (auto & c : candidates) {
+        c.key = c.p > 0.0f ? fabsf(-logf(c.p) - (float) entropy) : std::numeric_limits<float>::infinity();
+    }
 
-        cumsum = 1.0/cumsum;
-        for (int i = 0; i < (int) probs.size(); i++) {
-            probs[i] *= cumsum;
+    std::sort(candidates.begin(), candidates.end(),
+            [](const llama_sampler_candidate & a, const llama_sampler_candidate & b) {
+        return a.key < b.key;
+    });
+
+    double cumsum = 0.0;
+    for (int i = 0; i < (int) candidates.size(); i++) {
+        cumsum += candidates[i].p;
+        if (cumsum >= typical_p) {
+            candidates.resize(i + 1);
+            break;
         }
     }
 
-    //printf("\n");
-    //for (int i = 0; i < (int) 10; i++) {
-    //    printf("%d: '%s' %f\n", i, vocab.id_to_token.at(logits_id[i].second).c_str(), probs[i]);
-    //}
-    //printf("\n\n");
-    //exit(0);
+    sampler.by_id  = false;
+    sampler.sorted = false;
+}
+
+static void llama_sampler_min_p(llama_sampler & sampler, float min_p) {
+    if (min_p <= 0.0f) {
+        return;
+    }
+
+    llama_sampler_softmax(sampler);
+
+    auto & candidates = sampler.candidates;
+
+    const float threshold = candidates[0].p*min_p;
+
+    int n_keep = 1;
+    while (n_keep < (int) candidates.size() && candidates[n_keep].p >= threshold) {
+        n_keep++;
+    }
+
+    candidates.resize(n_keep);
+}
+
+static llama_vocab::id llama_sampler_run(
+        llama_context & lctx,
+        const llama_sampler_stage * stages,
+        int n_stages,
+        const llama_vocab::id * last_n_tokens,
+        int n_last) {
+    auto & sampler = lctx.sampler;
+
+    const int n_logits = lctx.model.hparams.n_vocab;
+
+    const auto & logits = lctx.logits;
+    const auto * plogits = logits.data() + logits.size() - n_logits;
+
+    llama_sampler_reset(sampler, plogits, n_logits);
+
+    for (int i = 0; i < n_stages; ++i) {
+        const auto & stage = stages[i];
+
+        switch (stage.type) {
+            case LLAMA_SAMPLER_REPEAT_PENALTY: llama_sampler_repeat_penalty(sampler, last_n_tokens, n_last, stage.value); break;
+            case LLAMA_SAMPLER_TEMP:           llama_sampler_temp   (sampler, stage.value);       break;
+            case LLAMA_SAMPLER_TOP_K:          llama_sampler_top_k  (sampler, (int) stage.value); break;
+            case LLAMA_SAMPLER_TOP_P:          llama_sampler_top_p  (sampler, stage.value);       break;
+            case LLAMA_SAMPLER_TYPICAL:        llama_sampler_typical(sampler, stage.value);       break;
+            case LLAMA_SAMPLER_MIN_P:          llama_sampler_min_p  (sampler, stage.value);       break;
+        }
+    }
+
+    auto & candidates = sampler.candidates;
+
+    if (candidates.size() == 1) {
+        return candidates[0].id;
+    }
+
+    // cutting candidates keeps the ratios of the remaining probabilities, so they are only renormalized here
+    if (!sampler.has_probs) {
+        float maxl = -std::numeric_limits<float>::infinity();
+        for (const auto & c : candidates) {
+            maxl = Max(maxl, c.logit);
+        }
+
+        for (auto & c : candidates) {
+            c.p = expf(c.logit - maxl);
+        }
+    }
+
+    // same draw as std::discrete_distribution, without allocating its tables
+    double sum = 0.0;
+    for (const auto & c : candidates) {
+        sum += c.p;
+    }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+    const double r = std::uniform_real_distribution<double>(0.0, 1.0)(lctx.rng);
 
-    return logits_id[idx].second;
+    double cumsum = 0.0;
+    for (const auto & c : candidates) {
+        cumsum += c.p/sum;
+        if (cumsum >= r) {
+            return c.id;
+        }
+    }
+
+    return candidates.back().id;
 }
 
 //
@@ -1570,87 +2471,211 @@ static bool llama_model_quantize_internal(const std::string & fname_inp, const s
 // interface implementation
 //
 
-struct llama_context * llama_init_from_file(
+struct llama_model * llama_load_model_from_file(
                              const char * path_model,
             struct llama_context_params   params) {
     ggml_time_init();
 
-    llama_context * ctx = new llama_context;
-
-    if (params.seed <= 0) {
-        params.seed = time(NULL);
-    }
-
-    ctx->rng = std::mt19937(params.seed);
-    ctx->logits_all = params.logits_all;
+    llama_model * model = new llama_model();
 
     ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
 
-    if (!llama_model_load(path_model, *ctx, params.n_ctx, params.n_parts, memory_type,
+    if (!llama_model_load(path_model, *model, params.n_ctx, params.n_parts, memory_type,
                           params.vocab_only, params.progress_callback,
                           params.progress_callback_user_data)) {
         fprintf(stderr, "%s: failed to load model\n", __func__);
-        llama_free(ctx);
+        llama_free_model(model);
         return nullptr;
     }
 
-    if (params.use_mlock) {
-        char *err;
-        if (!ggml_mlock(ctx->model.ctx,
-                        ctx->model.mm_addr,
-                        ctx->model.mm_length,
-                        &err)) {
-            fprintf(stderr, "%s\n", err);
-            free(err);
-            llama_free(ctx);
-            return nullptr;
-        }
+    if (params.use_mlock) {
+        char *err;
+        if (!ggml_mlock(model->ctx,
+                        model->mm_addr,
+                        model->mm_length,
+                        &err)) {
+            fprintf(stderr, "%s\n", err);
+            free(err);
+            llama_free_model(model);
+            return nullptr;
+        }
+    }
+
+    return model;
+}
+
+void llama_free_model(struct llama_model * model) {
+    if (model->ctx) {
+        ggml_free(model->ctx);
+    }
+
+    if (model->mm_addr) {
+        munmap_file(model->mm_addr, model->mm_length);
+    }
+
+    delete model;
+}
+
+struct llama_context * llama_new_context_with_model(
+                     struct llama_model * model,
+            struct llama_context_params   params) {
+    llama_context * ctx = new llama_context(*model);
+
+    if (params.seed <= 0) {
+        params.seed = time(NULL);
+    }
+
+    ctx->t_start_us = model->t_start_us;
+    ctx->t_load_us  = model->t_load_us;
+
+    ctx->rng = std::mt19937(params.seed);
+    ctx->logits_all = params.logits_all;
+    ctx->n_spin = params.n_spin;
+    ctx->flash_attn = params.flash_attn;
+
+    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    ggml_type k_type = memory_type;
+    ggml_type v_type = memory_type;
+    switch (params.kv_type) {
+        case LLAMA_KV_TYPE_DEFAULT: break;
+        case LLAMA_KV_TYPE_Q8_0: k_type = v_type = GGML_TYPE_Q8_0; break;
+        // K*Q would quantize the query to 4 bits as well, the keys stay at 8 bits
+        case LLAMA_KV_TYPE_Q4_0: k_type = GGML_TYPE_Q8_0; v_type = GGML_TYPE_Q4_0; break;
+        default:
+            {
+                fprintf(stderr, "%s: invalid kv_type %d\n", __func__, params.kv_type);
+                llama_free(ctx);
+                return nullptr;
+            }
     }
 
     // reserve memory for context buffers
     {
-        if (!kv_cache_init(ctx->model.hparams, ctx->model.kv_self, memory_type, ctx->model.hparams.n_ctx)) {
+        const auto & hparams = ctx->model.hparams;
+
+        // the quantized blocks must not cross heads, the q4_0 dot product works on pairs of blocks
+        const int n_head_embd = hparams.n_embd/hparams.n_head;
+        for (ggml_type type : { k_type, v_type }) {
+            if (ggml_blck_size(type) > 1 && n_head_embd % (2*ggml_blck_size(type)) != 0) {
+                fprintf(stderr, "%s: head size %d does not support a quantized KV cache\n", __func__, n_head_embd);
+                llama_free(ctx);
+                return nullptr;
+            }
+        }
+
+        // quantized blocks cannot be transposed, such a cache keeps its values as rows
+        const bool v_trans = params.v_trans && ggml_blck_size(v_type) == 1;
+
+        if (!kv_cache_init(hparams, ctx->kv_self, k_type, v_type, params.n_ctx, v_trans)) {
             fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
         {
-            const size_t memory_size = ggml_nbytes(ctx->model.kv_self.k) + ggml_nbytes(ctx->model.kv_self.v);
+            const size_t memory_size = ggml_nbytes(ctx->kv_self.k) + ggml_nbytes(ctx->kv_self.v);
             fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
         }
 
-        const auto & hparams = ctx->model.hparams;
+        const int n_ctx = ctx->kv_self.n_ctx;
 
         // resized during inference
         if (params.logits_all) {
-            ctx->logits.reserve(hparams.n_ctx*hparams.n_vocab);
+            ctx->logits.reserve(n_ctx*hparams.n_vocab);
         } else {
-            ctx->logits.reserve(hparams.n_ctx);
+            ctx->logits.reserve(n_ctx);
         }
 
         if (params.embedding){
             ctx->embedding.resize(hparams.n_embd);
         }
 
-        ctx->buf_compute.resize(MEM_REQ_EVAL.at(ctx->model.type));
+        ctx->sampler.stages.reserve(8);
+        ctx->sampler.candidates.reserve(hparams.n_vocab);
+        ctx->sampler.penalty_tokens.reserve(n_ctx);
+
+        ctx->n_batch       = Max(1, Min(params.n_batch, n_ctx));
+        ctx->n_threads_max = Max(Max(params.n_threads, 1), (int) std::thread::hardware_concurrency());
+
+        // every tensor grows with the batch and with the context, so the buffers fit any eval of at most
+        // n_batch tokens once they fit a full batch ending at the end of the context
+        // a vocab_only model has no weights to measure the graph with, its contexts only tokenize
+        if (!params.vocab_only) {
+            llama_context * lctxs[1] = { ctx };
+            const int n_tokens = ctx->n_batch;
+            const int n_past   = n_ctx - ctx->n_batch;
+
+            const llama_buf_sizes sizes = llama_measure_eval(lctxs, &n_tokens, &n_past, 1);
+
+            // room for the headers of any graph, the batches of llama_eval_batch() add attention tensors
+            ctx->buf_compute.resize(sizes.compute + ctx->buf_measure.size());
+            ctx->buf_alloc.resize(sizes.alloc);
+
+            fprintf(stderr, "%s: compute buffer = %7.2f MB, tensor arena = %7.2f MB (n_batch = %d)\n", __func__,
+                    ctx->buf_compute.size()/1024.0/1024.0, sizes.alloc/1024.0/1024.0, ctx->n_batch);
+        }
+
+        // the decode graph of the last bucket covers the whole context
+        ctx->n_graph_bucket = Max(0, params.n_graph_bucket);
+        if (ctx->n_graph_bucket > 0 && !params.vocab_only) {
+            llama_context * lctxs[1] = { ctx };
+            const int n_tokens = 1;
+            const int n_past   = n_ctx - 1;
+
+            llama_decode_graph & dg = ctx->decode_graph;
+
+            dg.n_kv = n_ctx;
+            const llama_buf_sizes sizes = llama_measure_eval(lctxs, &n_tokens, &n_past, 1, &dg);
+            dg.n_kv = 0;
+
+            dg.buf.resize(sizes.compute + sizes.headers);
+        }
+    }
+
+    if (params.n_threads > 1) {
+        ctx->threadpool = ggml_threadpool_new(params.n_threads);
+        if (!ctx->threadpool) {
+            fprintf(stderr, "%s: failed to create the compute thread pool\n", __func__);
+            llama_free(ctx);
+            return nullptr;
+        }
+    }
+
+    return ctx;
+}
+
+struct llama_context * llama_init_from_file(
+                             const char * path_model,
+            struct llama_context_params   params) {
+    llama_model * model = llama_load_model_from_file(path_model, params);
+    if (!model) {
+        return nullptr;
+    }
 
-        ctx->buf_scratch[0].resize(MEM_REQ_SCRATCH0.at(ctx->model.type));
-        ctx->buf_scratch[1].resize(MEM_REQ_SCRATCH1.at(ctx->model.type));
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    if (!ctx) {
+        llama_free_model(model);
+        return nullptr;
     }
 
+    ctx->model_owner = true;
+
     return ctx;
 }
 
 void llama_free(struct llama_context * ctx) {
-    kv_cache_free(ctx->model.kv_self);
+    ggml_threadpool_free(ctx->threadpool);
 
-    if (ctx->model.ctx) {
-        ggml_free(ctx->model.ctx);
+    llama_decode_graph_free(ctx->decode_graph);
+
+    kv_cache_free(ctx->kv_self);
+
+    if (ctx->kv_self.mm_addr) {
+        munmap_file(ctx->kv_self.mm_addr, ctx->kv_self.mm_length);
     }
 
-    if (ctx->model.mm_addr) {
-        munmap_file(ctx->model.mm_addr, ctx->model.mm_length);
+    if (ctx->model_owner) {
+        llama_free_model(&ctx->model);
     }
 
     delete ctx;
@@ -1674,7 +2699,7 @@ int llama_eval(
                          int   n_tokens,
                          int   n_past,
                          int   n_threads) {
-    if (!llama_eval_internal(*ctx, tokens, n_tokens, n_past, n_threads)) {
+    if (!llama_eval_internal(&ctx, tokens, &n_tokens, &n_past, 1, n_threads)) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return 1;
     }
@@ -1686,13 +2711,82 @@ int llama_eval(
     return 0;
 }
 
+int llama_eval_batch(
+        struct llama_context ** ctxs,
+           const llama_token  * tokens,
+                   const int  * n_tokens,
+                   const int  * n_past,
+                         int    n_ctxs,
+                         int    n_threads) {
+    for (int i = 0; i < n_ctxs; ++i) {
+        ctxs[i]->batch_evaluated = false;
+    }
+
+    bool aborted = false;
+
+    // the buffers of the first context of a group fit its own n_batch tokens, the attention of every other
+    // context adds to them, so the batch is split where the graph of the group stops fitting
+    for (int i0 = 0, i_tok = 0; i0 < n_ctxs; ) {
+        int n_group = 1;
+        int n_group_tokens = n_tokens[i0];
+
+        while (i0 + n_group < n_ctxs && n_group_tokens + n_tokens[i0 + n_group] <= ctxs[i0]->n_batch) {
+            const llama_buf_sizes sizes = llama_measure_eval(ctxs + i0, n_tokens + i0, n_past + i0, n_group + 1);
+            if (!llama_buf_sizes_fit(*ctxs[i0], sizes)) {
+                break;
+            }
+            n_group_tokens += n_tokens[i0 + n_group];
+            n_group++;
+        }
+
+        if (llama_eval_internal(ctxs + i0, tokens + i_tok, n_tokens + i0, n_past + i0, n_group, n_threads)) {
+            for (int i = i0; i < i0 + n_group; ++i) {
+                ctxs[i]->batch_evaluated = true;
+            }
+        } else if (ctxs[i0]->eval_aborted) {
+            // the next groups are evaluated unless their own contexts ask to stop too
+            aborted = true;
+        } else {
+            fprintf(stderr, "%s: failed to eval\n", __func__);
+            return 1;
+        }
+
+        i0    += n_group;
+        i_tok += n_group_tokens;
+    }
+
+    for (int i = 0; i < n_ctxs; ++i) {
+        if (ctxs[i]->batch_evaluated && !ctxs[i]->has_evaluated_once) {
+            ctxs[i]->t_load_us = ggml_time_us() - ctxs[i]->t_start_us;
+            ctxs[i]->has_evaluated_once = true;
+        }
+    }
+
+    return aborted ? 1 : 0;
+}
+
+bool llama_batch_evaluated(const struct llama_context * ctx) {
+    return ctx->batch_evaluated;
+}
+
+int llama_max_batch(struct llama_context * ctx, int n_past) {
+    return Max(1, Min(ctx->n_batch, ctx->kv_self.n_ctx - n_past));
+}
+
+void llama_set_abort_callback(struct llama_context * ctx, llama_abort_callback abort_callback, void * abort_callback_data) {
+    ctx->abort_callback      = abort_callback;
+    ctx->abort_callback_data = abort_callback_data;
+}
+
 int llama_tokenize(
         struct llama_context * ctx,
                   const char * text,
                  llama_token * tokens,
                          int   n_max_tokens,
                         bool   add_bos) {
-    auto res = llama_tokenize(ctx->vocab, text, add_bos);
+    llama_tokenize(ctx->vocab, ctx->tokenizer_scratch, text, strlen(text), add_bos);
+
+    const auto & res = ctx->tokenizer_scratch.output;
 
     if (n_max_tokens < (int) res.size()) {
         fprintf(stderr, "%s: too many tokens\n", __func__);
@@ -1706,12 +2800,88 @@ int llama_tokenize(
     return res.size();
 }
 
+void llama_numa_init(enum llama_numa_strategy strategy) {
+    ggml_numa_init((enum ggml_numa_strategy) strategy);
+}
+
+size_t llama_token_boundary(struct llama_context * ctx, const char * text, size_t size, size_t pos) {
+    while (pos < size && !ctx->vocab.can_split(text, pos)) {
+        ++pos;
+    }
+    return std::min(pos, size);
+}
+
+// below this many bytes per thread, starting the threads costs more than tokenizing
+static const size_t LLAMA_TOKENIZE_MIN_CHUNK = 16*1024;
+
+int llama_tokenize_parallel(
+        struct llama_context * ctx,
+                  const char * text,
+                 llama_token * tokens,
+                         int   n_max_tokens,
+                        bool   add_bos,
+                         int   n_threads) {
+    const size_t size = strlen(text);
+
+    n_threads = (int) std::min<size_t>(std::max(n_threads, 1), size / LLAMA_TOKENIZE_MIN_CHUNK);
+    if (n_threads <= 1) {
+        return llama_tokenize(ctx, text, tokens, n_max_tokens, add_bos);
+    }
+
+    // move every even split point forward to the next place where no token can cross
+    std::vector<size_t> bounds(1, 0);
+    for (int i = 1; i < n_threads; ++i) {
+        const size_t pos = llama_token_boundary(ctx, text, size, std::max(size*i/n_threads, bounds.back() + 1));
+        if (pos >= size) {
+            break;
+        }
+        bounds.push_back(pos);
+    }
+    bounds.push_back(size);
+
+    const int n_chunks = (int) bounds.size() - 1;
+    auto & chunks = ctx->tokenizer_chunks;
+    if ((int) chunks.size() < n_chunks) {
+        chunks.resize(n_chunks);
+    }
+
+    auto tokenize_chunk = [&](int i) {
+        llama_tokenize(ctx->vocab, chunks[i], text + bounds[i], bounds[i + 1] - bounds[i], add_bos && i == 0);
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_chunks; ++i) {
+        workers.emplace_back(tokenize_chunk, i);
+    }
+    tokenize_chunk(0);
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    size_t n_tokens = 0;
+    for (int i = 0; i < n_chunks; ++i) {
+        n_tokens += chunks[i].output.size();
+    }
+
+    if (n_max_tokens < (int) n_tokens) {
+        fprintf(stderr, "%s: too many tokens\n", __func__);
+        return -((int) n_tokens);
+    }
+
+    for (int i = 0; i < n_chunks; ++i) {
+        std::copy(chunks[i].output.begin(), chunks[i].output.end(), tokens);
+        tokens += chunks[i].output.size();
+    }
+
+    return n_tokens;
+}
+
 int llama_n_vocab(struct llama_context * ctx) {
     return ctx->vocab.id_to_token.size();
 }
 
 int llama_n_ctx(struct llama_context * ctx) {
-    return ctx->model.hparams.n_ctx;
+    return ctx->kv_self.n_ctx;
 }
 
 int llama_n_embd(struct llama_context * ctx) {
@@ -1726,6 +2896,315 @@ float * llama_get_embeddings(struct llama_context * ctx) {
     return ctx->embedding.data();
 }
 
+size_t llama_get_kv_cache_size(struct llama_context * ctx, int n_tokens) {
+    const auto & hparams = ctx->model.hparams;
+
+    LLAMA_ASSERT(n_tokens >= 0 && n_tokens <= ctx->kv_self.n_ctx);
+
+    return hparams.n_layer*n_tokens*(kv_cache_row_size(ctx->kv_self.k, hparams.n_embd) +
+                                     kv_cache_row_size(ctx->kv_self.v, hparams.n_embd));
+}
+
+size_t llama_copy_kv_cache(struct llama_context * ctx, uint8_t * dst, int n_tokens) {
+    LLAMA_ASSERT(n_tokens >= 0 && n_tokens <= ctx->kv_self.n_ctx);
+
+    return kv_cache_copy_prefix(ctx->model.hparams, ctx->kv_self, dst, nullptr, n_tokens);
+}
+
+size_t llama_set_kv_cache(struct llama_context * ctx, const uint8_t * src, int n_tokens) {
+    LLAMA_ASSERT(n_tokens >= 0 && n_tokens <= ctx->kv_self.n_ctx);
+
+    return kv_cache_copy_prefix(ctx->model.hparams, ctx->kv_self, nullptr, src, n_tokens);
+}
+
+void llama_kv_cache_shift(struct llama_context * ctx, int n_keep, int n_discard, int n_past) {
+    const auto & hparams = ctx->model.hparams;
+    auto & kv_self = ctx->kv_self;
+
+    LLAMA_ASSERT(n_keep >= 0 && n_discard >= 0 && n_keep + n_discard <= n_past && n_past <= kv_self.n_ctx);
+
+    if (n_discard == 0) {
+        return;
+    }
+
+    const int n_embd  = hparams.n_embd;
+    const int n_rot   = hparams.n_embd/hparams.n_head;
+    const int n_moved = n_past - n_keep - n_discard;
+
+    const size_t row_size   = kv_cache_row_size(kv_self.k, n_embd);
+    const size_t layer_size = row_size*kv_self.n_ctx;
+
+    for (int il = 0; il < hparams.n_layer; ++il) {
+        char * k = (char *) kv_self.k->data + il*layer_size;
+
+        memmove(k + n_keep*row_size, k + (n_keep + n_discard)*row_size, n_moved*row_size);
+
+        // the keys were rotated for their old positions
+        kv_cache_rope_shift(kv_self, k + n_keep*row_size, n_moved, n_embd, n_rot, -n_discard);
+    }
+
+    const llama_kv_runs v_runs = kv_cache_v_runs(kv_self, hparams);
+
+    for (int ir = 0; ir < v_runs.n; ++ir) {
+        char * v = (char *) kv_self.v->data + ir*v_runs.stride;
+
+        memmove(v + n_keep*v_runs.pos_size, v + (n_keep + n_discard)*v_runs.pos_size, n_moved*v_runs.pos_size);
+    }
+}
+
+//
+// session files
+//
+
+#define LLAMA_SESSION_ALIGN 4096
+
+static size_t session_align(size_t offs) {
+    return (offs + LLAMA_SESSION_ALIGN - 1) & ~(size_t)(LLAMA_SESSION_ALIGN - 1);
+}
+
+// copy a mapped session back into buf and release the mapping
+static void kv_cache_unmap(struct llama_kv_cache & cache) {
+    if (!cache.mm_addr) {
+        return;
+    }
+
+    memcpy(cache.k_data, cache.k->data, ggml_nbytes(cache.k));
+    memcpy(cache.v_data, cache.v->data, ggml_nbytes(cache.v));
+
+    cache.k->data = cache.k_data;
+    cache.v->data = cache.v_data;
+
+    munmap_file(cache.mm_addr, cache.mm_length);
+    cache.mm_addr = NULL;
+    cache.mm_length = 0;
+}
+
+int llama_save_session_file(
+        struct llama_context * ctx,
+                  const char * path_session,
+                         int   n_past,
+               const uint8_t * user_data,
+                      size_t   user_size) {
+    const auto & hparams = ctx->model.hparams;
+    auto & kv_self = ctx->kv_self;
+
+    LLAMA_ASSERT(n_past >= 0 && n_past <= kv_self.n_ctx);
+
+    // the file may be the one that is currently mapped
+    kv_cache_unmap(kv_self);
+
+    auto fout = std::ofstream(path_session, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, path_session);
+        return 1;
+    }
+
+    {
+        const uint32_t magic   = LLAMA_SESSION_MAGIC;
+        const uint32_t version = LLAMA_SESSION_VERSION;
+        const int32_t  k_type  = kv_self.k->type;
+        const int32_t  v_type  = kv_self.v->type;
+        const int32_t  v_trans = kv_self.v_trans;
+
+        fout.write((char *) &magic,           sizeof(magic));
+        fout.write((char *) &version,         sizeof(version));
+        fout.write((char *) &hparams.n_vocab, sizeof(hparams.n_vocab));
+        fout.write((char *) &kv_self.n_ctx,   sizeof(kv_self.n_ctx));
+        fout.write((char *) &hparams.n_embd,  sizeof(hparams.n_embd));
+        fout.write((char *) &hparams.n_layer, sizeof(hparams.n_layer));
+        fout.write((char *) &k_type,          sizeof(k_type));
+        fout.write((char *) &v_type,          sizeof(v_type));
+        fout.write((char *) &v_trans,         sizeof(v_trans));
+        fout.write((char *) &n_past,          sizeof(n_past));
+    }
+
+    // rng
+    {
+        std::stringstream rng_ss;
+        rng_ss << ctx->rng;
+
+        const std::string rng_str  = rng_ss.str();
+        const uint32_t    rng_size = rng_str.size();
+
+        fout.write((char *) &rng_size, sizeof(rng_size));
+        fout.write(rng_str.data(), rng_size);
+    }
+
+    // logits
+    {
+        const uint32_t n_logits = ctx->logits.size();
+
+        fout.write((char *) &n_logits, sizeof(n_logits));
+        fout.write((char *) ctx->logits.data(), n_logits*sizeof(float));
+    }
+
+    // user data
+    {
+        const uint64_t size = user_size;
+
+        fout.write((char *) &size, sizeof(size));
+        fout.write((const char *) user_data, user_size);
+    }
+
+    // keys and values, page aligned so they can be mapped in place
+    // only the first n_past positions of every layer (or row of transposed values) are written, the rest is left as a hole
+    {
+        const size_t row_size   = kv_cache_row_size(kv_self.k, hparams.n_embd);
+        const size_t layer_size = row_size*kv_self.n_ctx;
+        const size_t block_size = row_size*n_past;
+
+        const llama_kv_runs v_runs = kv_cache_v_runs(kv_self, hparams);
+
+        const size_t k_offs = session_align(fout.tellp());
+        const size_t v_offs = session_align(k_offs + ggml_nbytes(kv_self.k));
+        const size_t end    = v_offs + ggml_nbytes(kv_self.v);
+
+        for (int il = 0; il < hparams.n_layer; ++il) {
+            fout.seekp(k_offs + il*layer_size);
+            fout.write((char *) kv_self.k->data + il*layer_size, block_size);
+        }
+        for (int ir = 0; ir < v_runs.n; ++ir) {
+            fout.seekp(v_offs + ir*v_runs.stride);
+            fout.write((char *) kv_self.v->data + ir*v_runs.stride, v_runs.pos_size*n_past);
+        }
+
+        // extend the file to cover the whole mapping
+        fout.seekp(end - 1);
+        fout.put(0);
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, path_session);
+        return 1;
+    }
+
+    return 0;
+}
+
+int llama_load_session_file(
+        struct llama_context * ctx,
+                  const char * path_session,
+             const uint8_t  ** user_data,
+                      size_t * user_size) {
+    const auto & hparams = ctx->model.hparams;
+    auto & kv_self = ctx->kv_self;
+
+    auto fin = std::ifstream(path_session, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path_session);
+        return -1;
+    }
+
+    int32_t n_past = 0;
+    {
+        uint32_t magic   = 0;
+        uint32_t version = 0;
+        llama_hparams file_hparams;
+        int32_t k_type  = -1;
+        int32_t v_type  = -1;
+        int32_t v_trans = -1;
+
+        fin.read((char *) &magic,                sizeof(magic));
+        fin.read((char *) &version,              sizeof(version));
+        fin.read((char *) &file_hparams.n_vocab, sizeof(file_hparams.n_vocab));
+        fin.read((char *) &file_hparams.n_ctx,   sizeof(file_hparams.n_ctx));
+        fin.read((char *) &file_hparams.n_embd,  sizeof(file_hparams.n_embd));
+        fin.read((char *) &file_hparams.n_layer, sizeof(file_hparams.n_layer));
+        fin.read((char *) &k_type,               sizeof(k_type));
+        fin.read((char *) &v_type,               sizeof(v_type));
+        fin.read((char *) &v_trans,              sizeof(v_trans));
+        fin.read((char *) &n_past,               sizeof(n_past));
+
+        if (!fin || magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
+            fprintf(stderr, "%s: invalid session file '%s'\n", __func__, path_session);
+            return -1;
+        }
+
+        if (file_hparams.n_vocab != hparams.n_vocab || file_hparams.n_ctx   != kv_self.n_ctx ||
+            file_hparams.n_embd  != hparams.n_embd  || file_hparams.n_layer != hparams.n_layer ||
+            k_type != kv_self.k->type || v_type != kv_self.v->type || v_trans != kv_self.v_trans || n_past < 0 || n_past > kv_self.n_ctx) {
+            fprintf(stderr, "%s: session file '%s' does not match the model or the context parameters\n", __func__, path_session);
+            return -1;
+        }
+    }
+
+    std::string rng_str;
+    {
+        uint32_t rng_size = 0;
+        fin.read((char *) &rng_size, sizeof(rng_size));
+        rng_str.resize(rng_size);
+        fin.read(&rng_str[0], rng_size);
+    }
+
+    std::vector<float> logits;
+    {
+        uint32_t n_logits = 0;
+        fin.read((char *) &n_logits, sizeof(n_logits));
+        if (n_logits > (uint32_t) kv_self.n_ctx*hparams.n_vocab) {
+            fprintf(stderr, "%s: invalid session file '%s'\n", __func__, path_session);
+            return -1;
+        }
+        logits.resize(n_logits);
+        fin.read((char *) logits.data(), n_logits*sizeof(float));
+    }
+
+    uint64_t user_offs = 0;
+    uint64_t user_len  = 0;
+    {
+        fin.read((char *) &user_len, sizeof(user_len));
+        user_offs = fin.tellg();
+        fin.seekg(user_offs + user_len);
+    }
+
+    const size_t k_offs = session_align(user_offs + user_len);
+    const size_t v_offs = session_align(k_offs + ggml_nbytes(kv_self.k));
+    const size_t end    = v_offs + ggml_nbytes(kv_self.v);
+
+    if (!fin) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, path_session);
+        return -1;
+    }
+    fin.close();
+
+    uint64_t mm_length = 0;
+    void * mm_addr = mmap_file(path_session, &mm_length, true);
+    if (!mm_addr) {
+        fprintf(stderr, "%s: failed to mmap '%s'\n", __func__, path_session);
+        return -1;
+    }
+    if (mm_length < end) {
+        fprintf(stderr, "%s: session file '%s' is truncated\n", __func__, path_session);
+        munmap_file(mm_addr, mm_length);
+        return -1;
+    }
+
+    // replace the previous session, if any
+    if (kv_self.mm_addr) {
+        munmap_file(kv_self.mm_addr, kv_self.mm_length);
+    }
+    kv_self.mm_addr   = mm_addr;
+    kv_self.mm_length = mm_length;
+
+    kv_self.k->data = (char *) mm_addr + k_offs;
+    kv_self.v->data = (char *) mm_addr + v_offs;
+
+    {
+        std::istringstream rng_ss(rng_str);
+        rng_ss >> ctx->rng;
+    }
+
+    ctx->logits = std::move(logits);
+
+    if (user_data) {
+        *user_data = (const uint8_t *) mm_addr + user_offs;
+    }
+    if (user_size) {
+        *user_size = user_len;
+    }
+
+    return n_past;
+}
+
 const char * llama_token_to_str(struct llama_context * ctx, llama_token token) {
     if (token >= llama_n_vocab(ctx)) {
         return nullptr;
@@ -1752,18 +3231,44 @@ llama_token llama_sample_top_p_top_k(
                   float   repeat_penalty) {
     const int64_t t_start_sample_us = ggml_time_us();
 
-    llama_token result = 0;
+    const llama_sampler_stage stages[] = {
+        { LLAMA_SAMPLER_TEMP,           temp                },
+        { LLAMA_SAMPLER_REPEAT_PENALTY, repeat_penalty      },
+        { LLAMA_SAMPLER_TOP_K,          (float) top_k       },
+        { LLAMA_SAMPLER_TOP_P,          top_p               },
+    };
+
+    const llama_token result = llama_sampler_run(
+            *ctx,
+            stages, sizeof(stages)/sizeof(stages[0]),
+            last_n_tokens_data, last_n_tokens_size);
+
+    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    ctx->n_sample++;
+
+    return result;
+}
+
+void llama_sampler_clear(struct llama_context * ctx) {
+    ctx->sampler.stages.clear();
+}
+
+void llama_sampler_add(struct llama_context * ctx, struct llama_sampler_stage stage) {
+    ctx->sampler.stages.push_back(stage);
+}
+
+llama_token llama_sample(
+          llama_context * ctx,
+      const llama_token * last_n_tokens_data,
+                    int   last_n_tokens_size) {
+    const int64_t t_start_sample_us = ggml_time_us();
 
-    // TODO: avoid this ...
-    const auto last_n_tokens = std::vector<llama_token>(last_n_tokens_data, last_n_tokens_data + last_n_tokens_size);
+    const auto & stages = ctx->sampler.stages;
 
-    result = llama_sample_top_p_top_k(
+    const llama_token result = llama_sampler_run(
             *ctx,
-            last_n_tokens,
-            top_k,
-            top_p,
-            temp,
-            repeat_penalty);
+            stages.data(), stages.size(),
+            last_n_tokens_data, last_n_tokens_size);
 
     ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
     ctx->n_sample++;
@@ -1787,6 +3292,19 @@ void llama_print_timings(struct llama_context * ctx) {
     fprintf(stderr, "%s:       total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0);
 }
 
+double llama_get_prompt_eval_ms_per_token(struct llama_context * ctx) {
+    return ctx->n_p_eval > 0 ? 1e-3 * ctx->t_p_eval_us / ctx->n_p_eval : 0.0;
+}
+
+struct llama_mem_stats llama_get_mem_stats(struct llama_context * ctx) {
+    struct llama_mem_stats stats = {
+        /*.compute_size =*/ ctx->buf_compute.size(),
+        /*.arena_size   =*/ ctx->buf_alloc.size(),
+        /*.arena_peak   =*/ ctx->alloc_peak,
+    };
+    return stats;
+}
+
 void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_start_us = ggml_time_us();
     ctx->t_sample_us = ctx->n_sample = 0;
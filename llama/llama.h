@@ -22,6 +22,8 @@
 #define LLAMA_FILE_VERSION 1
 #define LLAMA_FILE_MAGIC 0x67676a74 // 'ggjt' in hex
 #define LLAMA_FILE_MAGIC_UNVERSIONED 0x67676d6c // pre-versioned files
+#define LLAMA_SESSION_MAGIC 0x6767736e // 'ggsn' in hex
+#define LLAMA_SESSION_VERSION 3
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,6 +35,7 @@ extern "C" {
     // TODO: show sample usage
     //
 
+    struct llama_model;
     struct llama_context;
 
     typedef int llama_token;
@@ -47,12 +50,28 @@ extern "C" {
 
     typedef void (*llama_progress_callback)(float progress, void *ctx);
 
+    typedef bool (*llama_abort_callback)(void * data);
+
+    enum llama_kv_type {
+        LLAMA_KV_TYPE_DEFAULT = 0, // F16 or F32, see f16_kv
+        LLAMA_KV_TYPE_Q8_0    = 1, // 8-bit blocks, about half the size of F16
+        LLAMA_KV_TYPE_Q4_0    = 2, // 4-bit values and 8-bit keys, about 45% of the size of F16, lower quality
+    };
+
     struct llama_context_params {
-        int n_ctx;   // text context
-        int n_parts; // -1 for default
-        int seed;    // RNG seed, 0 for random
+        int n_ctx;     // text context
+        int n_parts;   // -1 for default
+        int seed;      // RNG seed, 0 for random
+        int n_threads; // size of the persistent compute thread pool, 0 to create the threads on every llama_eval()
+        int n_spin;    // busy-wait iterations before an idle compute thread sleeps, 0 for the ggml default, -1 to never sleep
+        int n_batch;   // most tokens of a llama_eval(), the compute buffers are sized for it
+        int n_graph_bucket; // > 0 to reuse the graph of the single token evals for this many positions, see llama_eval()
+
+        enum llama_kv_type kv_type; // quantize the KV cache, the head size must be a multiple of 64
 
         bool f16_kv;     // use fp16 for KV cache
+        bool flash_attn; // fused attention without the scores in memory, F16 and F32 KV caches only
+        bool v_trans;    // cache the values transposed so no eval copies them, F16 and F32 KV caches only
         bool logits_all; // the llama_eval() call computes all logits, not just the last one
         bool vocab_only; // only load the vocabulary, no weights
         bool use_mlock;  // force system to keep model in RAM
@@ -66,6 +85,16 @@ extern "C" {
 
     LLAMA_API struct llama_context_params llama_context_default_params();
 
+    enum llama_numa_strategy {
+        LLAMA_NUMA_DISABLED   = 0,
+        LLAMA_NUMA_DISTRIBUTE = 1, // the rows of each weight go to the node of the threads computing them
+        LLAMA_NUMA_INTERLEAVE = 2, // the pages of the weights are spread over all the nodes
+    };
+
+    // Detect the NUMA nodes the process can run on, to be called before the model is loaded.
+    // With more than one node, the weights are placed and the compute threads pinned by node.
+    LLAMA_API void llama_numa_init(enum llama_numa_strategy strategy);
+
     // Various functions for loading a ggml llama model.
     // Allocate (almost) all memory needed for the model.
     // Return NULL on failure
@@ -73,7 +102,25 @@ extern "C" {
                              const char * path_model,
             struct llama_context_params   params);
 
+    // Load the weights and the vocabulary only, to be shared by several contexts.
+    // Only n_parts, vocab_only, use_mlock and the progress callback of params are used.
+    // Return NULL on failure
+    LLAMA_API struct llama_model * llama_load_model_from_file(
+                             const char * path_model,
+            struct llama_context_params   params);
+
+    // The model must outlive all the contexts created with it
+    LLAMA_API void llama_free_model(struct llama_model * model);
+
+    // Create a context with its own KV cache, logits, compute buffers and RNG on a loaded model.
+    // Contexts sharing a model can be evaluated from different threads at the same time.
+    // Return NULL on failure
+    LLAMA_API struct llama_context * llama_new_context_with_model(
+                     struct llama_model * model,
+            struct llama_context_params   params);
+
     // Frees all allocated memory
+    // The model is freed too when the context was created by llama_init_from_file()
     LLAMA_API void llama_free(struct llama_context * ctx);
 
     // TODO: not great API - very likely to change
@@ -86,7 +133,11 @@ extern "C" {
     // Run the llama inference to obtain the logits and probabilities for the next token.
     // tokens + n_tokens is the provided batch of new tokens to process
     // n_past is the number of tokens to use from previous eval calls
-    // Returns 0 on success
+    // n_tokens larger than the n_batch of the context params fail
+    // n_threads larger than the size of the context's thread pool fall back to creating the threads for this call
+    // with n_graph_bucket > 0, a single token reuses the graph built for the n_graph_bucket positions from
+    // n_past rounded down, the attention also covers the positions after n_past, masked
+    // Returns 0 on success, non-zero on failure or when the abort callback stopped the evaluation
     LLAMA_API int llama_eval(
             struct llama_context * ctx,
                const llama_token * tokens,
@@ -94,10 +145,42 @@ extern "C" {
                              int   n_past,
                              int   n_threads);
 
+    // Evaluate n_ctxs contexts created with the same model in one pass, so the weights are read once for all
+    // of them instead of once per context. Context i continues from n_past[i] with n_tokens[i] tokens, the
+    // tokens of all the contexts are stored one context after the other. Every context gets its own logits.
+    // The contexts are evaluated in groups that fit the compute buffers of the first context of the group, whose
+    // thread pool is used too, a context must appear only once. A group stops when the abort callback of one of
+    // its contexts returns true, the other groups are still evaluated.
+    // Returns 0 on success, non-zero on failure or when an abort callback stopped a group
+    LLAMA_API int llama_eval_batch(
+            struct llama_context ** ctxs,
+               const llama_token  * tokens,
+                       const int  * n_tokens,
+                       const int  * n_past,
+                             int    n_ctxs,
+                             int    n_threads);
+
+    // Whether the group of the context was evaluated by the last llama_eval_batch(), after an abort the contexts
+    // of the other groups have their logits and KV cache up to date and only the stopped ones must be evaluated again
+    LLAMA_API bool llama_batch_evaluated(const struct llama_context * ctx);
+
+    // Largest number of tokens a llama_eval() of the context continuing from n_past fits in the compute and
+    // scratch buffers: n_batch, or what is left of the context
+    LLAMA_API int llama_max_batch(struct llama_context * ctx, int n_past);
+
+    // Called by the thread running llama_eval() between the operations of the graph, typically to check a flag
+    // set by another thread. When it returns true the evaluation stops early and fails, the logits are not updated and the KV cache
+    // positions from n_past on must be evaluated again. Pass NULL to disable.
+    LLAMA_API void llama_set_abort_callback(
+            struct llama_context * ctx,
+            llama_abort_callback   abort_callback,
+                            void * abort_callback_data);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
     // Returns a negative number on failure - the number of tokens that would have been returned
+    // Can be called while another thread runs llama_eval() on the same context.
     // TODO: not sure if correct
     LLAMA_API int llama_tokenize(
             struct llama_context * ctx,
@@ -106,6 +189,25 @@ extern "C" {
                              int   n_max_tokens,
                             bool   add_bos);
 
+    // Same tokens as llama_tokenize(), for large texts the text is split at spaces and newlines that no token
+    // of the vocabulary can cross and the pieces are tokenized on up to n_threads threads.
+    LLAMA_API int llama_tokenize_parallel(
+            struct llama_context * ctx,
+                      const char * text,
+                     llama_token * tokens,
+                             int   n_max_tokens,
+                            bool   add_bos,
+                             int   n_threads);
+
+    // The first position from pos on where the text of size bytes can be cut without changing the tokens, the
+    // tokens of text[0, cut) followed by those of text[cut, size) are the tokens of the whole text.
+    // Returns size when there is none.
+    LLAMA_API size_t llama_token_boundary(
+            struct llama_context * ctx,
+                      const char * text,
+                            size_t   size,
+                            size_t   pos);
+
     LLAMA_API int llama_n_vocab(struct llama_context * ctx);
     LLAMA_API int llama_n_ctx  (struct llama_context * ctx);
     LLAMA_API int llama_n_embd (struct llama_context * ctx);
@@ -121,6 +223,49 @@ extern "C" {
     // shape: [n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings(struct llama_context * ctx);
 
+    // Snapshot of the keys and values of the first n_tokens positions of the KV cache
+    // Restoring it makes the next llama_eval() continue as if those tokens had just been evaluated,
+    // with n_past = n_tokens
+    // Returns the size in bytes of a snapshot of n_tokens positions
+    LLAMA_API size_t llama_get_kv_cache_size(struct llama_context * ctx, int n_tokens);
+
+    // Copies the first n_tokens positions of the KV cache to dst
+    // dst must hold llama_get_kv_cache_size(ctx, n_tokens) bytes
+    // Returns the number of bytes written
+    LLAMA_API size_t llama_copy_kv_cache(struct llama_context * ctx, uint8_t * dst, int n_tokens);
+
+    // Restores a snapshot made by llama_copy_kv_cache() with the same model, KV cache type and v_trans
+    // Returns the number of bytes read
+    LLAMA_API size_t llama_set_kv_cache(struct llama_context * ctx, const uint8_t * src, int n_tokens);
+
+    // Drop the n_discard positions that follow the first n_keep ones and move the positions up to n_past down
+    // to fill the gap. The cached keys are re-rotated to their new positions, so the next llama_eval() can
+    // continue with n_past - n_discard without evaluating the moved tokens again.
+    LLAMA_API void llama_kv_cache_shift(struct llama_context * ctx, int n_keep, int n_discard, int n_past);
+
+    // Session files
+    //
+    // Save the dynamic state of the context: the RNG, the last logits and the first n_past positions of the
+    // KV cache, together with an opaque user blob for the bookkeeping of the application.
+    // Returns 0 on success
+    LLAMA_API int llama_save_session_file(
+            struct llama_context * ctx,
+                      const char * path_session,
+                             int   n_past,
+                   const uint8_t * user_data,
+                          size_t   user_size);
+
+    // Load a session file saved with the same model, n_ctx, KV cache type and v_trans.
+    // The KV cache is mapped copy-on-write from the file instead of being read, so the file is not modified
+    // by the following llama_eval() calls. *user_data points into the mapping and stays valid until the next
+    // session is loaded or the context is freed.
+    // Returns n_past on success, a negative number on failure
+    LLAMA_API int llama_load_session_file(
+            struct llama_context * ctx,
+                      const char * path_session,
+                 const uint8_t  ** user_data,
+                          size_t * user_size);
+
     // Token Id -> String. Uses the vocabulary in the provided context
     LLAMA_API const char * llama_token_to_str(struct llama_context * ctx, llama_token token);
 
@@ -128,6 +273,35 @@ extern "C" {
     LLAMA_API llama_token llama_token_bos();
     LLAMA_API llama_token llama_token_eos();
 
+    // Sampler chain
+    //
+    // The stages are applied in order to the logits of the last llama_eval(), then a token is drawn from
+    // the remaining candidates. They work on candidate buffers owned by the context, so sampling does not
+    // allocate memory. A stage whose value disables it (top_k <= 0, top_p >= 1, ...) is a no-op.
+    enum llama_sampler_type {
+        LLAMA_SAMPLER_REPEAT_PENALTY = 0, // value: penalty for the tokens in last_n_tokens
+        LLAMA_SAMPLER_TEMP           = 1, // value: temperature, <= 0 for greedy sampling
+        LLAMA_SAMPLER_TOP_K          = 2, // value: number of candidates to keep
+        LLAMA_SAMPLER_TOP_P          = 3, // value: cumulative probability of the candidates to keep
+        LLAMA_SAMPLER_TYPICAL        = 4, // value: probability mass of the locally typical candidates to keep
+        LLAMA_SAMPLER_MIN_P          = 5, // value: minimum probability relative to the most likely candidate
+    };
+
+    typedef struct llama_sampler_stage {
+        enum llama_sampler_type type;
+        float value;
+    } llama_sampler_stage;
+
+    LLAMA_API void llama_sampler_clear(struct llama_context * ctx);
+    LLAMA_API void llama_sampler_add  (struct llama_context * ctx, struct llama_sampler_stage stage);
+
+    // Sample the next token with the context's sampler chain
+    LLAMA_API llama_token llama_sample(
+       struct llama_context * ctx,
+          const llama_token * last_n_tokens_data,
+                        int   last_n_tokens_size);
+
+    // Fixed chain: temperature, repetition penalty, top-k, top-p
     // TODO: improve the last_n_tokens interface ?
     LLAMA_API llama_token llama_sample_top_p_top_k(
        struct llama_context * ctx,
@@ -142,6 +316,19 @@ extern "C" {
     LLAMA_API void llama_print_timings(struct llama_context * ctx);
     LLAMA_API void llama_reset_timings(struct llama_context * ctx);
 
+    // Average time per token of the evals of more than one token since the last reset, 0 before the first one
+    // A context evaluated with others by llama_eval_batch() is charged the time of the whole batch
+    LLAMA_API double llama_get_prompt_eval_ms_per_token(struct llama_context * ctx);
+
+    // Memory used to evaluate the model
+    struct llama_mem_stats {
+        size_t compute_size; // buffer of the graph: tensor headers, inputs and work buffer
+        size_t arena_size;   // buffer of the intermediate tensors, sized for n_batch tokens at the end of the context
+        size_t arena_peak;   // most of the arena the intermediate tensors of one eval used at once so far
+    };
+
+    LLAMA_API struct llama_mem_stats llama_get_mem_stats(struct llama_context * ctx);
+
     // Print system information
     LLAMA_API const char * llama_print_system_info(void);
 
@@ -7,14 +7,24 @@ MainWindow::MainWindow(QWidget *parent)
 {
     ui->setupUi(this);
     ui->sendMessageButton->setEnabled(false);
+    ui->stopMessageButton->setEnabled(false);
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(16);
+    connect(&m_flushTimer, &QTimer::timeout, this, &MainWindow::flush_label);
     runner = new Runner(this);
-    connect(runner, &Runner::botTalk, this, &MainWindow::set_label);
+    connect(runner, &Runner::botTalk, this, [this](int session, const QString &token){if(session == m_session) this->set_label(token);});
+    connect(runner, &Runner::botTalk, ui->statusbar, [this](int session){if(session == m_session) ui->statusbar->clearMessage();});
+    connect(runner, &Runner::botReading, ui->statusbar, [this](int session, int percent){if(session == m_session) ui->statusbar->showMessage(tr("Reading the message... %1%").arg(percent));});
     connect(runner, &Runner::botWaitting, this, &MainWindow::disableSendMessageButton);
+    connect(runner, &Runner::botWaitting, ui->stopMessageButton, [this]{ui->stopMessageButton->setEnabled(true);});
     connect(runner, &Runner::botEnd, this, &MainWindow::enableSendMessageButton);
+    // after botEnd, which clears the status bar
+    connect(runner, &Runner::botFailed, ui->statusbar, [this](int session, const QString &reason){if(session == m_session) ui->statusbar->showMessage(reason);});
     dia = new modelsetting(this);
     connect(dia, &modelsetting::loadModel, runner, &Runner::loadModel);
     connect(dia, &modelsetting::unloadModel, runner, &Runner::unloadModel);
     connect(dia, &modelsetting::unloadModel, this, &MainWindow::disableSendMessageButton);
+    connect(dia, &modelsetting::unloadModel, ui->stopMessageButton, [this]{ui->stopMessageButton->setEnabled(false);});
     connect(runner, &Runner::loadModelPercent, dia, &modelsetting::updateModelPercent);
     connect(runner, &Runner::loadModelStatus, dia, &modelsetting::updateloadStatus);
     connect(runner, &Runner::loadModelStatus, [this](bool successed, const QString){if(successed) this->enableSendMessageButton();});
@@ -37,15 +47,34 @@ void MainWindow::on_action_LoadModel_triggered()
 void MainWindow::on_sendMessageButton_clicked()
 {
     auto sendbuf = ui->sendMessageTextEdit->toPlainText();
-    emit runner->sendMessage(sendbuf);
+    emit runner->sendMessage(m_session, sendbuf);
     ui->sendMessageTextEdit->clear();
     set_label(QString("\nUser: %1\nChatLLaMa:").arg(sendbuf));
 }
 
+void MainWindow::on_stopMessageButton_clicked()
+{
+    emit runner->stopMessage(m_session);
+}
+
 void MainWindow::set_label(const QString &token)
 {
-    QString txt = ui->chatMeaasge->toPlainText() + token;
-    ui->chatMeaasge->setPlainText(txt);
+    // tokens arriving within a frame are appended together
+    m_pending += token;
+    if(!m_flushTimer.isActive())
+        m_flushTimer.start();
+}
+
+void MainWindow::flush_label()
+{
+    m_flushTimer.stop();
+    if(m_pending.isEmpty())
+        return;
+    // insert at the end of the document instead of rebuilding the whole transcript
+    QTextCursor cursor(ui->chatMeaasge->document());
+    cursor.movePosition(QTextCursor::End);
+    cursor.insertText(m_pending);
+    m_pending.clear();
     ui->chatMeaasge->moveCursor(QTextCursor::End);
 }
 
@@ -56,6 +85,9 @@ void MainWindow::disableSendMessageButton()
 
 void MainWindow::enableSendMessageButton()
 {
+    flush_label();
+    ui->statusbar->clearMessage();
     ui->sendMessageButton->setEnabled(true);
+    ui->stopMessageButton->setEnabled(false);
 }
 
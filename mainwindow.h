@@ -2,6 +2,7 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QTimer>
 #include "runner.h"
 #include "modelsetting.h"
 
@@ -22,8 +23,12 @@ private slots:
 
     void on_sendMessageButton_clicked();
 
+    void on_stopMessageButton_clicked();
+
     void set_label(const QString &token);
 
+    void flush_label();
+
     void disableSendMessageButton();
 
     void enableSendMessageButton();
@@ -32,5 +37,8 @@ private:
     Ui::MainWindow *ui;
     Runner *runner;
     modelsetting *dia;
+    int m_session = 0; // the runner can serve several chats, the window shows one
+    QString m_pending; // text not yet appended to the chat
+    QTimer m_flushTimer; // appends the pending text at most once per frame
 };
 #endif // MAINWINDOW_H
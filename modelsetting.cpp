@@ -18,7 +18,8 @@ modelsetting::~modelsetting()
 void modelsetting::showEvent(QShowEvent *e)
 {
     ui->seed->setValidator(new QIntValidator(-1,INT_MAX,ui->seed));
-    ui->batch_size->setValidator(new QIntValidator(1,INT_MAX,ui->batch_size));
+    // 0 picks the batch size for every eval
+    ui->batch_size->setValidator(new QIntValidator(0,INT_MAX,ui->batch_size));
     ui->top_k->setValidator(new QIntValidator(1,INT_MAX,ui->top_k));
     ui->top_p->setValidator(new QDoubleValidator(0.0f,1.0f,3,ui->top_p));
     QDialog::showEvent(e);
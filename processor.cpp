@@ -1,23 +1,154 @@
+#include <QElapsedTimer>
 #include <QFile>
+#include <QMap>
+#include <QVector>
+#include <QMetaObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSet>
+#include <atomic>
 #include "processor.h"
 
+// the sampled text is converted and sent at most once per frame of the chat window
+static const qint64 output_interval_ms = 16;
+
 class Processor::InternalData
 {
 public:
-    bool chat_init_status = false;
-    session_env_t env;
+    ~InternalData();
+    struct Session
+    {
+        bool chat_init_status = false;
+        bool generating = false; // waiting for a step of the scheduler
+        std::atomic<bool> stop{false}; // aborts the evals of this session only
+        InternalData *data = nullptr;
+        session_env_t env;
+    };
+
+    // created on the first message, sessions share the weights of model_env
+    Session* session(int id);
+    // return true when a message of the session was still in progress
+    bool closeSession(int id);
+    void closeAllSessions();
+
+    model_env_t model_env;
+    // changed with stop_mutex held, handleStopMessage() looks the sessions up from another thread
+    QMap<int, QSharedPointer<Session>> sessions;
+    bool step_scheduled = false;
+    QElapsedTimer output_timer; // since the sampled text was last sent
+
+    // stop requests from other threads, applied between the steps
+    QMutex stop_mutex;
+    QSet<int> stop_sessions;
+    std::atomic<bool> preempt{false}; // aborts the evals of every session
+    bool in_step = false; // only the evals of a generate step are aborted
+    QSet<int> takeStopRequests();
+    bool abortRequested();
+    static bool abortCallback(void *data);
 };
 
+Processor::InternalData::~InternalData()
+{
+    closeAllSessions();
+    ::unload_model(&model_env);
+}
+
+// a stopped session cancels the eval group it is in, the other groups of the step are evaluated
+bool Processor::InternalData::abortCallback(void *data)
+{
+    Session *s = (Session*)data;
+    return s->data->in_step && (s->stop.load(std::memory_order_relaxed) || s->data->preempt.load(std::memory_order_relaxed));
+}
+
+Processor::InternalData::Session* Processor::InternalData::session(int id)
+{
+    auto it = sessions.find(id);
+    if(it != sessions.end())
+        return it.value().data();
+    if(!model_env.model)
+        return nullptr;
+    QSharedPointer<Session> session(new Session());
+    session->data = this;
+    if(!::new_session(&session->env, &model_env, abortCallback, session.data()))
+        return nullptr;
+    QMutexLocker locker(&stop_mutex);
+    sessions.insert(id, session);
+    return session.data();
+}
+
+bool Processor::InternalData::closeSession(int id)
+{
+    QSharedPointer<Session> session;
+    {
+        QMutexLocker locker(&stop_mutex);
+        session = sessions.take(id);
+    }
+    if(!session)
+        return false;
+    ::free_session(&session->env);
+    return session->generating;
+}
+
+void Processor::InternalData::closeAllSessions()
+{
+    QMap<int, QSharedPointer<Session>> closed;
+    {
+        QMutexLocker locker(&stop_mutex);
+        closed.swap(sessions);
+    }
+    for(auto it = closed.begin(); it != closed.end(); ++it)
+        ::free_session(&it.value()->env);
+}
+
+QSet<int> Processor::InternalData::takeStopRequests()
+{
+    QMutexLocker locker(&stop_mutex);
+    QSet<int> stopped;
+    stopped.swap(stop_sessions);
+    for(int id : stopped)
+    {
+        auto it = sessions.constFind(id);
+        if(it != sessions.constEnd())
+            it.value()->stop = false;
+    }
+    preempt = false;
+    return stopped;
+}
+
+bool Processor::InternalData::abortRequested()
+{
+    QMutexLocker locker(&stop_mutex);
+    return preempt || !stop_sessions.isEmpty();
+}
+
 Processor::Processor(QObject *parent) : QObject(parent)
 {
     Q_UNUSED(parent)
     qRegisterMetaType<gpt_params>();
     m_data = QSharedPointer<InternalData>(new InternalData());
+    m_data->output_timer.start();
+}
+
+// the messages in progress are dropped with their sessions, the window waiting for them is told they ended
+void Processor::closeAllSessions()
+{
+    m_data->takeStopRequests();
+    const QList<int> ids = m_data->sessions.keys();
+    for(int id : ids)
+    {
+        InternalData::Session *s = m_data->sessions.value(id).data();
+        if(s->generating)
+            sendOutput(id, &s->env);
+        if(m_data->closeSession(id))
+            emit tokenConsumed(id);
+    }
 }
 
 void Processor::handleLoadModel(const gpt_params &params)
 {
-    bool success = ::load_model(&m_data->env,params,updateLoadProgress,this);
+    closeAllSessions();
+    ::unload_model(&m_data->model_env);
+    bool success = ::load_model(&m_data->model_env,params,updateLoadProgress,this);
     if(success)
     {
        emit modelLoadSuccessed();
@@ -30,25 +161,208 @@ void Processor::handleLoadModel(const gpt_params &params)
 
 void Processor::handleUnloadModel()
 {
-    ::unload_model(&m_data->env);
+    closeAllSessions();
+    ::unload_model(&m_data->model_env);
     emit modelUnloaded();
 }
 
-void Processor::handleEvalToken(const QString &prompt)
+void Processor::handleEvalToken(int session, const QString &prompt)
 {
-    emit tokenRemaining();
-    if(!m_data->chat_init_status)
+    emit tokenRemaining(session);
+    {
+        // a stop that arrived before this message was meant for the previous one
+        QMutexLocker locker(&m_data->stop_mutex);
+        m_data->stop_sessions.remove(session);
+        auto it = m_data->sessions.constFind(session);
+        if(it != m_data->sessions.constEnd())
+            it.value()->stop = false;
+    }
+    InternalData::Session *s = m_data->session(session);
+    if(!s)
+    {
+        emit tokenConsumed(session);
+        return;
+    }
+    if(!s->chat_init_status)
+    {
+        if(!::init_chat_env(&s->env))
+        {
+            emit tokenConsumed(session);
+            emit generateFailed(session, "Failed to evaluate the prompt");
+            return;
+        }
+        s->chat_init_status=true;
+    }
+    ::init_user_input(&s->env, prompt);
+    if(!::should_generate(&s->env))
     {
-        ::init_chat_env(&m_data->env);
-        m_data->chat_init_status=true;
+        emit tokenConsumed(session);
+        return;
     }
-    ::init_user_input(&m_data->env, prompt);
-    while(::should_generate(&m_data->env))
+    s->generating = true;
+    scheduleGenerateStep();
+}
+
+// one step generates a token for every session that has a message in progress, the messages
+// that arrive in between join the next step
+void Processor::scheduleGenerateStep()
+{
+    if(m_data->step_scheduled)
+        return;
+    m_data->step_scheduled = true;
+    QMetaObject::invokeMethod(this, "handleGenerateStep", Qt::QueuedConnection);
+}
+
+void Processor::handleGenerateStep()
+{
+    m_data->step_scheduled = false;
+    applyStopRequests();
+
+    QVector<int> ids;
+    QVector<InternalData::Session*> sessions;
+    QVector<session_env_t*> envs;
+    for(auto it = m_data->sessions.begin(); it != m_data->sessions.end(); ++it)
+    {
+        if(it.value()->generating)
+        {
+            ids.push_back(it.key());
+            sessions.push_back(it.value().data());
+            envs.push_back(&it.value()->env);
+        }
+    }
+    if(envs.isEmpty())
+        return;
+
+    m_data->in_step = true;
+    bool success = ::generate_tokens(envs.data(), envs.size());
+    m_data->in_step = false;
+    const bool aborted = !success && m_data->abortRequested();
+    // an aborted step is run again by the sessions that were not stopped, after the queued events, the sessions
+    // whose eval group was not stopped only sample then
+    if(!success && !aborted)
+    {
+        // the eval would fail again, the messages of the step end here
+        for(int i=0;i<ids.size();i++)
+        {
+            ::drop_user_input(envs[i]);
+            sessions[i]->generating = false;
+            sendOutput(ids[i], envs[i]);
+            emit tokenConsumed(ids[i]);
+            emit generateFailed(ids[i], "Failed to evaluate the message");
+        }
+    }
+    if(success)
+    {
+        // the text of the steps within a frame is converted at once, the end of a message sends the rest
+        const bool send_output = m_data->output_timer.hasExpired(output_interval_ms);
+        if(send_output)
+            m_data->output_timer.restart();
+        for(int i=0;i<ids.size();i++)
+        {
+            const int progress = ::input_progress(envs[i]);
+            if(progress >= 0)
+                emit inputProgress(ids[i], progress);
+            const bool done = !::should_generate(envs[i]);
+            if(send_output || done)
+                sendOutput(ids[i], envs[i]);
+            if(done)
+            {
+                sessions[i]->generating = false;
+                emit tokenConsumed(ids[i]);
+            }
+        }
+    }
+    applyStopRequests();
+    scheduleGenerateStep();
+}
+
+void Processor::applyStopRequests()
+{
+    QSet<int> stop_sessions = m_data->takeStopRequests();
+    if(stop_sessions.isEmpty())
+        return;
+    for(auto it = m_data->sessions.begin(); it != m_data->sessions.end(); ++it)
+    {
+        if(it.value()->generating && stop_sessions.contains(it.key()))
+        {
+            // the unread rest of the message is not evaluated before the next one
+            ::drop_user_input(&it.value()->env);
+            it.value()->generating = false;
+            sendOutput(it.key(), &it.value()->env);
+            emit tokenConsumed(it.key());
+        }
+    }
+}
+
+void Processor::sendOutput(int session, session_env_t *env)
+{
+    QString text;
+    ::take_output(env, text);
+    if(!text.isEmpty())
+        emit tokenSampled(session, text);
+}
+
+void Processor::handleStopMessage(int session)
+{
+    QMutexLocker locker(&m_data->stop_mutex);
+    m_data->stop_sessions.insert(session);
+    auto it = m_data->sessions.constFind(session);
+    if(it != m_data->sessions.constEnd())
+        it.value()->stop = true;
+}
+
+// the aborted step is run again after the events queued in the meantime
+void Processor::handlePreempt()
+{
+    m_data->preempt = true;
+}
+
+void Processor::handleCloseSession(int session)
+{
+    if(m_data->closeSession(session))
+        emit tokenConsumed(session);
+}
+
+void Processor::handleSaveSession(int session, const QString &path)
+{
+    auto it = m_data->sessions.find(session);
+    if(it == m_data->sessions.end() || !it.value()->chat_init_status)
+    {
+        emit sessionSaveFailed(session, "Nothing to save");
+        return;
+    }
+    if(::save_session(&it.value()->env, path))
+    {
+        emit sessionSaved(session);
+    }
+    else
+    {
+        emit sessionSaveFailed(session, "Failed to write session file");
+    }
+}
+
+void Processor::handleLoadSession(int session, const QString &path)
+{
+    InternalData::Session *s = m_data->session(session);
+    if(!s)
+    {
+        emit sessionLoadFailed(session, "No model loaded");
+        return;
+    }
+    if(s->generating)
+    {
+        emit sessionLoadFailed(session, "Session is busy");
+        return;
+    }
+    if(::load_session(&s->env, path))
+    {
+        s->chat_init_status=true;
+        emit sessionLoaded(session);
+    }
+    else
     {
-        QString result = ::generate_token(&m_data->env);
-        emit tokenSampled(result);
+        emit sessionLoadFailed(session, "Failed to load session file");
     }
-    emit tokenConsumed();
 }
 
 void Processor::updateLoadProgress(float progress, void *ctx)
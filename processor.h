@@ -18,15 +18,33 @@ signals:
     void modelLoadSuccessed();
     void modelLoadFailed(const QString &reason);
     void modelUnloaded();
-    void tokenRemaining();
-    void tokenSampled(const QString &token);
-    void tokenConsumed();
+    void tokenRemaining(int session);
+    void inputProgress(int session, int percent);
+    void tokenSampled(int session, const QString &token);
+    void tokenConsumed(int session);
+    void generateFailed(int session, const QString &reason);
+    void sessionSaved(int session);
+    void sessionSaveFailed(int session, const QString &reason);
+    void sessionLoaded(int session);
+    void sessionLoadFailed(int session, const QString &reason);
 
 public slots:
     void handleLoadModel(const gpt_params &params);
     void handleUnloadModel();
-    void handleEvalToken(const QString &prompt);
+    void handleEvalToken(int session, const QString &prompt);
+    void handleCloseSession(int session);
+    void handleSaveSession(int session, const QString &path);
+    void handleLoadSession(int session, const QString &path);
+    // thread safe, connect them with Qt::DirectConnection to interrupt a running step
+    void handleStopMessage(int session);
+    void handlePreempt();
+private slots:
+    void handleGenerateStep();
 private:
+    void scheduleGenerateStep();
+    void applyStopRequests();
+    void sendOutput(int session, session_env_t *env);
+    void closeAllSessions();
     static void updateLoadProgress(float progress, void *ctx);
 private:
     class InternalData;
@@ -5,28 +5,43 @@ Runner::Runner(QObject *parent) : QObject(parent)
 {
     Q_UNUSED(parent)
     Processor *processor = new Processor();
+    m_processor = processor;
     processor->moveToThread(&m_thread);
     connect(&m_thread, &QThread::finished, processor, &QObject::deleteLater);
     connect(this, &Runner::loadModel, processor, &Processor::handleLoadModel);
     connect(this, &Runner::unloadModel, processor, &Processor::handleUnloadModel);
     connect(this, &Runner::sendMessage, processor, &Processor::handleEvalToken);
+    connect(this, &Runner::closeSession, processor, &Processor::handleCloseSession);
+    connect(this, &Runner::saveSession, processor, &Processor::handleSaveSession);
+    connect(this, &Runner::loadSession, processor, &Processor::handleLoadSession);
+    // the worker thread is busy while generating, the stop requests must not wait in its queue
+    connect(this, &Runner::stopMessage, processor, &Processor::handleStopMessage, Qt::DirectConnection);
+    connect(this, &Runner::unloadModel, processor, &Processor::handlePreempt, Qt::DirectConnection);
+    connect(this, &Runner::loadModel, processor, &Processor::handlePreempt, Qt::DirectConnection);
 
     connect(processor, &Processor::modelLoading, this, &Runner::handleModelLoading);
     connect(processor, &Processor::modelLoadFailed, this, &Runner::handleModelLoadFailed);
     connect(processor, &Processor::modelLoadSuccessed, this, &Runner::handleModelLoadSuccessed);
     connect(processor, &Processor::modelUnloaded, this, &Runner::handleModelUnloaded);
     connect(processor, &Processor::tokenRemaining, this, &Runner::handleTokenRemaining);
+    connect(processor, &Processor::inputProgress, this, &Runner::handleInputProgress);
     connect(processor, &Processor::tokenSampled, this, &Runner::handleTokenSampled);
     connect(processor, &Processor::tokenConsumed, this, &Runner::handleTokenConsumed);
+    connect(processor, &Processor::generateFailed, this, &Runner::handleGenerateFailed);
+    connect(processor, &Processor::sessionSaved, this, &Runner::handleSessionSaved);
+    connect(processor, &Processor::sessionSaveFailed, this, &Runner::handleSessionSaveFailed);
+    connect(processor, &Processor::sessionLoaded, this, &Runner::handleSessionLoaded);
+    connect(processor, &Processor::sessionLoadFailed, this, &Runner::handleSessionLoadFailed);
 
     m_thread.start();
 }
 
 Runner::~Runner()
 {
-    m_thread.terminate();
-    //m_thread.quit();
-    //m_thread.wait();
+    // abort the running step, the processor frees the sessions and the model when the thread finishes
+    m_processor->handlePreempt();
+    m_thread.quit();
+    m_thread.wait();
 }
 
 void Runner::handleModelLoading(int percent)
@@ -49,17 +64,47 @@ void Runner::handleModelUnloaded()
     emit resetModelStatus();
 }
 
-void Runner::handleTokenRemaining()
+void Runner::handleTokenRemaining(int session)
 {
-    emit botWaitting();
+    emit botWaitting(session);
 }
 
-void Runner::handleTokenSampled(const QString &token)
+void Runner::handleInputProgress(int session, int percent)
 {
-    emit botTalk(token);
+    emit botReading(session, percent);
 }
 
-void Runner::handleTokenConsumed()
+void Runner::handleTokenSampled(int session, const QString &token)
 {
-    emit botEnd();
+    emit botTalk(session, token);
+}
+
+void Runner::handleTokenConsumed(int session)
+{
+    emit botEnd(session);
+}
+
+void Runner::handleGenerateFailed(int session, const QString &reason)
+{
+    emit botFailed(session, reason);
+}
+
+void Runner::handleSessionSaved(int session)
+{
+    emit saveSessionStatus(session, true, "Success!");
+}
+
+void Runner::handleSessionSaveFailed(int session, const QString &reason)
+{
+    emit saveSessionStatus(session, false, reason);
+}
+
+void Runner::handleSessionLoaded(int session)
+{
+    emit loadSessionStatus(session, true, "Success!");
+}
+
+void Runner::handleSessionLoadFailed(int session, const QString &reason)
+{
+    emit loadSessionStatus(session, false, reason);
 }
@@ -6,6 +6,8 @@
 #include <QString>
 #include "common.h"
 
+class Processor;
+
 class Runner : public QObject
 {
     Q_OBJECT
@@ -16,30 +18,45 @@ public:
 signals: //recv from gui
     void loadModel(const gpt_params &params);
     void unloadModel();
-    void sendMessage(const QString &prompt);
+    void sendMessage(int session, const QString &prompt);
+    void closeSession(int session);
+    void stopMessage(int session);
+    void saveSession(int session, const QString &path);
+    void loadSession(int session, const QString &path);
 
 signals: //send to gui
     void loadModelPercent(int percent);
     void loadModelStatus(bool successed,const QString &reason);
     void resetModelStatus();
-    void botWaitting();
-    void botTalk(const QString &token);
-    void botEnd();
+    void botWaitting(int session);
+    void botReading(int session, int percent);
+    void botTalk(int session, const QString &token);
+    void botEnd(int session);
+    void botFailed(int session, const QString &reason);
+    void saveSessionStatus(int session, bool successed,const QString &reason);
+    void loadSessionStatus(int session, bool successed,const QString &reason);
 
 private slots:
     void handleModelLoading(int percent);
     void handleModelLoadSuccessed();
     void handleModelLoadFailed(const QString &reason);
     void handleModelUnloaded();
-    void handleTokenRemaining();
-    void handleTokenSampled(const QString &token);
-    void handleTokenConsumed();
+    void handleTokenRemaining(int session);
+    void handleInputProgress(int session, int percent);
+    void handleTokenSampled(int session, const QString &token);
+    void handleTokenConsumed(int session);
+    void handleGenerateFailed(int session, const QString &reason);
+    void handleSessionSaved(int session);
+    void handleSessionSaveFailed(int session, const QString &reason);
+    void handleSessionLoaded(int session);
+    void handleSessionLoadFailed(int session, const QString &reason);
 private:
    Runner(const Runner&) = delete;
    Runner& operator=(const Runner&) = delete;
 
 private:
     QThread m_thread;
+    Processor *m_processor;
 };
 
 #endif // RUNNER_H
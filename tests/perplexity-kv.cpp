@@ -0,0 +1,178 @@
+// perplexity of a text with each KV cache type, the predictions of the quantized caches must stay close to
+// those of the F16 one
+//
+//     perplexity-kv MODEL [TEXT_FILE]
+//
+// the text is evaluated in windows of n_ctx tokens, the second half of every window is scored. The perplexity
+// can move either way with the rounding, the KL divergence from the F16 predictions is what is checked.
+#include "llama.h"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static const int n_ctx     = 128;
+static const int n_windows = 4;
+
+// used without TEXT_FILE
+static const char * default_text =
+    " The quick brown fox jumps over the lazy dog. A language model assigns a probability to every"
+    " token that may follow the text it has read so far, and the perplexity of a text is the exponential"
+    " of the average negative log probability of its tokens. The keys and the values of the tokens read"
+    " so far are kept in a cache, so that every new token only has to attend to them instead of reading"
+    " the whole text again. Storing that cache with fewer bits saves memory, at the cost of some rounding"
+    " in the attention. This test measures how much of the quality of the predictions that rounding costs,"
+    " by comparing the perplexity of the same text with each of the cache types.\n";
+
+struct kv_config {
+    const char *  name;
+    llama_kv_type kv_type;
+    bool          f16_kv;
+    double        max_kl; // mean KL divergence from the F16 predictions
+};
+
+struct kv_result {
+    double ppl = -1;
+    double kl  = 0;
+    std::vector<float> log_probs; // of every scored position
+};
+
+// log_probs of the reference, empty for the reference itself
+static kv_result evaluate(llama_model * model, const kv_config & config, const std::vector<llama_token> & tokens,
+                          const std::vector<float> & ref_log_probs) {
+    kv_result result;
+
+    auto params = llama_context_default_params();
+    params.n_ctx      = n_ctx;
+    params.n_batch    = n_ctx;
+    params.seed       = 1;
+    params.kv_type    = config.kv_type;
+    params.f16_kv     = config.f16_kv;
+    params.logits_all = true;
+
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    if (ctx == NULL) {
+        return result;
+    }
+
+    const int n_vocab = llama_n_vocab(ctx);
+    const int n_threads = 4;
+
+    double nll = 0;
+    double kl = 0;
+    int count = 0;
+    for (int w = 0; w < n_windows; w++) {
+        if (llama_eval(ctx, tokens.data() + w*n_ctx, n_ctx, 0, n_threads)) {
+            llama_free(ctx);
+            return result;
+        }
+
+        const float * logits = llama_get_logits(ctx);
+        for (int i = n_ctx/2; i < n_ctx - 1; i++) {
+            const float * row = logits + i*n_vocab;
+            float max = row[0];
+            for (int j = 1; j < n_vocab; j++) {
+                max = std::max(max, row[j]);
+            }
+            double sum = 0;
+            for (int j = 0; j < n_vocab; j++) {
+                sum += exp(row[j] - max);
+            }
+            const double log_sum = max + log(sum);
+
+            const size_t offs = result.log_probs.size();
+            for (int j = 0; j < n_vocab; j++) {
+                result.log_probs.push_back(row[j] - log_sum);
+            }
+            if (!ref_log_probs.empty()) {
+                for (int j = 0; j < n_vocab; j++) {
+                    const double ref = ref_log_probs[offs + j];
+                    kl += exp(ref)*(ref - result.log_probs[offs + j]);
+                }
+            }
+
+            nll += -result.log_probs[offs + tokens[w*n_ctx + i + 1]];
+            count++;
+        }
+    }
+
+    llama_free(ctx);
+
+    result.ppl = exp(nll/count);
+    result.kl  = kl/count;
+    return result;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MODEL [TEXT_FILE]\n", argv[0]);
+        return 1;
+    }
+
+    std::string text = default_text;
+    if (argc > 2) {
+        std::ifstream file(argv[2]);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        text = " " + buffer.str();
+    }
+
+    auto params = llama_context_default_params();
+    llama_model * model = llama_load_model_from_file(argv[1], params);
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, argv[1]);
+        return 1;
+    }
+
+    std::vector<llama_token> tokens;
+    {
+        llama_context * ctx = llama_new_context_with_model(model, params);
+        if (ctx == NULL) {
+            llama_free_model(model);
+            return 1;
+        }
+        std::vector<llama_token> text_tokens(text.size() + 1);
+        text_tokens.resize(llama_tokenize(ctx, text.c_str(), text_tokens.data(), text_tokens.size(), true));
+        llama_free(ctx);
+
+        // a short text is repeated to fill the windows
+        while ((int) tokens.size() < n_windows*n_ctx && !text_tokens.empty()) {
+            tokens.insert(tokens.end(), text_tokens.begin(), text_tokens.end());
+        }
+        tokens.resize(n_windows*n_ctx);
+    }
+
+    // the first one is the reference
+    const kv_config configs[] = {
+        { "f16",  LLAMA_KV_TYPE_DEFAULT, true,  0     },
+        { "f32",  LLAMA_KV_TYPE_DEFAULT, false, 1e-4  },
+        { "q8_0", LLAMA_KV_TYPE_Q8_0,    true,  2e-3  },
+        { "q4_0", LLAMA_KV_TYPE_Q4_0,    true,  1e-1  }, // 4-bit values, the keys are Q8_0
+    };
+
+    int n_failed = 0;
+    std::vector<float> ref_log_probs;
+    double ref_ppl = 0;
+    for (const kv_config & config : configs) {
+        kv_result result = evaluate(model, config, tokens, ref_log_probs);
+        if (result.ppl < 0) {
+            fprintf(stderr, "%s: %s: the eval failed\n", __func__, config.name);
+            return 1;
+        }
+        if (ref_log_probs.empty()) {
+            ref_log_probs = std::move(result.log_probs);
+            ref_ppl = result.ppl;
+        }
+        const bool ok = result.kl <= config.max_kl;
+        printf("%s: %-4s perplexity %10.4f (%+6.2f%%), KL divergence from f16 %.6f%s\n", __func__,
+               config.name, result.ppl, 100*(result.ppl/ref_ppl - 1), result.kl, ok ? "" : ", TOO FAR");
+        n_failed += !ok;
+    }
+
+    llama_free_model(model);
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+// ggml_flash_attn_past() against the unfused attention of llama_build_graph():
+// mul_mat, scale, diag_mask_inf, soft_max and mul_mat with the transposed values
+#include "ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// the unfused path rounds the soft_max to F16 with an F16 cache, the fused one keeps it in F32
+static const double max_error_f32 = 1e-6;
+static const double max_error_f16 = 1e-3;
+
+static float frand(void) {
+    return (float) rand()/RAND_MAX*2.0f - 1.0f;
+}
+
+static void fill(struct ggml_tensor * t) {
+    const int n = ggml_nelements(t);
+    for (int i = 0; i < n; i++) {
+        if (t->type == GGML_TYPE_F32) {
+            ((float *) t->data)[i] = frand()*2;
+        } else {
+            ((ggml_fp16_t *) t->data)[i] = ggml_fp32_to_fp16(frand()*2);
+        }
+    }
+}
+
+// D: head size, H: heads, N: queries, M: cached positions, the keys after n_past + i are masked for query i
+static double max_error(enum ggml_type type, int D, int H, int N, int n_past, int M, bool v_trans, int n_threads) {
+    struct ggml_init_params params = { 256*1024*1024, NULL, false };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * q    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, D, H, N);
+    struct ggml_tensor * kmem = ggml_new_tensor_3d(ctx, type, D, H, M);
+    struct ggml_tensor * vmem = ggml_new_tensor_3d(ctx, type, D, H, M);
+    fill(q);
+    fill(kmem);
+    fill(vmem);
+
+    struct ggml_tensor * Q = ggml_permute(ctx, q, 0, 2, 1, 3);
+    struct ggml_tensor * K = ggml_permute(ctx, kmem, 0, 2, 1, 3);
+    struct ggml_tensor * V_trans = ggml_cpy(ctx,
+            ggml_permute(ctx, vmem, 1, 2, 0, 3),
+            ggml_new_tensor_3d(ctx, type, M, D, H));
+
+    struct ggml_tensor * KQ = ggml_mul_mat(ctx, K, Q);
+    KQ = ggml_scale(ctx, KQ, ggml_new_f32(ctx, 1.0f/sqrtf(D)));
+    KQ = ggml_diag_mask_inf(ctx, KQ, n_past);
+    KQ = ggml_soft_max(ctx, KQ);
+    struct ggml_tensor * ref = ggml_mul_mat(ctx, V_trans, KQ);
+
+    struct ggml_tensor * V = v_trans ? V_trans : ggml_permute(ctx, vmem, 0, 2, 1, 3);
+    struct ggml_tensor * out = ggml_flash_attn_past(ctx, Q, K, V, n_past, v_trans);
+
+    struct ggml_cgraph gf = ggml_build_forward(ref);
+    ggml_build_forward_expand(&gf, out);
+    gf.n_threads = n_threads;
+    ggml_graph_compute(ctx, &gf);
+
+    double error = 0;
+    for (int i = 0; i < ggml_nelements(ref); i++) {
+        const double d = fabs(((float *) ref->data)[i] - ((float *) out->data)[i]);
+        if (!(d <= error)) {
+            error = d;
+        }
+    }
+
+    ggml_free(ctx);
+    return error;
+}
+
+int main(void) {
+    // D, H, N, n_past, M
+    static const int cases[][5] = {
+        {  64, 4, 1,   0,   1 },
+        {  64, 4, 1,   9,  10 },
+        {  64, 4, 1,   9,  32 }, // decode within a bucket of positions, the last 22 keys are masked
+        {  64, 4, 7,   0,   7 },
+        {  64, 4, 7,  20,  27 },
+        { 128, 2, 5,  30,  64 },
+        {  64, 8, 1,  63,  64 },
+        {  80, 3, 3,   5,  13 },
+        {  64, 4, 8, 100, 128 },
+    };
+
+    srand(1);
+
+    double worst[2] = { 0, 0 };
+    int n_failed = 0;
+    for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); c++) {
+        for (int f16 = 0; f16 < 2; f16++) {
+            for (int v_trans = 0; v_trans < 2; v_trans++) {
+                for (int n_threads = 1; n_threads <= 3; n_threads += 2) {
+                    const int * p = cases[c];
+                    const double error = max_error(f16 ? GGML_TYPE_F16 : GGML_TYPE_F32, p[0], p[1], p[2], p[3], p[4], v_trans, n_threads);
+                    const double max = f16 ? max_error_f16 : max_error_f32;
+                    if (!(error <= worst[f16])) {
+                        worst[f16] = error;
+                    }
+                    if (!(error <= max)) {
+                        fprintf(stderr, "%s: D = %d, H = %d, N = %d, n_past = %d, M = %d, %s, v_trans = %d, n_threads = %d: error %g > %g\n",
+                                __func__, p[0], p[1], p[2], p[3], p[4], f16 ? "f16" : "f32", v_trans, n_threads, error, max);
+                        n_failed++;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%s: worst error f32 %g, f16 %g\n", __func__, worst[0], worst[1]);
+    return n_failed == 0 ? 0 : 1;
+}
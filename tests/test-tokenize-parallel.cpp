@@ -0,0 +1,103 @@
+// llama_tokenize_parallel() must give the tokens of llama_tokenize() for any text and thread count
+#include "llama.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+// LLAMA_TOKENIZE_MIN_CHUNK of llama.cpp, the texts below it are not split
+static const size_t min_chunk = 16*1024;
+
+static const size_t corpus_size = 2*1024*1024;
+
+// the split points of the tokenizer are at spaces and newlines, so they get runs of them, and multibyte
+// text on both sides
+static std::string make_corpus(size_t size) {
+    static const char * pieces[] = {
+        " the", " cat", "Hello", " world", "th", "e", "ab", "x", ".", ",",
+        " ", "  ", "   ", "        ", "\n", "\n\n", "\n   \n", " \n", "\t",
+        "é", "ü", "ñ", " café", "中文", "日本語のテキスト", " 한국어", "😀", " 🚀🚀", "\xe2\x80\x94",
+    };
+    const int n_pieces = sizeof(pieces)/sizeof(pieces[0]);
+
+    std::string text;
+    text.reserve(size + 64);
+    srand(1);
+    while (text.size() < size) {
+        text += pieces[rand() % n_pieces];
+    }
+    return text;
+}
+
+static std::vector<llama_token> tokenize(llama_context * ctx, const std::string & text, int n_threads) {
+    std::vector<llama_token> tokens(text.size() + 1);
+    const int n = n_threads > 0
+        ? llama_tokenize_parallel(ctx, text.c_str(), tokens.data(), tokens.size(), true, n_threads)
+        : llama_tokenize(ctx, text.c_str(), tokens.data(), tokens.size(), true);
+    tokens.resize(n < 0 ? 0 : n);
+    return tokens;
+}
+
+static double ms_since(std::chrono::steady_clock::time_point t_start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MODEL\n", argv[0]);
+        return 1;
+    }
+
+    auto params = llama_context_default_params();
+    params.vocab_only = true;
+
+    llama_context * ctx = llama_init_from_file(argv[1], params);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const int n_threads_max = std::max(4, (int) std::thread::hardware_concurrency());
+    const std::string corpus = make_corpus(corpus_size);
+
+    int n_failed = 0;
+
+    // the whole corpus, the time of each thread count against llama_tokenize()
+    const std::vector<llama_token> expected = tokenize(ctx, corpus, 0);
+    const auto t_start = std::chrono::steady_clock::now();
+    tokenize(ctx, corpus, 0); // the first call grows the buffers of the tokenizer
+    const double t_serial = ms_since(t_start);
+    printf("%s: %zu bytes, %zu tokens, llama_tokenize %.1f ms\n", __func__, corpus.size(), expected.size(), t_serial);
+
+    for (int n_threads = 1; n_threads <= n_threads_max; n_threads++) {
+        const auto t_start = std::chrono::steady_clock::now();
+        const std::vector<llama_token> tokens = tokenize(ctx, corpus, n_threads);
+        const double t = ms_since(t_start);
+        const bool same = tokens == expected;
+        printf("%s: n_threads = %d: %.1f ms, speedup %.2f%s\n", __func__, n_threads, t, t_serial/t, same ? "" : ", DIFFERENT TOKENS");
+        n_failed += !same;
+    }
+
+    // the texts around the sizes where one more thread is used, the split points move through the pieces
+    for (size_t k = 2; k <= 4; k++) {
+        for (size_t offset = 0; offset < 64; offset += 13) {
+            for (int d = -3; d <= 3; d++) {
+                const std::string text = corpus.substr(offset, k*min_chunk + d);
+                const std::vector<llama_token> expected = tokenize(ctx, text, 0);
+                for (int n_threads = 2; n_threads <= (int) k + 1; n_threads++) {
+                    if (tokenize(ctx, text, n_threads) != expected) {
+                        fprintf(stderr, "%s: different tokens for %zu bytes from %zu with %d threads\n", __func__, text.size(), offset, n_threads);
+                        n_failed++;
+                    }
+                }
+            }
+        }
+    }
+
+    llama_free(ctx);
+
+    return n_failed == 0 ? 0 : 1;
+}